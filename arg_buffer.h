@@ -0,0 +1,281 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+namespace cpplog {
+
+namespace internal {
+
+/**
+ * @brief      A compact, binary copy of the arguments to a log message.
+ *
+ * @details    Arguments are stored as a type tag followed by their raw bytes,
+ *             so capturing them is just a few memcpy()s. Formatting them into
+ *             text is left until the message is emitted (i.e. on the emitter
+ *             thread in async mode).
+ *
+ *             Small argument lists are stored inline; larger ones (e.g. long
+ *             strings) spill into a single heap allocation.
+ *
+ *             Types which aren't numbers, pointers or strings are converted to
+ *             a string with operator<< when captured.
+ */
+class ArgBuffer {
+ public:
+  /**
+   * The type tag stored before each argument.
+   */
+  enum Type : uint8_t { BOOL, CHAR, INT, UINT, DOUBLE, STRING, POINTER, FLOAT };
+
+  /**
+   * The number of bytes stored inline, before spilling to the heap.
+   */
+  static constexpr std::size_t kInlineSize = 64;
+
+  ArgBuffer() : size_(0), capacity_(kInlineSize), n_args_(0) {}
+
+  ArgBuffer(ArgBuffer&& other) noexcept { *this = std::move(other); }
+
+  ArgBuffer& operator=(ArgBuffer&& other) noexcept {
+    size_ = other.size_;
+    capacity_ = other.capacity_;
+    n_args_ = other.n_args_;
+    heap_ = std::move(other.heap_);
+    if (heap_ == nullptr) {
+      std::memcpy(inline_, other.inline_, size_);
+    }
+
+    other.size_ = 0;
+    other.capacity_ = kInlineSize;
+    other.n_args_ = 0;
+    return *this;
+  }
+
+  /**
+   * @brief      Capture some arguments, appending them to the buffer.
+   */
+  void Add() {}
+
+  template <typename T, typename... Rest>
+  void Add(const T& arg, const Rest&... rest) {
+    _Add(arg);
+    Add(rest...);
+  }
+
+  /**
+   * @brief      Append the arguments captured by another buffer.
+   */
+  void Append(const ArgBuffer& other) {
+    _Reserve(other.size_);
+    std::memcpy(_Data() + size_, other._Data(), other.size_);
+    size_ += other.size_;
+    n_args_ += other.n_args_;
+  }
+
+  /**
+   * @brief      The number of arguments captured.
+   */
+  std::size_t size() const { return n_args_; }
+
+  /**
+   * @brief      Whether or not any arguments were captured.
+   */
+  bool empty() const { return n_args_ == 0; }
+
+  /**
+   * @brief      The encoded arguments (e.g. for writing to a binary log). See
+   *             Visit() for how to decode them.
+   */
+  const char* data() const { return _Data(); }
+
+  /**
+   * @brief      The length of data().
+   */
+  std::size_t data_size() const { return size_; }
+
+  /**
+   * @brief      Replace the arguments with some previously encoded ones (i.e.
+   *             the data() of another buffer).
+   *
+   * @param[in]  data    The encoded arguments.
+   * @param[in]  length  The length of `data`.
+   * @param[in]  n_args  The number of arguments encoded in `data`.
+   */
+  void Assign(const char* data, std::size_t length, std::size_t n_args) {
+    size_ = 0;
+    _Reserve(length);
+    std::memcpy(_Data(), data, length);
+    size_ = length;
+    n_args_ = n_args;
+  }
+
+  /**
+   * @brief      Decode each argument in order, calling the matching overload
+   *             of `visitor`:
+   *
+   *             - visitor(bool), visitor(char)
+   *             - visitor(int64_t), visitor(uint64_t), visitor(double)
+   *             - visitor(float), which a visitor without that overload
+   *               receives as a double
+   *             - visitor(const char* data, std::size_t length)
+   *             - visitor(const void*)
+   */
+  template <typename Visitor>
+  void Visit(Visitor& visitor) const {
+    const char* data = _Data();
+    const char* end = data + size_;
+    while (data < end) {
+      auto type = static_cast<Type>(*data++);
+      switch (type) {
+        case BOOL:
+          visitor(*data != 0);
+          data += 1;
+          break;
+        case CHAR:
+          visitor(*data);
+          data += 1;
+          break;
+        case INT:
+          visitor(_Read<int64_t>(&data));
+          break;
+        case UINT:
+          visitor(_Read<uint64_t>(&data));
+          break;
+        case DOUBLE:
+          visitor(_Read<double>(&data));
+          break;
+        case FLOAT:
+          visitor(_Read<float>(&data));
+          break;
+        case POINTER:
+          visitor(_Read<const void*>(&data));
+          break;
+        case STRING: {
+          auto length = _Read<uint32_t>(&data);
+          visitor(data, static_cast<std::size_t>(length));
+          data += length;
+          break;
+        }
+      }
+    }
+  }
+
+ private:
+  void _Add(bool value) {
+    char byte = value ? 1 : 0;
+    _Write(BOOL, &byte, 1);
+  }
+
+  void _Add(char value) { _Write(CHAR, &value, 1); }
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value &&
+                          std::is_signed<T>::value>::type
+  _Add(T value) {
+    int64_t value_64 = value;
+    _Write(INT, &value_64, sizeof(value_64));
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value &&
+                          std::is_unsigned<T>::value>::type
+  _Add(T value) {
+    uint64_t value_64 = value;
+    _Write(UINT, &value_64, sizeof(value_64));
+  }
+
+  // Floats keep their own tag, so that they can be rendered with only the
+  // digits a float has.
+  void _Add(float value) { _Write(FLOAT, &value, sizeof(value)); }
+
+  template <typename T>
+  typename std::enable_if<std::is_floating_point<T>::value>::type _Add(
+      T value) {
+    double value_double = value;
+    _Write(DOUBLE, &value_double, sizeof(value_double));
+  }
+
+  void _Add(const char* value) { _AddString(value, std::strlen(value)); }
+
+  void _Add(char* value) { _Add(static_cast<const char*>(value)); }
+
+  void _Add(const std::string& value) {
+    _AddString(value.data(), value.length());
+  }
+
+  template <typename T>
+  void _Add(T* value) {
+    const void* pointer = value;
+    _Write(POINTER, &pointer, sizeof(pointer));
+  }
+
+  // Rendered as a null pointer, like (void*)0.
+  void _Add(std::nullptr_t) { _Add(static_cast<const void*>(nullptr)); }
+
+  template <typename T>
+  typename std::enable_if<!std::is_arithmetic<T>::value>::type _Add(
+      const T& value) {
+    std::ostringstream stream;
+    stream << value;
+    _Add(stream.str());
+  }
+
+  void _AddString(const char* value, std::size_t length) {
+    uint32_t length_32 = length;
+    _Reserve(1 + sizeof(length_32) + length);
+    _Write(STRING, &length_32, sizeof(length_32));
+    std::memcpy(_Data() + size_, value, length);
+    size_ += length;
+  }
+
+  void _Write(Type type, const void* value, std::size_t length) {
+    _Reserve(1 + length);
+    char* data = _Data() + size_;
+    *data = static_cast<char>(type);
+    std::memcpy(data + 1, value, length);
+    size_ += 1 + length;
+    n_args_++;
+  }
+
+  void _Reserve(std::size_t length) {
+    if (size_ + length <= capacity_) {
+      return;
+    }
+
+    std::size_t new_capacity = capacity_;
+    while (new_capacity < size_ + length) {
+      new_capacity *= 2;
+    }
+
+    std::unique_ptr<char[]> new_heap(new char[new_capacity]);
+    std::memcpy(new_heap.get(), _Data(), size_);
+    heap_ = std::move(new_heap);
+    capacity_ = new_capacity;
+  }
+
+  template <typename T>
+  static T _Read(const char** data) {
+    T value;
+    std::memcpy(&value, *data, sizeof(value));
+    *data += sizeof(value);
+    return value;
+  }
+
+  char* _Data() { return heap_ == nullptr ? inline_ : heap_.get(); }
+  const char* _Data() const { return heap_ == nullptr ? inline_ : heap_.get(); }
+
+  char inline_[kInlineSize];
+  std::unique_ptr<char[]> heap_;
+  uint32_t size_, capacity_;
+  uint32_t n_args_;
+};
+
+}  // namespace internal
+
+}  // namespace cpplog
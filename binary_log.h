@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace cpplog {
+
+namespace internal {
+
+/**
+ * @file
+ *
+ * The binary log format written with --log_format=binary, and read back by
+ * cpplog_decode. Everything is in native byte order.
+ *
+ * The log file (<logfile_name>.bin) starts with kBinaryLogMagic, followed by
+ * records:
+ *
+ *     varint   length of the rest of the record
+ *     zigzag   nanoseconds since the previous record in the file (or since the
+ *              epoch, for the first record)
+ *     varint   call site id
+ *     varint   thread id
+ *     byte     RECORD_ARGS, RECORD_CHECKED_ARGS or RECORD_TEXT
+ *
+ *     Before that byte, a message inside or ending a scope (see LOG_SCOPED)
+ *     has one or both of:
+ *
+ *     byte     RECORD_DEPTH
+ *     varint   the number of scopes the message is inside
+ *
+ *     byte     RECORD_SPAN
+ *     varint   how long the scope the message ends lasted, in nanoseconds
+ *
+ *     RECORD_ARGS: the call site's format string applies.
+ *     varint   number of arguments
+ *     bytes    the arguments, encoded as in ArgBuffer
+ *
+ *     RECORD_CHECKED_ARGS: as RECORD_ARGS, for a LOGF message (whose format is
+ *     rendered by cpplog rather than cppstring).
+ *
+ *     RECORD_TEXT: the message was formatted when it was logged.
+ *     bytes    the message
+ *
+ * Call sites and threads are described once each in a dictionary
+ * (<logfile_name>.bin.dict), which starts with kBinaryDictMagic, followed by
+ * entries:
+ *
+ *     byte     DICT_CALL_SITE
+ *     varint   call site id
+ *     byte     level
+ *     varint   line
+ *     string   file
+ *     string   format (empty if the call site doesn't have a fixed format)
+ *
+ *     byte     DICT_THREAD
+ *     varint   thread id
+ *     string   thread name
+ *
+ * where a string is a varint length followed by the bytes. The dictionary
+ * isn't rotated, so it applies to every archive of the log.
+ */
+
+constexpr char kBinaryLogMagic[] = "CPPLOGB1";
+constexpr char kBinaryDictMagic[] = "CPPLOGD1";
+constexpr std::size_t kBinaryMagicLength = sizeof(kBinaryLogMagic) - 1;
+
+enum BinaryRecordKind : uint8_t {
+  RECORD_ARGS = 0,
+  RECORD_TEXT = 1,
+  RECORD_CHECKED_ARGS = 2,
+  RECORD_DEPTH = 3,
+  RECORD_SPAN = 4
+};
+enum BinaryDictEntry : uint8_t { DICT_CALL_SITE = 'S', DICT_THREAD = 'T' };
+
+/**
+ * @brief      Append an unsigned LEB128 varint to a buffer.
+ */
+inline void AppendVarint(uint64_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+
+  out->push_back(static_cast<char>(value));
+}
+
+/**
+ * @brief      Append a signed varint (zigzag encoded) to a buffer.
+ */
+inline void AppendZigZag(int64_t value, std::string* out) {
+  AppendVarint((uint64_t(value) << 1) ^ uint64_t(value >> 63), out);
+}
+
+/**
+ * @brief      Append a length-prefixed string to a buffer.
+ */
+inline void AppendString(const char* data, std::size_t length,
+                         std::string* out) {
+  AppendVarint(length, out);
+  out->append(data, length);
+}
+
+/**
+ * @brief      Reads the values written by the Append*() functions. Every read
+ *             returns false (and leaves its output alone) if the data runs
+ *             out.
+ */
+class BinaryReader {
+ public:
+  BinaryReader(const char* data, std::size_t length)
+      : pos_(data), end_(data + length) {}
+
+  bool ReadVarint(uint64_t* value) {
+    uint64_t result = 0;
+    for (int shift = 0; pos_ < end_ && shift < 64; shift += 7) {
+      uint8_t byte = static_cast<uint8_t>(*pos_++);
+      result |= uint64_t(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        *value = result;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  bool ReadZigZag(int64_t* value) {
+    uint64_t encoded;
+    if (!ReadVarint(&encoded)) {
+      return false;
+    }
+
+    *value = int64_t(encoded >> 1) ^ -int64_t(encoded & 1);
+    return true;
+  }
+
+  bool ReadByte(uint8_t* value) {
+    if (pos_ >= end_) {
+      return false;
+    }
+
+    *value = static_cast<uint8_t>(*pos_++);
+    return true;
+  }
+
+  bool ReadBytes(std::size_t length, const char** data) {
+    if (std::size_t(end_ - pos_) < length) {
+      return false;
+    }
+
+    *data = pos_;
+    pos_ += length;
+    return true;
+  }
+
+  bool ReadString(std::string* value) {
+    uint64_t length;
+    const char* data;
+    if (!ReadVarint(&length) || !ReadBytes(length, &data)) {
+      return false;
+    }
+
+    value->assign(data, length);
+    return true;
+  }
+
+  /**
+   * @brief      The number of bytes left to read.
+   */
+  std::size_t remaining() const { return end_ - pos_; }
+
+ private:
+  const char* pos_;
+  const char* end_;
+};
+
+}  // namespace internal
+
+}  // namespace cpplog
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+
+namespace cpplog {
+
+namespace internal {
+
+/**
+ * @file
+ *
+ * Compile-time checks for the format strings of LOGF messages. A LOGF format
+ * is a string literal made of text, {{ and }} (for literal braces) and these
+ * placeholders, one per argument:
+ *
+ *     {}       Any argument.
+ *     {:x}     An integer, in lowercase (or {:X}, uppercase) hexadecimal.
+ *     {:.Nf}   A number, with N (up to 99) digits after the decimal point.
+ *
+ * Anything else (e.g. a stray brace, or a placeholder with any other spec) is
+ * a compile error, as is a format with the wrong number of placeholders for
+ * its arguments. These are C++11 constexpr functions, so they only recurse:
+ * runs of plain text are skipped eight characters at a time to keep the
+ * depth well within the compiler's limit (512 by default) for formats of a
+ * few thousand characters.
+ */
+
+/**
+ * @brief      The types of a LOGF message's arguments, as deduced by
+ *             CheckedArgTypes().
+ */
+template <typename... Args>
+struct ArgTypeList {
+  static constexpr std::size_t size = sizeof...(Args);
+};
+
+/**
+ * @brief      Get the types of some arguments. This is only declared, for use
+ *             in decltype(), so that the arguments aren't evaluated. It only
+ *             accepts a string literal (or array) format.
+ */
+template <std::size_t N, typename... Args>
+ArgTypeList<typename std::decay<Args>::type...> CheckedArgTypes(
+    const char (&format)[N], const Args&... args);
+
+/**
+ * @brief      Which placeholder specs an argument can be given.
+ */
+template <typename T>
+struct CheckedArgTraits {
+  /**
+   * Whether or not the argument is an integer, for {:x}.
+   */
+  static constexpr bool integer = std::is_integral<T>::value &&
+                                  !std::is_same<T, bool>::value &&
+                                  !std::is_same<T, char>::value;
+
+  /**
+   * Whether or not the argument is a number, for {:.Nf}.
+   */
+  static constexpr bool number = integer || std::is_floating_point<T>::value;
+};
+
+/**
+ * The result of CountPlaceholders() for a format which isn't valid.
+ */
+constexpr std::size_t kBadCheckedFormat = std::size_t(-1);
+
+constexpr bool _IsFormatDigit(char c) { return c >= '0' && c <= '9'; }
+
+constexpr bool _IsPlainText(char c) { return c != '{' && c != '}' && c != 0; }
+
+/**
+ * @brief      Whether the next eight characters are all plain text, and so can
+ *             be skipped in one go.
+ */
+constexpr bool _IsPlainRun(const char* f) {
+  return _IsPlainText(f[0]) && _IsPlainText(f[1]) && _IsPlainText(f[2]) &&
+         _IsPlainText(f[3]) && _IsPlainText(f[4]) && _IsPlainText(f[5]) &&
+         _IsPlainText(f[6]) && _IsPlainText(f[7]);
+}
+
+/**
+ * @brief      Find the closing brace of a placeholder.
+ *
+ * @param[in]  spec  The character after the opening brace.
+ *
+ * @return     The closing brace, or nullptr if the placeholder isn't one of
+ *             the supported forms.
+ */
+constexpr const char* PlaceholderEnd(const char* spec) {
+  return spec[0] == '}'
+             ? spec
+             : spec[0] != ':'
+                   ? nullptr
+                   : spec[1] == 'x' || spec[1] == 'X'
+                         ? (spec[2] == '}' ? spec + 2 : nullptr)
+                         : spec[1] == '.' && _IsFormatDigit(spec[2])
+                               ? (spec[3] == 'f' && spec[4] == '}'
+                                      ? spec + 4
+                                      : _IsFormatDigit(spec[3]) &&
+                                                spec[4] == 'f' &&
+                                                spec[5] == '}'
+                                            ? spec + 5
+                                            : nullptr)
+                               : nullptr;
+}
+
+constexpr std::size_t _CountPlaceholders(const char* f, std::size_t n) {
+  return _IsPlainRun(f)
+             ? _CountPlaceholders(f + 8, n)
+             : f[0] == 0
+                   ? n
+                   : (f[0] == '{' || f[0] == '}') && f[1] == f[0]
+                         ? _CountPlaceholders(f + 2, n)
+                         : f[0] == '}'
+                               ? kBadCheckedFormat
+                               : f[0] == '{'
+                                     ? (PlaceholderEnd(f + 1) == nullptr
+                                            ? kBadCheckedFormat
+                                            : _CountPlaceholders(
+                                                  PlaceholderEnd(f + 1) + 1,
+                                                  n + 1))
+                                     : _CountPlaceholders(f + 1, n);
+}
+
+/**
+ * @brief      Count the placeholders in a LOGF format.
+ *
+ * @return     The number of placeholders, or kBadCheckedFormat if the format
+ *             has a stray brace or an unsupported placeholder.
+ */
+constexpr std::size_t CountPlaceholders(const char* format) {
+  return _CountPlaceholders(format, 0);
+}
+
+/**
+ * @brief      Find the next placeholder's opening brace, or the end of the
+ *             format.
+ */
+constexpr const char* NextPlaceholder(const char* f) {
+  return _IsPlainRun(f)
+             ? NextPlaceholder(f + 8)
+             : f[0] == 0 || (f[0] == '{' && f[1] != '{')
+                   ? f
+                   : (f[0] == '{' || f[0] == '}') && f[1] == f[0]
+                         ? NextPlaceholder(f + 2)
+                         : NextPlaceholder(f + 1);
+}
+
+/**
+ * @brief      Skip past a placeholder (or just its brace, if it isn't valid).
+ */
+constexpr const char* _AfterPlaceholder(const char* brace) {
+  return PlaceholderEnd(brace + 1) == nullptr ? brace + 1
+                                              : PlaceholderEnd(brace + 1) + 1;
+}
+
+/**
+ * @brief      Whether or not a placeholder can be given an argument of some
+ *             kind. Unsupported placeholders are left to CountPlaceholders()
+ *             to reject.
+ */
+constexpr bool _SpecAccepts(const char* spec, bool integer, bool number) {
+  return spec[0] != ':' || (spec[1] == 'x' || spec[1] == 'X')
+             ? spec[0] != ':' || integer
+             : spec[1] != '.' || number;
+}
+
+constexpr bool _PlaceholdersMatch(const char*, ArgTypeList<>) { return true; }
+
+template <typename T, typename... Rest>
+constexpr bool _PlaceholdersMatch(const char* f, ArgTypeList<T, Rest...>) {
+  return NextPlaceholder(f)[0] == 0 ||
+         (_SpecAccepts(NextPlaceholder(f) + 1, CheckedArgTraits<T>::integer,
+                       CheckedArgTraits<T>::number) &&
+          _PlaceholdersMatch(_AfterPlaceholder(NextPlaceholder(f)),
+                             ArgTypeList<Rest...>()));
+}
+
+/**
+ * @brief      Whether or not each placeholder in a LOGF format can be given
+ *             the argument in its position.
+ */
+template <typename... Args>
+constexpr bool PlaceholdersMatch(const char* format,
+                                 ArgTypeList<Args...> types) {
+  return _PlaceholdersMatch(format, types);
+}
+
+}  // namespace internal
+
+}  // namespace cpplog
+
+/**
+ * @brief      Get the first of some macro arguments (the format of a LOGF).
+ */
+#define CPPLOG_EXPAND(X) X
+#define CPPLOG_FIRST_ARG(...) \
+  CPPLOG_EXPAND(CPPLOG_FIRST_ARG_(__VA_ARGS__, _cpplog_unused))
+#define CPPLOG_FIRST_ARG_(FIRST, ...) FIRST
+
+/**
+ * @brief      Check the format and arguments of a LOGF message at compile
+ *             time.
+ */
+#define CPPLOG_CHECK_FORMAT(...)                                             \
+  typedef decltype(::cpplog::internal::CheckedArgTypes(__VA_ARGS__))         \
+      _cpplog_arg_types;                                                     \
+  static_assert(::cpplog::internal::CountPlaceholders(                       \
+                    CPPLOG_FIRST_ARG(__VA_ARGS__)) !=                        \
+                    ::cpplog::internal::kBadCheckedFormat,                   \
+                "LOGF format has a stray brace or an unsupported "           \
+                "placeholder (use {}, {:x}, {:X} or {:.Nf})");               \
+  static_assert(::cpplog::internal::CountPlaceholders(                       \
+                    CPPLOG_FIRST_ARG(__VA_ARGS__)) ==                        \
+                        _cpplog_arg_types::size ||                           \
+                    ::cpplog::internal::CountPlaceholders(                   \
+                        CPPLOG_FIRST_ARG(__VA_ARGS__)) ==                    \
+                        ::cpplog::internal::kBadCheckedFormat,               \
+                "LOGF format has the wrong number of placeholders for its "  \
+                "arguments");                                                \
+  static_assert(::cpplog::internal::PlaceholdersMatch(                       \
+                    CPPLOG_FIRST_ARG(__VA_ARGS__), _cpplog_arg_types()),     \
+                "LOGF argument doesn't suit its placeholder ({:x} takes an " \
+                "integer, {:.Nf} a number)")
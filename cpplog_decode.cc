@@ -0,0 +1,353 @@
+#include "binary_log.h"
+#include "json.h"
+#include "log.h"
+
+#include <gflags/gflags.h>
+#include <zlib.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+DECLARE_bool(colorize_output);
+DECLARE_string(line_format);
+
+DEFINE_string(dict, "",
+              "The dictionary written alongside the binary log. By default, "
+              "this is the path of the log up to and including \".bin\", "
+              "followed by \".dict\".");
+DEFINE_bool(chrome_trace, false,
+            "Write the scopes logged with LOG_SCOPED as Chrome trace events "
+            "(for chrome://tracing or Perfetto) instead of rendering every "
+            "message as text.");
+
+using namespace cpplog::internal;
+
+namespace {
+
+/**
+ * @brief      A call site read from the dictionary.
+ */
+struct DecodedCallSite {
+  std::string file, format;
+  std::unique_ptr<CallSite> site;
+};
+
+/**
+ * @brief      The contents of a dictionary.
+ */
+struct Dictionary {
+  std::unordered_map<uint64_t, std::unique_ptr<DecodedCallSite>> call_sites;
+  std::unordered_map<uint64_t, std::string> threads;
+};
+
+/**
+ * @brief      Read all of a (possibly gzipped) file.
+ */
+bool _ReadFile(const std::string& path, std::string* out) {
+  gzFile file = gzopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+
+  char buffer[64 * 1024];
+  int length;
+  while ((length = gzread(file, buffer, sizeof(buffer))) > 0) {
+    out->append(buffer, length);
+  }
+
+  return gzclose(file) == Z_OK && length == 0;
+}
+
+bool _ReadDictionary(const std::string& path, Dictionary* dict) {
+  std::string data;
+  if (!_ReadFile(path, &data) ||
+      data.compare(0, kBinaryMagicLength, kBinaryDictMagic) != 0) {
+    std::fprintf(stderr, "%s is not a cpplog dictionary\n", path.c_str());
+    return false;
+  }
+
+  BinaryReader reader(data.data() + kBinaryMagicLength,
+                      data.length() - kBinaryMagicLength);
+
+  // A truncated last entry (e.g. after a crash) is expected, and the entries
+  // before it are kept. An unknown entry type or level means the dictionary
+  // is corrupt.
+  bool corrupt = false;
+  uint8_t type;
+  while (reader.ReadByte(&type)) {
+    uint64_t id;
+    if (!reader.ReadVarint(&id)) {
+      break;
+    }
+
+    if (type == DICT_CALL_SITE) {
+      std::unique_ptr<DecodedCallSite> decoded(new DecodedCallSite());
+      uint8_t level;
+      uint64_t line;
+      if (!reader.ReadByte(&level) || !reader.ReadVarint(&line) ||
+          !reader.ReadString(&decoded->file) ||
+          !reader.ReadString(&decoded->format)) {
+        break;
+      }
+
+      if (level >= N_LEVELS) {
+        corrupt = true;
+        break;
+      }
+
+      decoded->site.reset(new CallSite(decoded->file.c_str(), int(line),
+                                       static_cast<Level>(level)));
+      dict->call_sites[id] = std::move(decoded);
+    } else if (type == DICT_THREAD) {
+      std::string thread;
+      if (!reader.ReadString(&thread)) {
+        break;
+      }
+
+      dict->threads[id] = std::move(thread);
+    } else {
+      corrupt = true;
+      break;
+    }
+  }
+
+  if (corrupt) {
+    std::fprintf(stderr, "%s is corrupt\n", path.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+const char* const kLevelNames[] = {"TRACE",   "DEBUG", "INFO",
+                                   "WARNING", "ERROR", "FATAL"};
+
+/**
+ * @brief      Write a scope as a complete ("X") trace event, preceded by a
+ *             name for its thread the first time the thread is seen.
+ *
+ * @param[in]  name       The scope's message.
+ * @param[in]  site       The call site of the scope.
+ * @param[in]  end_ns     When the scope ended, in nanoseconds since the epoch.
+ * @param[in]  span_ns    How long the scope lasted.
+ * @param[in]  thread_id  The id of the thread it was on.
+ * @param[in]  thread     The name of the thread.
+ */
+void _WriteTraceEvent(const std::string& name, const CallSite& site,
+                      int64_t end_ns, uint64_t span_ns, uint64_t thread_id,
+                      const std::string& thread) {
+  static std::unordered_set<uint64_t> named_threads;
+  static std::string event;
+  static const char* separator = "\n";
+  event.clear();
+  if (named_threads.insert(thread_id).second) {
+    event.append(separator);
+    event.append("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,");
+    event.append("\"tid\":");
+    event.append(std::to_string(thread_id));
+    event.append(",\"args\":{\"name\":");
+    AppendJsonString(thread, &event);
+    event.append("}}");
+    separator = ",\n";
+  }
+
+  // Trace timestamps are in microseconds. Times since the epoch have too many
+  // digits for a double to keep the nanoseconds, so they're split by hand.
+  long long start_ns = end_ns - int64_t(span_ns);
+  char times[64];
+  std::snprintf(times, sizeof(times), "\"ts\":%lld.%03lld,\"dur\":%llu.%03llu",
+                start_ns / 1000, start_ns % 1000,
+                static_cast<unsigned long long>(span_ns / 1000),
+                static_cast<unsigned long long>(span_ns % 1000));
+  event.append(separator);
+  event.append("{\"name\":");
+  AppendJsonString(name, &event);
+  event.append(",\"cat\":\"");
+  event.append(kLevelNames[site.level()]);
+  event.append("\",\"ph\":\"X\",");
+  event.append(times);
+  event.append(",\"pid\":1,\"tid\":");
+  event.append(std::to_string(thread_id));
+  event.append(",\"args\":{\"site\":");
+  AppendJsonString(std::string(site.file()) + ":" +
+                       std::to_string(site.line()),
+                   &event);
+  event.append("}}");
+  separator = ",\n";
+  std::fwrite(event.data(), 1, event.length(), stdout);
+}
+
+/**
+ * @brief      Render every record in a binary log to stdout.
+ */
+bool _DecodeLog(const std::string& path, const Dictionary& dict) {
+  std::string data;
+  if (!_ReadFile(path, &data) ||
+      data.compare(0, kBinaryMagicLength, kBinaryLogMagic) != 0) {
+    std::fprintf(stderr, "%s is not a cpplog binary log\n", path.c_str());
+    return false;
+  }
+
+  BinaryReader reader(data.data() + kBinaryMagicLength,
+                      data.length() - kBinaryMagicLength);
+  static const std::string kUnknownThread = "?";
+  int64_t time_ns = 0;
+  uint64_t length;
+  const char* record;
+  std::string line;
+  while (reader.ReadVarint(&length) && reader.ReadBytes(length, &record)) {
+    BinaryReader fields(record, length);
+    int64_t delta_ns;
+    uint64_t site_id, thread_id;
+    uint8_t kind;
+    if (!fields.ReadZigZag(&delta_ns) || !fields.ReadVarint(&site_id) ||
+        !fields.ReadVarint(&thread_id) || !fields.ReadByte(&kind)) {
+      std::fprintf(stderr, "%s: skipping a corrupt record\n", path.c_str());
+      continue;
+    }
+
+    // A message inside or ending a scope says so before its kind.
+    uint64_t depth = 0, span_ns = 0;
+    bool is_span = false, prefix_ok = true;
+    while (prefix_ok && (kind == RECORD_DEPTH || kind == RECORD_SPAN)) {
+      if (kind == RECORD_DEPTH) {
+        prefix_ok = fields.ReadVarint(&depth);
+      } else {
+        prefix_ok = fields.ReadVarint(&span_ns);
+        is_span = true;
+      }
+
+      prefix_ok = prefix_ok && fields.ReadByte(&kind);
+    }
+
+    time_ns += delta_ns;
+    if (!prefix_ok || (FLAGS_chrome_trace && !is_span)) {
+      continue;
+    }
+
+    auto site = dict.call_sites.find(site_id);
+    if (site == dict.call_sites.end()) {
+      std::fprintf(stderr, "%s: skipping a record from unknown site %llu\n",
+                   path.c_str(), static_cast<unsigned long long>(site_id));
+      continue;
+    }
+
+    auto thread = dict.threads.find(thread_id);
+    const auto& thread_name =
+        thread == dict.threads.end() ? kUnknownThread : thread->second;
+
+    // Rebuild the message, then render it as it would have been logged.
+    ArgBuffer args;
+    std::string format;
+    const char* payload;
+    std::size_t payload_length = fields.remaining();
+    if (kind == RECORD_ARGS || kind == RECORD_CHECKED_ARGS) {
+      uint64_t n_args;
+      if (!fields.ReadVarint(&n_args)) {
+        continue;
+      }
+
+      payload_length = fields.remaining();
+      fields.ReadBytes(payload_length, &payload);
+      args.Assign(payload, payload_length, n_args);
+      format = site->second->format;
+    } else {
+      fields.ReadBytes(payload_length, &payload);
+      args.Add(std::string(payload, payload_length));
+      format = "{}";
+    }
+
+    auto log_time = std::chrono::time_point<std::chrono::system_clock>(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::nanoseconds(time_ns)));
+    LogMessage message(site->second->site.get(), log_time, format,
+                       std::move(args), kind == RECORD_CHECKED_ARGS);
+    if (FLAGS_chrome_trace) {
+      message.set_depth(0);
+      message.Render("{message}", false, thread_name, &line);
+      _WriteTraceEvent(line, *site->second->site, time_ns, span_ns, thread_id,
+                       thread_name);
+      continue;
+    }
+
+    message.set_depth(uint32_t(depth));
+    if (is_span) {
+      message.set_span(std::chrono::nanoseconds(span_ns));
+    }
+
+    message.Render(FLAGS_line_format, FLAGS_colorize_output, thread_name,
+                   &line);
+    line.push_back('\n');
+    std::fwrite(line.data(), 1, line.length(), stdout);
+  }
+
+  if (reader.remaining() > 0) {
+    std::fprintf(stderr, "%s: the last record is incomplete\n", path.c_str());
+  }
+
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage(
+      "Render binary cpplog logs (--log_format=binary) as text.\n"
+      "Usage: cpplog_decode [--dict=<file>.bin.dict] <file>.bin...");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  cpplog::Reconfigure();
+
+  if (argc < 2) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "cpplog_decode");
+    return EXIT_FAILURE;
+  }
+
+  if (FLAGS_chrome_trace) {
+    std::fputs("{\"traceEvents\":[", stdout);
+  }
+
+  bool ok = true;
+  std::unordered_map<std::string, std::unique_ptr<Dictionary>> dicts;
+  for (int i = 1; i < argc; i++) {
+    std::string path = argv[i];
+    std::string dict_path = FLAGS_dict;
+    if (dict_path.empty()) {
+      auto bin = path.rfind(".bin");
+      dict_path = path.substr(0, bin == std::string::npos ? path.length()
+                                                          : bin + 4) +
+                  ".dict";
+    }
+
+    // Archives of the same log share a dictionary. One which couldn't be
+    // read is kept as nullptr, so that it is only read (and reported) once.
+    auto dict = dicts.find(dict_path);
+    if (dict == dicts.end()) {
+      std::unique_ptr<Dictionary> read(new Dictionary());
+      if (!_ReadDictionary(dict_path, read.get())) {
+        read.reset();
+      }
+
+      dict = dicts.emplace(dict_path, std::move(read)).first;
+    }
+
+    if (dict->second == nullptr) {
+      std::fprintf(stderr, "%s: skipping, as its dictionary couldn't be read\n",
+                   path.c_str());
+      ok = false;
+      continue;
+    }
+
+    ok = _DecodeLog(path, *dict->second) && ok;
+  }
+
+  if (FLAGS_chrome_trace) {
+    std::fputs("\n]}\n", stdout);
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
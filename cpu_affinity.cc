@@ -0,0 +1,87 @@
+#include "cpu_affinity.h"
+
+#include <cstdlib>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif  // __linux__
+
+namespace cpplog {
+
+namespace internal {
+
+namespace {
+
+/**
+ * The CPUs set by SetLoggerCpus(). This is only written before the logger's
+ * threads start, so they can read it without a lock.
+ */
+std::vector<int> LOGGER_CPUS;
+
+/**
+ * @brief      Parse a CPU number, which must be the whole of `text`.
+ *
+ * @return     The number, or -1 if `text` isn't one.
+ */
+int _ParseCpu(const std::string& text) {
+  if (text.empty() || text.length() > 5 ||
+      text.find_first_not_of("0123456789") != std::string::npos) {
+    return -1;
+  }
+
+  return std::atoi(text.c_str());
+}
+
+}  // namespace
+
+std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::size_t start = 0;
+  while (start < list.length()) {
+    std::size_t end = list.find(',', start);
+    end = end == std::string::npos ? list.length() : end;
+    std::string entry = list.substr(start, end - start);
+    start = end + 1;
+
+    auto dash = entry.find('-');
+    int first = _ParseCpu(entry.substr(0, dash));
+    int last = dash == std::string::npos ? first
+                                         : _ParseCpu(entry.substr(dash + 1));
+    if (first < 0 || last < first) {
+      continue;
+    }
+
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+
+  return cpus;
+}
+
+void SetLoggerCpus(const std::vector<int>& cpus) { LOGGER_CPUS = cpus; }
+
+void PinLoggerThread() {
+#ifdef __linux__
+  if (LOGGER_CPUS.empty()) {
+    return;
+  }
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (int cpu : LOGGER_CPUS) {
+    if (cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &cpus);
+    }
+  }
+
+  // If none of the CPUs exist (or are allowed), this fails and the thread
+  // carries on wherever the scheduler puts it.
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif  // __linux__
+}
+
+}  // namespace internal
+
+}  // namespace cpplog
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace cpplog {
+
+namespace internal {
+
+/**
+ * @brief      Parse a list of CPUs, e.g. "0-3,8". Entries which aren't a
+ *             number or a range of numbers are ignored.
+ *
+ * @param[in]  list  The list, as given to --log_emitter_cpus.
+ *
+ * @return     The CPUs, in the order given.
+ */
+std::vector<int> ParseCpuList(const std::string& list);
+
+/**
+ * @brief      Set the CPUs which the logger's own threads may run on (see
+ *             PinLoggerThread()). An empty list leaves them to the scheduler.
+ *             This must be called before any of those threads start.
+ */
+void SetLoggerCpus(const std::vector<int>& cpus);
+
+/**
+ * @brief      Restrict the calling thread to the CPUs set by SetLoggerCpus(),
+ *             if any. Each of the logger's threads which is on the path of a
+ *             message (the emitter, the format threads, the sink workers and
+ *             the network sender) calls this as soon as it starts, so that it
+ *             stays near the caches (and the NUMA node) it shares with the
+ *             others. This only does anything on Linux.
+ */
+void PinLoggerThread();
+
+}  // namespace internal
+
+}  // namespace cpplog
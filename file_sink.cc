@@ -0,0 +1,291 @@
+#include "file_sink.h"
+
+#include "log_rotator.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#ifdef OS_WINDOWS
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#endif  // OS_WINDOWS
+
+namespace cpplog {
+
+namespace internal {
+
+namespace {
+
+int _OpenFile(const std::string& path) {
+#ifdef OS_WINDOWS
+  return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+               _S_IREAD | _S_IWRITE);
+#else
+  return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif  // OS_WINDOWS
+}
+
+void _CloseFile(int fd) {
+#ifdef OS_WINDOWS
+  _close(fd);
+#else
+  close(fd);
+#endif  // OS_WINDOWS
+}
+
+/**
+ * @brief      Write all of `data` to `fd`, retrying on partial writes. Errors
+ *             are ignored: there's nowhere sensible to report them.
+ */
+void _WriteFully(int fd, const char* data, std::size_t length) {
+  while (length > 0) {
+#ifdef OS_WINDOWS
+    auto written = _write(fd, data, static_cast<unsigned int>(length));
+#else
+    auto written = write(fd, data, length);
+#endif  // OS_WINDOWS
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return;
+    }
+
+    data += written;
+    length -= written;
+  }
+}
+
+/**
+ * The most buffers to pass to a single writev() call. POSIX only guarantees
+ * 16 (IOV_MAX), but every platform we care about allows at least 1024.
+ */
+constexpr std::size_t kMaxBuffersPerWrite = 1024;
+
+}  // namespace
+
+void WriteVectored(int fd, const iovec* buffers, std::size_t count) {
+#ifdef OS_WINDOWS
+  for (std::size_t i = 0; i < count; i++) {
+    _WriteFully(fd, static_cast<const char*>(buffers[i].iov_base),
+                buffers[i].iov_len);
+  }
+#else
+  // A partial write can stop part way through a buffer. Copies of the
+  // remaining entries are made so the caller's array isn't modified.
+  iovec pending[kMaxBuffersPerWrite];
+  while (count > 0) {
+    std::size_t n = std::min(count, kMaxBuffersPerWrite);
+    std::copy(buffers, buffers + n, pending);
+    buffers += n;
+    count -= n;
+
+    iovec* next = pending;
+    while (n > 0) {
+      auto written = writev(fd, next, static_cast<int>(n));
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        return;
+      }
+
+      // Skip over everything which was written.
+      auto remaining = static_cast<std::size_t>(written);
+      while (n > 0 && remaining >= next->iov_len) {
+        remaining -= next->iov_len;
+        next++;
+        n--;
+      }
+
+      if (n > 0) {
+        next->iov_base = static_cast<char*>(next->iov_base) + remaining;
+        next->iov_len -= remaining;
+      }
+    }
+  }
+#endif  // OS_WINDOWS
+}
+
+FileSink::FileSink(const std::string& path, uint64_t max_size,
+                   std::size_t buffer_size,
+                   std::chrono::milliseconds flush_interval,
+                   LogRotator* rotator, SinkCounters* counters)
+    : path_(path),
+      max_size_(max_size),
+      buffer_size_(buffer_size),
+      flush_interval_(flush_interval),
+      rotator_(rotator),
+      counters_(counters),
+      fd_(-1),
+      bytes_written_(0),
+      rotations_(0) {
+  buffer_.reserve(buffer_size_);
+  _Open();
+  if (rotator_ != nullptr) {
+    rotator_->PrepareSpare(path_, 0);
+  }
+}
+
+FileSink::~FileSink() {
+  Flush();
+  if (fd_ >= 0) {
+    _CloseFile(fd_);
+  }
+}
+
+void FileSink::Write(const char* data, std::size_t length, bool flush_now) {
+  // Rotate before going over the maximum size.
+  if (max_size_ > 0 && bytes_written_ > 0 &&
+      bytes_written_ + length > max_size_) {
+    Rotate();
+  }
+
+  // Keep lines in order with anything queued.
+  if (!queued_.empty()) {
+    Flush();
+  }
+
+  if (buffer_.empty()) {
+    buffered_since_ = std::chrono::steady_clock::now();
+  }
+
+  // Lines which don't fit go straight to the file.
+  if (buffer_.length() + length > buffer_size_) {
+    Flush();
+    if (length > buffer_size_) {
+      ScopedWriteTimer timer(counters_, length);
+      _WriteFully(fd_, data, length);
+      bytes_written_ += length;
+      return;
+    }
+
+    buffered_since_ = std::chrono::steady_clock::now();
+  }
+
+  buffer_.append(data, length);
+  bytes_written_ += length;
+
+  if (flush_now) {
+    Flush();
+  } else {
+    FlushIfDue();
+  }
+}
+
+void FileSink::Queue(const char* data, std::size_t length) {
+  if (max_size_ > 0 && bytes_written_ > 0 &&
+      bytes_written_ + length > max_size_) {
+    Rotate();
+  }
+
+  // Keep lines in order with anything buffered.
+  if (!buffer_.empty()) {
+    Flush();
+  }
+
+  iovec line;
+  line.iov_base = const_cast<char*>(data);
+  line.iov_len = length;
+  queued_.push_back(line);
+  bytes_written_ += length;
+}
+
+void FileSink::Flush() {
+  if (fd_ < 0) {
+    buffer_.clear();
+    queued_.clear();
+    return;
+  }
+
+  if (!buffer_.empty()) {
+    ScopedWriteTimer timer(counters_, buffer_.length());
+    _WriteFully(fd_, buffer_.data(), buffer_.length());
+    buffer_.clear();
+  }
+
+  if (!queued_.empty()) {
+    std::size_t length = 0;
+    for (const auto& line : queued_) {
+      length += line.iov_len;
+    }
+
+    ScopedWriteTimer timer(counters_, length);
+    WriteVectored(fd_, queued_.data(), queued_.size());
+    queued_.clear();
+  }
+}
+
+void FileSink::FlushIfDue() {
+  if (!buffer_.empty() &&
+      std::chrono::steady_clock::now() - buffered_since_ >= flush_interval_) {
+    Flush();
+  }
+}
+
+void FileSink::FlushForCrash() const {
+  if (fd_ < 0) {
+    return;
+  }
+
+  if (!buffer_.empty()) {
+    _WriteFully(fd_, buffer_.data(), buffer_.length());
+  }
+
+  if (!queued_.empty()) {
+    WriteVectored(fd_, queued_.data(), queued_.size());
+  }
+}
+
+void FileSink::_Open() {
+  fd_ = _OpenFile(path_);
+  bytes_written_ = 0;
+}
+
+void FileSink::Rotate() {
+  Flush();
+  if (rotator_ != nullptr) {
+    // If there's no spare, just keep writing to the current file.
+    int spare = rotator_->TakeSpare(path_);
+    if (spare < 0) {
+      return;
+    }
+
+    if (fd_ >= 0) {
+      rotator_->Retire(path_, fd_, -1);
+    }
+
+    fd_ = spare;
+    bytes_written_ = 0;
+    _CountRotation();
+    return;
+  }
+
+  if (fd_ >= 0) {
+    _CloseFile(fd_);
+  }
+
+  // Move the file to the file + 1.
+  std::string old_path = path_ + ".old";
+  std::remove(old_path.c_str());
+  std::rename(path_.c_str(), old_path.c_str());
+  _Open();
+  _CountRotation();
+}
+
+void FileSink::_CountRotation() {
+  rotations_++;
+  if (counters_ != nullptr) {
+    counters_->rotations.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+}  // namespace internal
+
+}  // namespace cpplog
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "stats.h"
+
+#ifndef OS_WINDOWS
+#include <sys/uio.h>
+#endif  // OS_WINDOWS
+
+namespace cpplog {
+
+namespace internal {
+
+class LogRotator;
+
+#ifdef OS_WINDOWS
+/**
+ * Windows has no writev(), so buffers are written one at a time.
+ */
+struct iovec {
+  void* iov_base;
+  std::size_t iov_len;
+};
+#endif  // OS_WINDOWS
+
+/**
+ * @brief      Write a list of buffers to a file descriptor, using as few
+ *             writev() calls as possible and retrying on partial writes.
+ *             Errors are ignored: there's nowhere sensible to report them.
+ *
+ * @param[in]  fd       The file descriptor to write to.
+ * @param[in]  buffers  The buffers to write, in order.
+ * @param[in]  count    The number of buffers.
+ */
+void WriteVectored(int fd, const iovec* buffers, std::size_t count);
+
+/**
+ * @brief      A buffered log file.
+ *
+ * @details    Lines are appended to an in-memory buffer which is written out
+ *             when it fills up, when `flush_interval` has passed since the
+ *             last write, or when Flush() is called. The number of bytes
+ *             written is tracked in memory, so deciding when to rotate the
+ *             file never needs a stat() call.
+ *
+ *             A FileSink is not thread-safe; callers must serialize access.
+ */
+class FileSink {
+ public:
+  /**
+   * @brief      Open (and truncate) a log file.
+   *
+   * @param[in]  path            The path of the file.
+   * @param[in]  max_size        The size (in bytes) after which the file is
+   *                             rotated. 0 means never rotate.
+   * @param[in]  buffer_size     The number of bytes to buffer before writing.
+   * @param[in]  flush_interval  The maximum amount of time to hold buffered
+   *                             lines before writing them.
+   * @param[in]  rotator         Used to rotate the file without blocking. If
+   *                             nullptr, the file is rotated inline by moving
+   *                             it to `path` + ".old".
+   * @param[in]  counters        Where to count writes and rotations, or
+   *                             nullptr.
+   */
+  FileSink(const std::string& path, uint64_t max_size, std::size_t buffer_size,
+           std::chrono::milliseconds flush_interval,
+           LogRotator* rotator = nullptr, SinkCounters* counters = nullptr);
+
+  /**
+   * @brief      Flush anything buffered and close the file.
+   */
+  ~FileSink();
+
+  FileSink(const FileSink&) = delete;
+  FileSink& operator=(const FileSink&) = delete;
+
+  /**
+   * @brief      Append a line to the file.
+   *
+   * @param[in]  data          The line to write, including the newline.
+   * @param[in]  length        The length of `data`.
+   * @param[in]  flush_now     Whether or not to write the line out right away
+   *                           (e.g. for errors).
+   */
+  void Write(const char* data, std::size_t length, bool flush_now);
+
+  /**
+   * @brief      Queue a line to be written by the next Flush(), without copying
+   *             it. Queued lines are written with a single writev().
+   *
+   * @param[in]  data    The line to write, including the newline. This must
+   *                     stay valid (and unchanged) until Flush() is called.
+   * @param[in]  length  The length of `data`.
+   */
+  void Queue(const char* data, std::size_t length);
+
+  /**
+   * @brief      Write out anything which is buffered or queued.
+   */
+  void Flush();
+
+  /**
+   * @brief      Flush if the oldest buffered line has been held for longer
+   *             than the flush interval.
+   */
+  void FlushIfDue();
+
+  /**
+   * @brief      Write out anything which is buffered or queued, from a crash
+   *             handler. This only calls write() and writev(), so it is
+   *             async-signal-safe, but it leaves the buffers as they are:
+   *             nothing should use the sink afterwards.
+   */
+  void FlushForCrash() const;
+
+  /**
+   * @brief      Rotate the file now, starting a new one. With a rotator, this
+   *             just swaps in the rotator's spare file and leaves the rest to
+   *             the rotator's thread.
+   */
+  void Rotate();
+
+  /**
+   * @brief      The path of the file.
+   */
+  const std::string& path() const { return path_; }
+
+  /**
+   * @brief      The file descriptor of the current file, or -1.
+   */
+  int fd() const { return fd_; }
+
+  /**
+   * @brief      The number of bytes written to the current file (including
+   *             anything still buffered).
+   */
+  uint64_t bytes_written() const { return bytes_written_; }
+
+  /**
+   * @brief      The number of times the file has been rotated.
+   */
+  uint64_t rotations() const { return rotations_; }
+
+ private:
+  void _Open();
+  void _CountRotation();
+
+  std::string path_;
+  uint64_t max_size_;
+  std::size_t buffer_size_;
+  std::chrono::milliseconds flush_interval_;
+  LogRotator* rotator_;
+  SinkCounters* counters_;
+
+  int fd_;
+  uint64_t bytes_written_, rotations_;
+  std::string buffer_;
+
+  /**
+   * Lines added by Queue() which haven't been written yet.
+   */
+  std::vector<iovec> queued_;
+
+  /**
+   * When the oldest line in the buffer was added.
+   */
+  std::chrono::steady_clock::time_point buffered_since_;
+};
+
+}  // namespace internal
+
+}  // namespace cpplog
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif  // defined(__SSE2__)
+
+namespace cpplog {
+
+namespace internal {
+
+/**
+ * @brief      Find the first character in a string which has to be escaped in
+ *             JSON: a quote, a backslash or a control character. Bytes above
+ *             0x7F are assumed to be UTF-8 and are left alone.
+ *
+ * @return     The index of that character, or `length` if there isn't one.
+ */
+inline std::size_t FindJsonEscape(const char* data, std::size_t length) {
+  std::size_t i = 0;
+
+#if defined(__SSE2__)
+  // Check 16 bytes at a time: c <= 0x1F (unsigned) is max(c, 0x1F) == 0x1F.
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1F);
+  for (; i + 16 <= length; i += 16) {
+    __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, backslash)),
+        _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+    int mask = _mm_movemask_epi8(special);
+    if (mask != 0) {
+      return i + std::size_t(__builtin_ctz(mask));
+    }
+  }
+#endif  // defined(__SSE2__)
+
+  for (; i < length; i++) {
+    auto c = static_cast<unsigned char>(data[i]);
+    if (c == '"' || c == '\\' || c <= 0x1F) {
+      return i;
+    }
+  }
+
+  return length;
+}
+
+/**
+ * @brief      Append a string to a buffer as a quoted JSON string. Runs of
+ *             characters which don't need escaping are copied in one go.
+ */
+inline void AppendJsonString(const char* data, std::size_t length,
+                             std::string* out) {
+  static const char kHex[] = "0123456789abcdef";
+  out->push_back('"');
+  while (length > 0) {
+    std::size_t plain = FindJsonEscape(data, length);
+    out->append(data, plain);
+    if (plain == length) {
+      break;
+    }
+
+    auto c = static_cast<unsigned char>(data[plain]);
+    switch (c) {
+      case '"':
+        out->append("\\\"");
+        break;
+      case '\\':
+        out->append("\\\\");
+        break;
+      case '\n':
+        out->append("\\n");
+        break;
+      case '\r':
+        out->append("\\r");
+        break;
+      case '\t':
+        out->append("\\t");
+        break;
+      default:
+        out->append("\\u00");
+        out->push_back(kHex[c >> 4]);
+        out->push_back(kHex[c & 0xF]);
+        break;
+    }
+
+    data += plain + 1;
+    length -= plain + 1;
+  }
+
+  out->push_back('"');
+}
+
+inline void AppendJsonString(const std::string& value, std::string* out) {
+  AppendJsonString(value.data(), value.length(), out);
+}
+
+}  // namespace internal
+
+}  // namespace cpplog
@@ -1,19 +1,45 @@
 #include "log.h"
 
+#include <algorithm>
 #include <array>
+#include <climits>
+#include <cmath>
 #include <condition_variable>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
-#include <deque>
-#include <fstream>
-#include <iomanip>
+#include <map>
 #include <mutex>
-#include <sstream>
+#include <new>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <gflags/gflags.h>
 #include <boost/filesystem.hpp>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif  // __linux__
+
+#ifndef OS_WINDOWS
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#endif  // OS_WINDOWS
+
+#include "binary_log.h"
+#include "cpu_affinity.h"
+#include "file_sink.h"
+#include "json.h"
+#include "log_rotator.h"
+#include "mmap_file_sink.h"
+#include "network_sink.h"
+#include "ring_buffer.h"
+#include "sink_worker.h"
+#include "stats_reporter.h"
 #include "util/string/constants.h"
 #include "util/string/util.h"
 
@@ -48,12 +74,111 @@ DEFINE_uint32(v, 0,
               "The verbosity level to log at. Only messages with a verbosity "
               "level <= this will be logged.");
 
+DEFINE_string(vmodule, "",
+              "Per-file verbosity levels which override --v, as a "
+              "comma-separated list of <pattern>=<level>, e.g. "
+              "\"rpc_*=3,cache.cc=1\". Patterns may use * and ?, and are "
+              "matched against the file's name, without directories, with "
+              "and without its extension. The first match wins.");
+
 // OUTPUT FILE OPTIONS
 DEFINE_uint32(logfile_max_size_mb, 50,
               "The maximum number of MiB a single logging file will take up. "
-              "Note that actual disk usage might vary, because the logging "
-              "system will keep the previous log file in addition to the "
-              "current log file.");
+              "Once a file is full, it is archived as "
+              "<file>.YYYYMMDD-HHMMSS and a new file is started. Note that "
+              "actual disk usage might vary, because archives are kept in "
+              "addition to the current log file (see --logfile_max_files and "
+              "--logfile_max_total_mb).");
+
+DEFINE_uint32(logfile_max_files, 10,
+              "The maximum number of archives to keep for each log file. Older "
+              "archives are deleted. 0 means keep them all.");
+
+DEFINE_uint32(logfile_max_total_mb, 0,
+              "The maximum total number of MiB of archives to keep for each "
+              "log file. Older archives are deleted. 0 means no limit.");
+
+DEFINE_string(logfile_compression, "none",
+              "How to compress archived log files: none or gzip. Compression "
+              "is done in the background.");
+
+DEFINE_bool(logfile_single, false,
+            "When enabled, write each log line once to a single "
+            "<logfile_name>.log file rather than to one file per level. A "
+            "<logfile_name>.log.idx index is written alongside it, made of "
+            "16-byte records (in native byte order) of the line's offset "
+            "(uint64), length (uint32) and level (uint8, then 3 bytes of "
+            "padding), so lines of a given level can be found without "
+            "scanning the log.");
+
+DEFINE_bool(logfile_mmap, false,
+            "When enabled, each level's log file is preallocated to "
+            "--logfile_max_size_mb and written through a memory mapping. "
+            "Lines survive the process crashing, and in synchronous mode "
+            "threads write to log files concurrently rather than taking "
+            "turns (unless also logging to stderr). Ignored with "
+            "--logfile_single or --log_format=binary, if "
+            "--logfile_max_size_mb is 0, or on Windows.");
+
+DEFINE_uint32(logfile_buffer_kb, 64,
+              "The number of KiB of log lines to buffer for each log file "
+              "before writing them out. ERROR and FATAL messages are always "
+              "written out immediately.");
+
+DEFINE_uint32(logfile_flush_interval_ms, 1000,
+              "The maximum number of milliseconds to hold buffered log lines "
+              "before writing them to their file.");
+
+DEFINE_string(log_format, "text",
+              "The format of log files: text, json or binary. JSON logs have "
+              "one object per line, with a member for each field in "
+              "--line_format and for each field of a structured message "
+              "(see LOG_KV). Binary logs are written to <logfile_name>.bin "
+              "(with a <logfile_name>.bin.dict dictionary of call sites and "
+              "threads) without formatting anything, and can be turned back "
+              "into text with cpplog_decode. Log levels aren't split into "
+              "separate files.");
+
+// NETWORK OUTPUT
+DEFINE_string(log_network, "",
+              "Also send log lines to a syslog collector, as RFC 5424 "
+              "messages: udp://host:port sends one per datagram, and "
+              "tcp://host:port keeps a connection open and frames them by "
+              "octet counting (RFC 6587). Lines are formatted as in log files "
+              "(--log_format=json sends JSON), batched and sent from a thread "
+              "of their own. If the collector falls behind, new lines are "
+              "dropped (see cpplog::SinkLinesDropped()).");
+
+DEFINE_string(log_network_min_level, "info",
+              "The minimum log level to send to --log_network.");
+
+DEFINE_uint32(log_network_facility, 1,
+              "The syslog facility to send lines with, e.g. 1 (user-level) or "
+              "16-23 (local0-local7).");
+
+DEFINE_uint32(log_network_buffer_kb, 1024,
+              "The most KiB of lines to hold for --log_network while waiting "
+              "to send them.");
+
+DEFINE_uint32(log_network_flush_interval_ms, 100,
+              "The longest to hold lines for --log_network before sending "
+              "them. They are sent sooner once a batch has built up, or when "
+              "an ERROR is logged.");
+
+// CRASH HANDLING
+DEFINE_bool(log_crash_handler, true,
+            "Whether or not Init() installs handlers for SIGSEGV, SIGBUS, "
+            "SIGFPE, SIGILL and SIGABRT which write out buffered log lines, "
+            "and any messages still in the async queue, before the program "
+            "dies. The signal is then passed on to whichever handler was "
+            "installed before.");
+
+DEFINE_uint32(log_drain_timeout_ms, 2000,
+              "With --async_logging, the longest to wait after a FATAL "
+              "message (or a crash, with --async_per_thread_buffers or "
+              "--async_sink_threads) for the emitter to write out everything "
+              "queued before it. After a FATAL message, the logger is then "
+              "shut down as it is at exit, unless the wait timed out.");
 
 // OUTPUT FORMATS
 DEFINE_string(line_format,
@@ -77,7 +202,117 @@ DEFINE_bool(async_logging, false,
 
 DEFINE_uint32(async_queue_max_len, 10000,
               "Maximum number of log messages to be stored in the queue until "
-              "any additional messages are blocked.");
+              "any additional messages are blocked. This is rounded up to the "
+              "next power of two.");
+
+DEFINE_string(async_overflow_policy, "block",
+              "What to do with new messages when the async queue is full. Can "
+              "be one of block (wait for space), drop_newest (discard the new "
+              "message), drop_oldest (discard the oldest queued message) or "
+              "drop_below (discard messages below "
+              "--async_overflow_min_level, block on the rest).");
+
+DEFINE_string(async_overflow_min_level, "warning",
+              "When --async_overflow_policy=drop_below, messages below this "
+              "level are dropped when the queue is full.");
+
+DEFINE_double(async_shed_low_watermark, 0,
+              "When the async queue (or a thread's buffer) is at least this "
+              "full, as a fraction between 0 and 1, TRACE and DEBUG messages "
+              "are sampled (see --async_shed_keep_one_in) rather than all "
+              "being queued. 0 disables load shedding.");
+
+DEFINE_double(async_shed_high_watermark, 0.9,
+              "When the async queue is at least this full (and load shedding "
+              "is enabled), TRACE and DEBUG messages are all dropped and INFO "
+              "messages are sampled. WARNING and above are never shed.");
+
+DEFINE_uint32(async_shed_keep_one_in, 10,
+              "When sampling messages to shed load, keep one in this many (at "
+              "random).");
+
+DEFINE_uint32(async_shed_summary_interval_ms, 10000,
+              "How often to log a summary of the messages shed, per level and "
+              "per call site, if any were.");
+
+DEFINE_bool(async_per_thread_buffers, false,
+            "When enabled (with --async_logging), each logging thread gets its "
+            "own message buffer rather than sharing a single queue. The "
+            "emitter drains all buffers in batches, ordered by message time.");
+
+DEFINE_uint32(async_thread_buffer_len, 1024,
+              "Maximum number of log messages to be stored in each thread's "
+              "buffer when --async_per_thread_buffers is enabled. This is "
+              "rounded up to the next power of two.");
+
+DEFINE_bool(async_numa_local_buffers, false,
+            "When enabled (with --async_per_thread_buffers), each thread's "
+            "buffer is mapped from fresh pages and faulted in by the thread "
+            "itself, so that it lives on that thread's NUMA node rather than "
+            "wherever recycled heap memory happens to be. Only on Linux.");
+
+DEFINE_bool(async_batch_writes, false,
+            "When enabled (with --async_logging), each batch of messages "
+            "drained by the emitter is written to each destination (stderr "
+            "and each log file) with a single writev() call as soon as the "
+            "batch is done, rather than line by line. Lines going to several "
+            "log files are only copied once.");
+
+DEFINE_bool(async_sink_threads, false,
+            "When enabled (with --async_logging), stderr and each log file "
+            "are written by a thread of their own, so that a slow destination "
+            "doesn't hold up the others. The emitter only renders lines and "
+            "hands them over in chunks. When --async_overflow_policy drops "
+            "messages, lines for a destination which can't keep up are "
+            "dropped too. --logfile_single, --logfile_mmap and "
+            "--log_format=binary files are still written by the emitter. "
+            "Overrides --async_batch_writes.");
+
+DEFINE_uint32(async_drain_batch_size, 256,
+              "Maximum number of messages taken from each thread's buffer per "
+              "batch when --async_per_thread_buffers is enabled, and from the "
+              "queue per batch when --log_format_threads is set.");
+
+DEFINE_uint32(log_format_threads, 0,
+              "The number of extra threads which help the emitter (with "
+              "--async_logging) render messages. Each batch is split between "
+              "them and the emitter, then written in order.");
+
+DEFINE_string(async_emitter_wait, "block",
+              "How the emitter (with --async_logging) waits for messages once "
+              "it has caught up. Can be either block (sleep until a producer "
+              "wakes it) or spin (poll for up to --async_emitter_spin_us "
+              "first, then sleep). Spinning burns some CPU, but while the "
+              "emitter spins, producers don't have to wake it up.");
+
+DEFINE_uint32(async_emitter_spin_us, 50,
+              "The longest the emitter polls for when "
+              "--async_emitter_wait=spin. It polls for less (down to a "
+              "sixteenth of this) while messages keep not arriving in time.");
+
+DEFINE_string(log_emitter_cpus, "",
+              "The CPUs to run the emitter, the --log_format_threads, the "
+              "--async_sink_threads workers and the --log_network sender on, "
+              "as a list like 0-3,8. Keeping them on one socket (ideally the "
+              "producers' socket) saves them from passing cache lines across "
+              "sockets. Empty leaves them to the scheduler. Only on Linux.");
+
+DEFINE_uint32(log_stats_interval_ms, 10000,
+              "How often to write the logger's own statistics (see "
+              "cpplog::GetStats()) to --log_stats_file and --log_stats_statsd, "
+              "if either is set.");
+
+DEFINE_string(log_stats_file, "",
+              "A file to write the logger's statistics to in the Prometheus "
+              "text format (e.g. for node_exporter's textfile collector). It "
+              "is replaced atomically each time.");
+
+DEFINE_string(log_stats_statsd, "",
+              "A host:port to send the logger's statistics to over UDP, in the "
+              "StatsD format.");
+
+DEFINE_string(log_stats_statsd_prefix, "cpplog",
+              "The prefix for the names of the metrics sent to StatsD.");
 
 DEFINE_uint32(
     max_filename_len, 20,
@@ -92,25 +327,646 @@ namespace cpplog {
 
 namespace internal {
 
+/**
+ * @brief      A message rendered for each of its outputs (see
+ *             LogMessage::RenderOutputs()).
+ */
+struct RenderedMessage {
+  Level level = TRACE;
+  bool to_stderr = false, to_files = false, to_binary = false;
+  bool to_network = false;
+
+  /**
+   * The lines (including newlines) for stderr and the text log files. The
+   * file line is also what is sent to --log_network.
+   */
+  std::string stderr_line, file_line;
+
+  /**
+   * When the message was logged.
+   */
+  std::chrono::time_point<std::chrono::system_clock> log_time;
+
+  /**
+   * What else _WriteBinaryRecord() needs, if the message goes to the binary
+   * log.
+   */
+  const CallSite* site = nullptr;
+  const char* static_format = nullptr;
+  const ThreadIdentity* thread = nullptr;
+  std::string binary_payload;
+};
+
+std::atomic<int> MIN_ENABLED_LEVEL(TRACE);
+std::atomic<unsigned int> MAX_ENABLED_VERBOSITY(UINT_MAX);
+std::atomic<uint32_t> VERBOSITY_GENERATION(1);
+
 namespace {
 
 /**
- * The message queue to store log messages in.
+ * @brief      Somewhere for one thread to wait for work, such that whoever
+ *             hands it work only pays for waking it up when it is asleep.
+ *
+ * @details    The waiter sets `sleeping_` (holding `lock_`) before it checks
+ *             for work the last time, and a notifier checks `sleeping_` after
+ *             handing the work over. There is a fence between the write and
+ *             the read on each side, so at least one of them sees the other's
+ *             write. A notifier which sees the waiter sleeping takes the lock
+ *             before notifying, so that the waiter is either still to check
+ *             for work or already waiting.
+ *
+ *             With a spin set, the waiter first polls for work without
+ *             sleeping (so notifiers have nothing to do). The time it polls
+ *             for adapts, between a sixteenth of the spin and all of it: it
+ *             doubles whenever work turns up while polling, and halves
+ *             whenever the waiter has to go to sleep.
+ */
+class Wakeup {
+ public:
+  /**
+   * @brief      Set the longest to poll for before sleeping. This must be
+   *             called before the waiter starts.
+   */
+  void SetSpin(std::chrono::nanoseconds spin) {
+    max_spin_ = spin;
+    spin_ = spin;
+  }
+
+  /**
+   * @brief      Wait until `ready()` is true, or `timeout` passes. Only one
+   *             thread may wait.
+   */
+  template <typename Ready>
+  void Wait(std::chrono::nanoseconds timeout, Ready ready) {
+    if (max_spin_.count() > 0) {
+      auto deadline = std::chrono::steady_clock::now() + spin_;
+      do {
+        if (ready()) {
+          spin_ = std::min(max_spin_, spin_ * 2);
+          return;
+        }
+      } while (std::chrono::steady_clock::now() < deadline);
+
+      spin_ = std::max(max_spin_ / 16, spin_ / 2);
+    }
+
+    std::unique_lock<std::mutex> lock(lock_);
+    sleeping_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    wake_.wait_for(lock, timeout, ready);
+    sleeping_.store(false, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief      Wake the waiter if it is asleep. Call this after changing
+   *             anything which its `ready()` checks.
+   */
+  void Notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed)) {
+      { std::lock_guard<std::mutex> lock(lock_); }
+      wake_.notify_one();
+    }
+  }
+
+ private:
+  std::mutex lock_;
+  std::condition_variable wake_;
+  std::atomic<bool> sleeping_{false};
+  std::chrono::nanoseconds max_spin_{0}, spin_{0};
+};
+
+/**
+ * The message queue to store log messages in. This is only created by Init()
+ * when --async_logging is enabled.
  */
-std::deque<LogMessage> LOG_MESSAGE_QUEUE;
-std::condition_variable LOG_MESSAGE_QUEUE_INSERT;
-std::mutex LOG_MESSAGE_QUEUE_INSERT_LOCK;
-bool SHUTTING_DOWN = false;
+std::unique_ptr<RingBuffer<LogMessage>> LOG_MESSAGE_QUEUE;
+std::atomic<bool> SHUTTING_DOWN(false);
 std::thread* LOG_EMITTER;
 
+/**
+ * Where the emitter waits for messages (or, in synchronous mode, the log file
+ * flusher waits for its next flush).
+ */
+Wakeup EMITTER_WAKEUP;
+
+/**
+ * Whether or not the calling thread is the emitter, which mustn't wait for
+ * itself to drain the queue.
+ */
+thread_local bool IS_EMITTER = false;
+
+/**
+ * Requests for the emitter to write out everything queued so far, e.g. before
+ * the program exits on a FATAL message (see _DrainQueue()). A thread asking
+ * for a drain bumps DRAINS_REQUESTED, and the emitter sets DRAINS_DONE to the
+ * last request it has seen through, notifying DRAIN_DONE under DRAIN_LOCK.
+ */
+std::atomic<uint64_t> DRAINS_REQUESTED(0), DRAINS_DONE(0);
+std::mutex DRAIN_LOCK;
+std::condition_variable DRAIN_DONE;
+
+/**
+ * Set by a crash handler before it writes anything out itself, and by the
+ * emitter once it has stopped for good as a result (see _StopIfCrashing()).
+ */
+std::atomic<bool> CRASH_WRITING(false), EMITTER_STOPPED(false);
+
+/**
+ * A per-thread message buffer, used when --async_per_thread_buffers is set.
+ * Each buffer is owned by one producer thread and drained by the emitter. When
+ * the producer exits, the buffer is marked as abandoned and the emitter frees
+ * it once it has been drained. The producer creates its own buffer, so with
+ * --async_numa_local_buffers the buffer is placed on the producer's NUMA node.
+ */
+struct ThreadBuffer {
+  ThreadBuffer(std::size_t capacity, bool local_pages)
+      : queue(capacity, local_pages), abandoned(false) {}
+
+  SpscRingBuffer<LogMessage> queue;
+  std::atomic<bool> abandoned;
+};
+
+struct ThreadBufferHandle {
+  ~ThreadBufferHandle() {
+    if (buffer != nullptr) {
+      buffer->abandoned.store(true, std::memory_order_release);
+    }
+  }
+
+  std::shared_ptr<ThreadBuffer> buffer;
+};
+
+/**
+ * All registered thread buffers. THREAD_BUFFERS_GENERATION is bumped whenever
+ * the list changes so that the emitter only has to re-read it when required.
+ */
+bool THREAD_BUFFERS_ENABLED = false;
+std::mutex THREAD_BUFFERS_LOCK;
+std::vector<std::shared_ptr<ThreadBuffer>> THREAD_BUFFERS;
+std::atomic<uint64_t> THREAD_BUFFERS_GENERATION(0);
+thread_local ThreadBufferHandle THREAD_BUFFER;
+
+/**
+ * Lock used to stop multiple threads emitting at once in synchronous mode.
+ */
+std::mutex EMIT_LOCK;
+
+/**
+ * What to do when the async queue is full. Parsed from --async_overflow_policy
+ * by Reconfigure().
+ */
+enum OverflowPolicy { BLOCK, DROP_NEWEST, DROP_OLDEST, DROP_BELOW };
+
+/**
+ * The number of messages dropped from the async queue, per level.
+ */
+std::array<std::atomic<uint64_t>, N_LEVELS> MESSAGES_DROPPED;
+
+/**
+ * The number of messages shed, per level, and the call sites which have shed
+ * any (see CallSite::CountShed()).
+ */
+std::array<std::atomic<uint64_t>, N_LEVELS> MESSAGES_SHED;
+std::mutex SHEDDING_CALL_SITES_LOCK;
+std::vector<const CallSite*> SHEDDING_CALL_SITES;
+
+/**
+ * @brief      The number of messages each producer thread has queued, per
+ *             level. Only the owning thread writes to its counts, so that
+ *             counting doesn't make producers share a cache line.
+ *
+ * @details    These are kept in a lock-free list which is never shrunk. When
+ *             a thread exits its counts are released for another thread to
+ *             carry on from, so the totals are never lost.
+ */
+struct ProducerCounts {
+  std::array<std::atomic<uint64_t>, N_LEVELS> enqueued;
+  std::atomic<bool> in_use;
+  ProducerCounts* next;
+};
+
+struct ProducerCountsHandle {
+  ~ProducerCountsHandle() {
+    if (counts != nullptr) {
+      counts->in_use.store(false, std::memory_order_release);
+    }
+  }
+
+  ProducerCounts* counts = nullptr;
+};
+
+std::atomic<ProducerCounts*> PRODUCER_COUNTS(nullptr);
+thread_local ProducerCountsHandle PRODUCER_COUNTS_HANDLE;
+
+/**
+ * The number of messages emitted per level, how full the emitter has found
+ * the queue, and how long producers have waited for space in it (see
+ * GetStats()).
+ */
+std::array<std::atomic<uint64_t>, N_LEVELS> MESSAGES_EMITTED;
+std::atomic<uint64_t> QUEUE_HIGH_WATER(0);
+std::atomic<uint64_t> PRODUCER_WAITS(0), PRODUCER_WAIT_NS(0);
+
+/**
+ * The sizes of the emitter's batches, and the writes made to each kind of
+ * output.
+ */
+AtomicHistogram EMITTER_BATCH_SIZES;
+SinkCounters STDERR_COUNTERS, LOG_FILE_COUNTERS, BINARY_LOG_COUNTERS,
+    NETWORK_COUNTERS;
+
+/**
+ * Reports statistics if --log_stats_file or --log_stats_statsd is set.
+ * Created by Init().
+ */
+std::unique_ptr<StatsReporter> STATS_REPORTER;
+
 /**
  * Log files to write to. They will be opened only once (when they are used) and
- * will be written to from then on.
+ * will be written to from then on. Anything still buffered is written out when
+ * they are destroyed at exit.
+ */
+std::array<std::unique_ptr<FileSink>, N_LEVELS> LOG_FILES;
+
+/**
+ * Rotates log files in the background. Created by Init(). Defined before the
+ * log files so that it outlives them.
+ */
+std::unique_ptr<LogRotator> LOG_ROTATOR;
+
+/**
+ * Log files used instead of LOG_FILES when --logfile_mmap is set. They are all
+ * opened by Init(), as they can be written by several threads at once.
+ */
+bool MMAP_LOG_FILES_ENABLED = false;
+std::array<std::unique_ptr<MmapFileSink>, N_LEVELS> MMAP_LOG_FILES;
+
+/**
+ * The path of each level's log file. These are worked out once by Init().
+ */
+std::array<std::string, N_LEVELS> LOG_FILE_PATHS;
+
+/**
+ * The path of the --logfile_single log file, worked out along with
+ * LOG_FILE_PATHS.
+ */
+std::string SINGLE_LOG_PATH;
+
+/**
+ * The log file and its index used when --logfile_single is set.
+ */
+std::unique_ptr<FileSink> SINGLE_LOG_FILE, SINGLE_LOG_INDEX;
+
+/**
+ * @brief      The lines rendered by the emitter during a batch, when
+ *             --async_batch_writes is set.
+ *
+ * @details    Each line is copied in once, and every destination queues a
+ *             pointer to it (see FileSink::Queue()). The whole batch is
+ *             written by _WriteBatch() at the end of each drain of the queue,
+ *             or earlier if it fills up. The storage never moves, so queued
+ *             pointers stay valid until then.
+ */
+struct WriteBatch {
+  std::unique_ptr<char[]> data;
+  std::size_t size = 0, capacity = 0;
+  std::vector<iovec> to_stderr;
+};
+bool BATCH_WRITES = false;
+WriteBatch WRITE_BATCH;
+
+/**
+ * Threads writing to stderr and to each of LOG_FILES, when
+ * --async_sink_threads is set. They are started by the emitter the first time
+ * they are needed. Once a log file has a worker, only the worker touches it.
+ */
+bool SINK_WORKERS_ENABLED = false;
+std::unique_ptr<SinkWorker> STDERR_WORKER;
+std::array<std::unique_ptr<SinkWorker>, N_LEVELS> LOG_FILE_WORKERS;
+
+/**
+ * The number of chunks of lines which can be waiting for each sink worker,
+ * and the number of lines dropped because a worker (or the network sink) had
+ * no room left.
+ */
+constexpr std::size_t kSinkWorkerChunks = 16;
+std::atomic<uint64_t> SINK_LINES_DROPPED(0);
+
+/**
+ * Sends lines to --log_network, if it is set. Created by Init().
+ */
+std::unique_ptr<NetworkSink> NETWORK_SINK;
+
+/**
+ * Statistics about the batches drained by the emitter (see GetBatchStats()).
+ */
+std::atomic<uint64_t> EMITTER_BATCHES(0), EMITTER_BATCH_MESSAGES(0),
+    EMITTER_MAX_BATCH_SIZE(0);
+
+/**
+ * The format of log files (--log_format).
+ */
+enum LogFormat { TEXT, BINARY, JSON };
+
+struct CompiledLineFormat;
+
+/**
+ * @brief      The logging flags which can be changed at runtime, parsed once
+ *             by Reconfigure().
+ *
+ * @details    Each snapshot is immutable once it has been published in
+ *             CONFIG, so any thread can use the current one without locking
+ *             while Reconfigure() builds the next. Threads use a snapshot
+ *             through a ScopedPinnedConfig, which publishes it as the
+ *             thread's hazard pointer. Reconfigure() frees the replaced
+ *             snapshots which no thread has pinned, so at most one replaced
+ *             snapshot per pinning thread is kept at a time. Caches which
+ *             outlive a pin compare `generation`, not addresses, since a new
+ *             snapshot may reuse a freed one's.
+ */
+struct Config {
+  /**
+   * Counts up from 1 with each Reconfigure().
+   */
+  uint64_t generation;
+
+  /**
+   * --logtostderr and --logtofile, and the lowest level each shows.
+   */
+  bool to_stderr, to_files;
+  Level min_stderr_level, min_file_level;
+
+  /**
+   * Whether --log_network is set, and the lowest level sent to it.
+   */
+  bool to_network;
+  Level min_network_level;
+
+  uint32_t verbosity;
+
+  /**
+   * The --vmodule patterns and their verbosities, in order.
+   */
+  std::vector<std::pair<std::string, uint32_t>> vmodule;
+
+  LogFormat log_format;
+
+  /**
+   * --line_format, and the same compiled with --colorize_output.
+   */
+  std::string line_format;
+  std::unique_ptr<const CompiledLineFormat> compiled_line_format;
+  bool colorize;
+
+  /**
+   * --datetime_format, and the number of sub-second digits to show.
+   */
+  std::string datetime_format;
+  int datetime_digits;
+
+  uint32_t max_filename_len, max_line_number_len;
+  bool logfile_single;
+  uint64_t logfile_max_size;
+
+  /**
+   * The overflow policy, and the lowest level DROP_BELOW keeps.
+   */
+  OverflowPolicy overflow_policy;
+  Level overflow_min_level;
+
+  /**
+   * The load shedding watermarks, in thousandths of the queue's capacity, and
+   * the sampling rate. A low watermark of 0 disables shedding.
+   */
+  uint32_t shed_low_watermark, shed_high_watermark, shed_keep_one_in;
+
+  /**
+   * Defined once CompiledLineFormat is, which the config owns.
+   */
+  ~Config();
+};
+
+std::atomic<const Config*> CONFIG(nullptr);
+std::mutex CONFIG_LOCK;
+std::unique_ptr<const Config> CURRENT_CONFIG;
+uint64_t CONFIG_GENERATION = 0;
+
+/**
+ * The configs which have been replaced, but might still be pinned.
+ */
+std::vector<std::unique_ptr<const Config>> RETIRED_CONFIGS;
+
+/**
+ * @brief      A thread's hazard pointer: the config it has pinned, which
+ *             Reconfigure() mustn't free. Readers are never freed. Once a
+ *             thread exits, its reader is reused by the next new thread.
+ */
+struct ConfigReader {
+  std::atomic<const Config*> pinned{nullptr};
+  std::atomic<bool> in_use{true};
+  ConfigReader* next = nullptr;
+};
+
+/**
+ * Every thread's reader, as a list which is only ever pushed onto.
+ */
+std::atomic<ConfigReader*> CONFIG_READERS(nullptr);
+
+thread_local ConfigReader* CONFIG_READER = nullptr;
+
+/**
+ * @brief      Get the calling thread's reader, claiming one the first time.
+ */
+ConfigReader* _GetConfigReader() {
+  if (CONFIG_READER != nullptr) {
+    return CONFIG_READER;
+  }
+
+  ConfigReader* head = CONFIG_READERS.load(std::memory_order_acquire);
+  for (ConfigReader* reader = head; reader != nullptr; reader = reader->next) {
+    bool in_use = false;
+    if (!reader->in_use.load(std::memory_order_relaxed) &&
+        reader->in_use.compare_exchange_strong(in_use, true,
+                                               std::memory_order_acquire)) {
+      CONFIG_READER = reader;
+      break;
+    }
+  }
+
+  if (CONFIG_READER == nullptr) {
+    auto* reader = new ConfigReader();
+    reader->next = head;
+    while (!CONFIG_READERS.compare_exchange_weak(reader->next, reader,
+                                                 std::memory_order_acq_rel)) {
+    }
+
+    CONFIG_READER = reader;
+  }
+
+  // Hand the reader back when the thread exits.
+  static thread_local struct Releaser {
+    ~Releaser() {
+      CONFIG_READER->in_use.store(false, std::memory_order_release);
+      CONFIG_READER = nullptr;
+    }
+  } releaser;
+  (void)releaser;
+
+  return CONFIG_READER;
+}
+
+/**
+ * @brief      Free the retired configs which no thread has pinned. Called by
+ *             Reconfigure() (with CONFIG_LOCK held) after publishing a new
+ *             config, so that a thread pinning one of them afterwards would
+ *             see it has been replaced, and pin the new one instead.
+ */
+void _FreeUnpinnedConfigs() {
+  // The crash handler reads CONFIG without pinning it.
+  if (CRASH_WRITING.load(std::memory_order_seq_cst)) {
+    return;
+  }
+
+  std::vector<const Config*> pinned;
+  for (ConfigReader* reader = CONFIG_READERS.load(std::memory_order_acquire);
+       reader != nullptr; reader = reader->next) {
+    pinned.push_back(reader->pinned.load(std::memory_order_seq_cst));
+  }
+
+  auto is_unpinned = [&pinned](const std::unique_ptr<const Config>& config) {
+    return std::find(pinned.begin(), pinned.end(), config.get()) ==
+           pinned.end();
+  };
+
+  auto& retired = RETIRED_CONFIGS;
+  retired.erase(std::remove_if(retired.begin(), retired.end(), is_unpinned),
+                retired.end());
+}
+
+/**
+ * The config which the calling thread has pinned, if any.
+ */
+thread_local const Config* PINNED_CONFIG = nullptr;
+
+/**
+ * @brief      Pins the current config for as long as this is in scope, so
+ *             that everything the calling thread does in the meantime (e.g.
+ *             rendering and writing a message) uses that one config, and
+ *             Reconfigure() can't free it. Pins nest: an inner pin carries on
+ *             with the outer one's config.
+ */
+class ScopedPinnedConfig {
+ public:
+  ScopedPinnedConfig() : previous_(PINNED_CONFIG), reader_(nullptr) {
+    if (previous_ != nullptr) {
+      return;
+    }
+
+    // Init() is optional in synchronous mode, so the flags are read here if
+    // nothing has read them yet.
+    if (CONFIG.load(std::memory_order_acquire) == nullptr) {
+      Reconfigure();
+    }
+
+    // Publish the hazard, then check that the config is still current. If it
+    // is, any Reconfigure() which replaces it will see the hazard.
+    reader_ = _GetConfigReader();
+    const Config* config = CONFIG.load(std::memory_order_acquire);
+    while (true) {
+      reader_->pinned.store(config, std::memory_order_seq_cst);
+      const Config* current = CONFIG.load(std::memory_order_seq_cst);
+      if (current == config) {
+        break;
+      }
+
+      config = current;
+    }
+
+    PINNED_CONFIG = config;
+  }
+
+  /**
+   * @brief      Use a config which another thread has pinned, and keeps pinned
+   *             for as long as this is in scope (e.g. for the format pool,
+   *             which renders the emitter's batch).
+   */
+  explicit ScopedPinnedConfig(const Config& lent)
+      : previous_(PINNED_CONFIG), reader_(nullptr) {
+    PINNED_CONFIG = &lent;
+  }
+
+  ~ScopedPinnedConfig() {
+    PINNED_CONFIG = previous_;
+    if (reader_ != nullptr) {
+      reader_->pinned.store(nullptr, std::memory_order_release);
+    }
+  }
+
+ private:
+  const Config* previous_;
+  ConfigReader* reader_;
+};
+
+/**
+ * @brief      Get the calling thread's pinned config. Everything which reads
+ *             the config does so inside a ScopedPinnedConfig.
  */
-std::array<std::ofstream, N_LEVELS> LOG_FILES;
+const Config& _GetConfig() {
+  if (PINNED_CONFIG != nullptr) {
+    return *PINNED_CONFIG;
+  }
+
+  // Not reached, but better a config which might be replaced than none.
+  const Config* config = CONFIG.load(std::memory_order_acquire);
+  if (config == nullptr) {
+    Reconfigure();
+    config = CONFIG.load(std::memory_order_acquire);
+  }
+
+  return *config;
+}
+
+/**
+ * @brief      The state of the --log_format=binary log and its dictionary.
+ */
+struct BinaryLog {
+  std::unique_ptr<FileSink> file, dict;
+
+  /**
+   * The log time of the last record, in nanoseconds since the epoch. Records
+   * store the difference from this.
+   */
+  int64_t last_time_ns = 0;
+
+  /**
+   * The ids of the call sites and threads already in the dictionary.
+   */
+  std::unordered_map<const CallSite*, uint64_t> call_sites;
+  std::unordered_map<const ThreadIdentity*, uint64_t> threads;
+
+  std::string record, entry;
+};
+BinaryLog BINARY_LOG;
+
+/**
+ * @brief      A record in the --logfile_single index.
+ */
+struct LogIndexRecord {
+  uint64_t offset;
+  uint32_t length;
+  uint8_t level;
+  uint8_t padding[3];
+};
+
+/**
+ * Thread used to periodically flush log files in synchronous mode. In async
+ * mode, the emitter thread does this itself.
+ */
+std::thread* LOG_FLUSHER;
 
 // UTILITY FUNCTIONS.
-std::string _LevelToString(Level level) {
+const char* _LevelToString(Level level) {
   switch (level) {
     case TRACE:
       return "T";
@@ -188,276 +1044,3399 @@ std::string _GetColor(Level level) {
   }
 }
 
+OverflowPolicy _StringToOverflowPolicy(const std::string& policy) {
+  auto policy_lower = string::ToLower(policy);
+  if (policy_lower == "drop_newest") {
+    return DROP_NEWEST;
+  } else if (policy_lower == "drop_oldest") {
+    return DROP_OLDEST;
+  } else if (policy_lower == "drop_below") {
+    return DROP_BELOW;
+  } else {
+    return BLOCK;
+  }
+}
+
 /**
- * @brief      Actually emit a message to all output streams.
- *
- *             This will, based on the current logging configuration, either:
- *             - Output to a file, based on the logging level.
- *             - Output to the display, based on the minimum level.
- *
- *             Calls to Emit() will be locked during synchronous mode to ensure
- *             that multiple threads do not print over eachother.
- *
- * @param[in]  msg   The message to emit.
+ * @brief      Parse --vmodule into (pattern, verbosity) pairs. Entries without
+ *             a pattern or a numeric verbosity are ignored.
  */
-void _DoEmitMessage(const LogMessage& msg) {
-  static std::mutex emit_lock;
+std::vector<std::pair<std::string, uint32_t>> _ParseVmodule(
+    const std::string& vmodule) {
+  std::vector<std::pair<std::string, uint32_t>> patterns;
+  std::size_t start = 0;
+  while (start <= vmodule.length()) {
+    std::size_t end = vmodule.find(',', start);
+    end = end == std::string::npos ? vmodule.length() : end;
+    std::string entry = vmodule.substr(start, end - start);
+    start = end + 1;
 
-  // If we aren't logging, then stop. This might make things a bit faster when
-  // logging is disabled.
-  if (!FLAGS_logtofile && !FLAGS_logtostderr) {
+    auto equals = entry.rfind('=');
+    if (equals == std::string::npos || equals == 0 ||
+        equals + 1 == entry.length() ||
+        entry.find_first_not_of("0123456789", equals + 1) !=
+            std::string::npos) {
+      continue;
+    }
+
+    patterns.emplace_back(
+        entry.substr(0, equals),
+        uint32_t(std::strtoul(entry.c_str() + equals + 1, nullptr, 10)));
+  }
+
+  return patterns;
+}
+
+/**
+ * @brief      Whether or not a glob pattern, which may contain * and ?, matches
+ *             the whole of some text.
+ */
+bool _GlobMatches(const char* pattern, const char* text) {
+  // Backtrack to just after the last *, with it matching one more character.
+  const char* star = nullptr;
+  const char* star_text = nullptr;
+  while (*text != '\0') {
+    if (*pattern == '*') {
+      star = ++pattern;
+      star_text = text;
+    } else if (*pattern == '?' || *pattern == *text) {
+      pattern++;
+      text++;
+    } else if (star != nullptr) {
+      pattern = star;
+      text = ++star_text;
+    } else {
+      return false;
+    }
+  }
+
+  while (*pattern == '*') {
+    pattern++;
+  }
+
+  return *pattern == '\0';
+}
+
+/**
+ * @brief      Get the verbosity for messages from a file: the level for the
+ *             first --vmodule pattern matching its name (with or without its
+ *             extension), or else --v.
+ */
+uint32_t _VerbosityForFile(const Config& config, const char* file) {
+  if (config.vmodule.empty()) {
+    return config.verbosity;
+  }
+
+  std::string module = file;
+  module = module.substr(0, module.rfind('.'));
+  for (const auto& pattern : config.vmodule) {
+    if (_GlobMatches(pattern.first.c_str(), file) ||
+        _GlobMatches(pattern.first.c_str(), module.c_str())) {
+      return pattern.second;
+    }
+  }
+
+  return config.verbosity;
+}
+
+/**
+ * @brief      Back off after failing to push to a full queue. This spins for a
+ *             little while, then yields, then sleeps for increasing amounts of
+ *             time so that blocked producers don't burn a whole core.
+ *
+ * @param      attempt  The number of times we have backed off so far.
+ */
+void _Backoff(int* attempt) {
+  static const int kSpins = 64, kYields = 128;
+  int n = (*attempt)++;
+  if (n < kSpins) {
+    ;
+  } else if (n < kSpins + kYields) {
+    std::this_thread::yield();
+  } else {
+    int shift = std::min(n - (kSpins + kYields), 5);
+    std::this_thread::sleep_for(std::chrono::microseconds(50 << shift));
+  }
+}
+
+/**
+ * @brief      Whether or not several threads can emit messages at once in
+ *             synchronous mode, with some config. That's only when the only
+ *             files are --logfile_mmap per-level text files, which are written
+ *             without a lock, and nothing goes to stderr. (The network sink
+ *             has a lock of its own.) Otherwise the binary log, the single log
+ *             file and stderr would be written by several threads at once.
+ */
+bool _EmitsWithoutLock(const Config& config) {
+  return MMAP_LOG_FILES_ENABLED && !config.to_stderr &&
+         !config.logfile_single && config.log_format != BINARY;
+}
+
+/**
+ * @brief      Actually emit a message to all output streams.
+ *
+ *             This will, based on the current logging configuration, either:
+ *             - Output to a file, based on the logging level.
+ *             - Output to the display, based on the minimum level.
+ *
+ *             This is not thread-safe; callers in synchronous mode must hold
+ *             EMIT_LOCK to ensure that multiple threads do not print over
+ *             eachother. The exception is when only --logfile_mmap files are
+ *             being written to (see _EmitsWithoutLock()), which can be done
+ *             concurrently.
+ *
+ * @param[in]  msg   The message to emit.
+ */
+void _DoEmitMessage(const LogMessage& msg) {
+  // If we aren't logging, then stop. This might make things a bit faster when
+  // logging is disabled.
+  ScopedPinnedConfig pin;
+  const Config& config = _GetConfig();
+  if (!config.to_files && !config.to_stderr && !config.to_network) {
+    return;
+  }
+
+  msg.Emit(config.line_format);
+}
+
+/**
+ * @brief      Flush any log files which have had lines buffered for longer than
+ *             --logfile_flush_interval_ms. With the same locking requirements
+ *             as _DoEmitMessage().
+ */
+void _FlushLogFilesIfDue() {
+  for (int i = 0; i < N_LEVELS; i++) {
+    if (LOG_FILE_WORKERS[i] == nullptr && LOG_FILES[i] != nullptr) {
+      LOG_FILES[i]->FlushIfDue();
+    }
+  }
+
+  if (SINGLE_LOG_FILE != nullptr) {
+    SINGLE_LOG_FILE->FlushIfDue();
+    SINGLE_LOG_INDEX->FlushIfDue();
+  }
+
+  if (BINARY_LOG.file != nullptr) {
+    BINARY_LOG.file->FlushIfDue();
+  }
+}
+
+/**
+ * @brief      Write out everything buffered for all log files.
+ */
+void _FlushLogFiles() {
+  for (int i = 0; i < N_LEVELS; i++) {
+    if (LOG_FILE_WORKERS[i] == nullptr && LOG_FILES[i] != nullptr) {
+      LOG_FILES[i]->Flush();
+    }
+  }
+
+  if (SINGLE_LOG_FILE != nullptr) {
+    SINGLE_LOG_FILE->Flush();
+    SINGLE_LOG_INDEX->Flush();
+  }
+
+  if (BINARY_LOG.file != nullptr) {
+    BINARY_LOG.file->Flush();
+  }
+}
+
+/**
+ * @brief      Work out the paths of the log files.
+ */
+void _SetLogFilePaths() {
+  for (int i = 0; i < N_LEVELS; i++) {
+    LOG_FILE_PATHS[i] =
+        (boost::filesystem::path(FLAGS_logfile_dir) /
+         (FLAGS_logfile_name + "." + _LevelToLongString((Level)i)))
+            .string();
+  }
+
+  SINGLE_LOG_PATH = (boost::filesystem::path(FLAGS_logfile_dir) /
+                     (FLAGS_logfile_name + ".log"))
+                        .string();
+}
+
+/**
+ * @brief      Open a log file using the --logfile_* settings.
+ *
+ * @param[in]  path      The path to the file.
+ * @param[in]  max_size  The size to rotate at, in bytes (0 to never rotate).
+ * @param[in]  counters  Where to count the file's writes.
+ */
+std::unique_ptr<FileSink> _OpenLogFile(const std::string& path,
+                                       uint64_t max_size,
+                                       SinkCounters* counters) {
+  return std::unique_ptr<FileSink>(new FileSink(
+      path, max_size, std::size_t(FLAGS_logfile_buffer_kb) * 1024,
+      std::chrono::milliseconds(FLAGS_logfile_flush_interval_ms),
+      LOG_ROTATOR.get(), counters));
+}
+
+/**
+ * @brief      Convert a string into a LogFormat. Unknown formats are treated as
+ *             text.
+ */
+LogFormat _StringToLogFormat(const std::string& format) {
+  auto format_lower = string::ToLower(format);
+  if (format_lower == "binary") {
+    return BINARY;
+  } else if (format_lower == "json") {
+    return JSON;
+  } else {
+    return TEXT;
+  }
+}
+
+/**
+ * @brief      Write out the current write batch: one writev() for stderr and
+ *             one for each log file.
+ */
+void _WriteBatch() {
+  if (!WRITE_BATCH.to_stderr.empty()) {
+    std::size_t length = 0;
+    for (const auto& line : WRITE_BATCH.to_stderr) {
+      length += line.iov_len;
+    }
+
+    ScopedWriteTimer timer(&STDERR_COUNTERS, length);
+    WriteVectored(fileno(stderr), WRITE_BATCH.to_stderr.data(),
+                  WRITE_BATCH.to_stderr.size());
+    WRITE_BATCH.to_stderr.clear();
+  }
+
+  _FlushLogFiles();
+  WRITE_BATCH.size = 0;
+}
+
+/**
+ * @brief      Copy some data into the current write batch, writing the batch
+ *             out first if there isn't room.
+ *
+ * @return     The copy, which stays valid until the batch is written, or
+ *             nullptr if the data is too large to batch.
+ */
+const char* _AddToWriteBatch(const char* data, std::size_t length) {
+  if (WRITE_BATCH.data == nullptr) {
+    WRITE_BATCH.capacity = std::size_t(FLAGS_logfile_buffer_kb) * 1024;
+    WRITE_BATCH.data.reset(new char[WRITE_BATCH.capacity]);
+  }
+
+  if (length > WRITE_BATCH.capacity) {
+    return nullptr;
+  }
+
+  if (WRITE_BATCH.size + length > WRITE_BATCH.capacity) {
+    _WriteBatch();
+  }
+
+  char* copy = WRITE_BATCH.data.get() + WRITE_BATCH.size;
+  std::memcpy(copy, data, length);
+  WRITE_BATCH.size += length;
+  return copy;
+}
+
+/**
+ * @brief      Called by the emitter after it has emitted a batch of messages.
+ *
+ * @param[in]  n_messages  The number of messages in the batch.
+ */
+void _EndEmitterBatch(uint64_t n_messages) {
+  if (n_messages == 0) {
+    return;
+  }
+
+  if (BATCH_WRITES) {
+    _WriteBatch();
+  }
+
+  if (STDERR_WORKER != nullptr) {
+    STDERR_WORKER->Submit();
+  }
+
+  for (auto& worker : LOG_FILE_WORKERS) {
+    if (worker != nullptr) {
+      worker->Submit();
+    }
+  }
+
+  // Only the emitter writes these, so there's no need for a CAS.
+  EMITTER_BATCHES.fetch_add(1, std::memory_order_relaxed);
+  EMITTER_BATCH_MESSAGES.fetch_add(n_messages, std::memory_order_relaxed);
+  if (n_messages > EMITTER_MAX_BATCH_SIZE.load(std::memory_order_relaxed)) {
+    EMITTER_MAX_BATCH_SIZE.store(n_messages, std::memory_order_relaxed);
+  }
+
+  EMITTER_BATCH_SIZES.Record(n_messages);
+}
+
+/**
+ * @brief      Write a rendered line (including newline) to stderr.
+ */
+void _WriteToStderr(const std::string& line) {
+  if (BATCH_WRITES) {
+    const char* copy = _AddToWriteBatch(line.data(), line.length());
+    if (copy != nullptr) {
+      iovec buffer;
+      buffer.iov_base = const_cast<char*>(copy);
+      buffer.iov_len = line.length();
+      WRITE_BATCH.to_stderr.push_back(buffer);
+      return;
+    }
+  }
+
+  ScopedWriteTimer timer(&STDERR_COUNTERS, line.length());
+  std::cerr.write(line.data(), line.length());
+  std::cerr.flush();
+}
+
+/**
+ * @brief      Write a rendered line (including newline) to the log files. The
+ *             line is written as-is to every file it belongs in.
+ */
+void _WriteToLogFiles(const std::string& line, Level level) {
+  // The single log file takes the same levels as the per-level files do
+  // between them.
+  const Config& config = _GetConfig();
+  if (level < config.min_file_level) {
+    return;
+  }
+
+  // Errors are written out immediately, everything else is buffered. When
+  // batching, the line is copied into the batch once and queued on each file.
+  bool flush_now = level >= ERROR;
+  uint64_t max_size = config.logfile_max_size;
+  const char* data = line.data();
+  const char* batched = BATCH_WRITES && !MMAP_LOG_FILES_ENABLED
+                            ? _AddToWriteBatch(line.data(), line.length())
+                            : nullptr;
+  auto write = [batched, flush_now](FileSink* file, const char* bytes,
+                                    std::size_t length) {
+    if (batched != nullptr) {
+      file->Queue(bytes, length);
+    } else {
+      file->Write(bytes, length, flush_now);
+    }
+  };
+
+  if (batched != nullptr) {
+    data = batched;
+  }
+
+  if (config.logfile_single) {
+    if (SINGLE_LOG_FILE == nullptr) {
+      if (SINGLE_LOG_PATH.empty()) {
+        _SetLogFilePaths();
+      }
+
+      SINGLE_LOG_FILE =
+          _OpenLogFile(SINGLE_LOG_PATH, max_size, &LOG_FILE_COUNTERS);
+      SINGLE_LOG_INDEX =
+          _OpenLogFile(SINGLE_LOG_PATH + ".idx", 0, &LOG_FILE_COUNTERS);
+    }
+
+    // The index is rotated along with the log, so offsets always refer to
+    // the current log file.
+    auto rotations = SINGLE_LOG_FILE->rotations();
+    uint64_t offset = SINGLE_LOG_FILE->bytes_written();
+    write(SINGLE_LOG_FILE.get(), data, line.length());
+    if (SINGLE_LOG_FILE->rotations() != rotations) {
+      SINGLE_LOG_INDEX->Rotate();
+      offset = 0;
+    }
+
+    LogIndexRecord record = {offset, uint32_t(line.length()), uint8_t(level),
+                             {0, 0, 0}};
+    const char* record_data = reinterpret_cast<const char*>(&record);
+    if (batched != nullptr) {
+      record_data = _AddToWriteBatch(record_data, sizeof(record));
+    }
+
+    write(SINGLE_LOG_INDEX.get(), record_data, sizeof(record));
+    return;
+  }
+
+  auto min_level = config.min_file_level;
+  if (MMAP_LOG_FILES_ENABLED) {
+    for (int i = min_level; i <= level; i++) {
+      if (MMAP_LOG_FILES[i] != nullptr) {
+        MMAP_LOG_FILES[i]->Write(line.data(), line.length());
+      }
+    }
+
+    return;
+  }
+
+  // Log to all of the relevant files.
+  if (LOG_FILE_PATHS[TRACE].empty()) {
+    _SetLogFilePaths();
+  }
+
+  for (int i = min_level; i <= level; i++) {
+    auto& log_file = LOG_FILES[i];
+    if (log_file == nullptr) {
+      log_file = _OpenLogFile(LOG_FILE_PATHS[i], max_size, &LOG_FILE_COUNTERS);
+    }
+
+    write(log_file.get(), data, line.length());
+  }
+}
+
+/**
+ * @brief      Write a record to the --log_format=binary log, adding the call
+ *             site and thread to the dictionary first if they're new.
+ *
+ * @param[in]  site      The call site the message was logged from.
+ * @param[in]  format    The call site's format string, or nullptr if it
+ *                       doesn't have a fixed one.
+ * @param[in]  log_time  The time the message was logged.
+ * @param[in]  thread    The thread which logged the message.
+ * @param[in]  payload   The record's kind and payload (see
+ *                       LogMessage::_AppendBinaryPayload()).
+ */
+void _WriteBinaryRecord(
+    const CallSite* site, const char* format,
+    const std::chrono::time_point<std::chrono::system_clock>& log_time,
+    const ThreadIdentity* thread, const std::string& payload) {
+  auto& log = BINARY_LOG;
+  if (log.file == nullptr) {
+    auto path = (boost::filesystem::path(FLAGS_logfile_dir) /
+                 (FLAGS_logfile_name + ".bin"))
+                    .string();
+
+    // The log is rotated here rather than by the sink, so that every file
+    // starts with a header. The dictionary applies to all of them.
+    log.file = _OpenLogFile(path, 0, &BINARY_LOG_COUNTERS);
+    log.dict = _OpenLogFile(path + ".dict", 0, &BINARY_LOG_COUNTERS);
+    log.dict->Write(kBinaryDictMagic, kBinaryMagicLength, true);
+  }
+
+  // Describe anything new in the dictionary. These are written straight
+  // away, so that the dictionary is never behind the log.
+  auto site_id = log.call_sites.find(site);
+  if (site_id == log.call_sites.end()) {
+    site_id = log.call_sites.emplace(site, log.call_sites.size()).first;
+    log.entry.clear();
+    log.entry.push_back(static_cast<char>(DICT_CALL_SITE));
+    AppendVarint(site_id->second, &log.entry);
+    log.entry.push_back(static_cast<char>(site->level()));
+    AppendVarint(uint64_t(site->line()), &log.entry);
+    AppendString(site->file(), std::strlen(site->file()), &log.entry);
+    std::size_t format_length = format == nullptr ? 0 : std::strlen(format);
+    AppendString(format, format_length, &log.entry);
+    log.dict->Write(log.entry.data(), log.entry.length(), true);
+  }
+
+  auto thread_id = log.threads.find(thread);
+  if (thread_id == log.threads.end()) {
+    thread_id = log.threads.emplace(thread, log.threads.size()).first;
+    log.entry.clear();
+    log.entry.push_back(static_cast<char>(DICT_THREAD));
+    AppendVarint(thread_id->second, &log.entry);
+    AppendString(thread->text.data(), thread->text.length(), &log.entry);
+    log.dict->Write(log.entry.data(), log.entry.length(), true);
+  }
+
+  // Start a new file (with absolute times) when this one is full. The four
+  // varints before the payload take up at most 40 bytes.
+  uint64_t max_size = _GetConfig().logfile_max_size;
+  auto* file = log.file.get();
+  if (max_size > 0 && file->bytes_written() > kBinaryMagicLength &&
+      file->bytes_written() + payload.length() + 40 > max_size) {
+    file->Rotate();
+  }
+
+  if (file->bytes_written() == 0) {
+    file->Write(kBinaryLogMagic, kBinaryMagicLength, false);
+    log.last_time_ns = 0;
+  }
+
+  // Build the record. The length is only known once the rest is done.
+  int64_t time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        log_time.time_since_epoch())
+                        .count();
+  log.entry.clear();
+  AppendZigZag(time_ns - log.last_time_ns, &log.entry);
+  AppendVarint(site_id->second, &log.entry);
+  AppendVarint(thread_id->second, &log.entry);
+  log.record.clear();
+  AppendVarint(log.entry.length() + payload.length(), &log.record);
+  log.record.append(log.entry);
+  log.record.append(payload);
+
+  log.last_time_ns = time_ns;
+  file->Write(log.record.data(), log.record.length(),
+              site->level() >= ERROR);
+}
+
+/**
+ * @brief      Start a sink worker. Workers block when they fall behind, unless
+ *             the overflow policy drops messages.
+ */
+std::unique_ptr<SinkWorker> _StartSinkWorker(SinkWorker::WriteFunction write,
+                                             SinkWorker::IdleFunction idle) {
+  auto policy = _GetConfig().overflow_policy;
+  return std::unique_ptr<SinkWorker>(new SinkWorker(
+      write, idle, kSinkWorkerChunks,
+      std::chrono::milliseconds(FLAGS_logfile_flush_interval_ms),
+      policy != DROP_NEWEST && policy != DROP_OLDEST));
+}
+
+/**
+ * @brief      Get the worker writing to a level's log file, starting it if
+ *             this is the first line for that file. Only called by the
+ *             emitter.
+ */
+SinkWorker* _GetLogFileWorker(int level) {
+  auto& worker = LOG_FILE_WORKERS[level];
+  if (worker == nullptr) {
+    if (LOG_FILE_PATHS[TRACE].empty()) {
+      _SetLogFilePaths();
+    }
+
+    uint64_t max_size = _GetConfig().logfile_max_size;
+    worker = _StartSinkWorker(
+        [level, max_size](const char* data, std::size_t length,
+                          bool flush_now) {
+          auto& log_file = LOG_FILES[level];
+          if (log_file == nullptr) {
+            log_file = _OpenLogFile(LOG_FILE_PATHS[level], max_size,
+                                    &LOG_FILE_COUNTERS);
+          }
+
+          log_file->Write(data, length, flush_now);
+        },
+        [level] {
+          if (LOG_FILES[level] != nullptr) {
+            LOG_FILES[level]->FlushIfDue();
+          }
+        });
+  }
+
+  return worker.get();
+}
+
+/**
+ * @brief      Hand a line to a sink worker, counting it if it is dropped.
+ */
+void _AppendToSinkWorker(SinkWorker* worker, const std::string& line,
+                         bool flush_now) {
+  if (!worker->Append(line.data(), line.length(), flush_now)) {
+    SINK_LINES_DROPPED.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * @brief      Get the syslog severity of a level: 7 (debug) for TRACE and
+ *             DEBUG, down to 2 (critical) for FATAL.
+ */
+int _SyslogSeverity(Level level) {
+  static const int kSeverities[] = {7, 7, 6, 4, 3, 2};
+  return kSeverities[level];
+}
+
+/**
+ * @brief      Write a rendered message to all of its outputs. With the same
+ *             locking requirements as _DoEmitMessage().
+ */
+void _WriteRenderedMessage(const RenderedMessage& msg) {
+  if (msg.to_stderr || msg.to_files || msg.to_binary || msg.to_network) {
+    MESSAGES_EMITTED[msg.level].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  if (msg.to_network && NETWORK_SINK != nullptr) {
+    NETWORK_SINK->Write(_SyslogSeverity(msg.level), msg.log_time,
+                        msg.file_line.data(), msg.file_line.length());
+  }
+
+  if (msg.to_binary) {
+    _WriteBinaryRecord(msg.site, msg.static_format, msg.log_time, msg.thread,
+                       msg.binary_payload);
+  }
+
+  if (msg.to_stderr) {
+    if (SINK_WORKERS_ENABLED) {
+      if (STDERR_WORKER == nullptr) {
+        STDERR_WORKER = _StartSinkWorker(
+            [](const char* data, std::size_t length, bool) {
+              ScopedWriteTimer timer(&STDERR_COUNTERS, length);
+              std::cerr.write(data, length);
+              std::cerr.flush();
+            },
+            [] {});
+      }
+
+      _AppendToSinkWorker(STDERR_WORKER.get(), msg.stderr_line, false);
+    } else {
+      _WriteToStderr(msg.stderr_line);
+    }
+  }
+
+  if (msg.to_files) {
+    const Config& config = _GetConfig();
+    if (SINK_WORKERS_ENABLED && !config.logfile_single &&
+        !MMAP_LOG_FILES_ENABLED) {
+      bool flush_now = msg.level >= ERROR;
+      auto min_level = config.min_file_level;
+      for (int i = min_level; i <= msg.level; i++) {
+        _AppendToSinkWorker(_GetLogFileWorker(i), msg.file_line, flush_now);
+      }
+    } else {
+      _WriteToLogFiles(msg.file_line, msg.level);
+    }
+  }
+}
+
+/**
+ * The number of messages format pool threads claim at a time, and the space
+ * reserved for each line they render.
+ */
+constexpr std::size_t kFormatSliceSize = 16;
+constexpr std::size_t kRenderedLineReserve = 256;
+
+/**
+ * @brief      Threads which help the emitter render batches of messages
+ *             (--log_format_threads).
+ *
+ * @details    Render() splits a batch into slices, which the pool's threads
+ *             and the calling thread claim until there are none left. It
+ *             returns once every message has been rendered, and the emitter
+ *             then writes the batch in order, so using the pool doesn't
+ *             reorder anything.
+ */
+class FormatPool {
+ public:
+  explicit FormatPool(uint32_t n_threads) {
+    for (uint32_t i = 0; i < n_threads; i++) {
+      threads_.emplace_back(&FormatPool::_Run, this);
+    }
+  }
+
+  ~FormatPool() {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      stopping_ = true;
+    }
+
+    job_posted_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  /**
+   * @brief      Render `messages[i]` into `rendered[i]` for every message,
+   *             with a config the calling thread has pinned.
+   */
+  void Render(const LogMessage* const* messages, RenderedMessage* rendered,
+              std::size_t n_messages, const Config& config) {
+    // Small batches aren't worth waking anyone up for.
+    if (n_messages <= kFormatSliceSize) {
+      for (std::size_t i = 0; i < n_messages; i++) {
+        messages[i]->RenderOutputs(config.line_format, &rendered[i]);
+      }
+
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      job_ = Job{messages, rendered, n_messages, &config};
+      next_.store(0, std::memory_order_relaxed);
+      generation_++;
+      finished_ = false;
+    }
+
+    job_posted_.notify_all();
+    _RenderSlices(job_);
+
+    // Every slice has been claimed, so wait for the threads still rendering
+    // theirs. Threads which haven't joined in by now won't see this job.
+    std::unique_lock<std::mutex> lock(lock_);
+    job_done_.wait(lock, [this] { return n_active_ == 0; });
+    finished_ = true;
+  }
+
+ private:
+  struct Job {
+    const LogMessage* const* messages;
+    RenderedMessage* rendered;
+    std::size_t n_messages;
+    const Config* config;
+  };
+
+  void _RenderSlices(const Job& job) {
+    ScopedPinnedConfig pin(*job.config);
+    while (true) {
+      std::size_t start =
+          next_.fetch_add(kFormatSliceSize, std::memory_order_relaxed);
+      if (start >= job.n_messages) {
+        return;
+      }
+
+      std::size_t end = std::min(start + kFormatSliceSize, job.n_messages);
+      for (std::size_t i = start; i < end; i++) {
+        job.messages[i]->RenderOutputs(job.config->line_format,
+                                       &job.rendered[i]);
+      }
+    }
+  }
+
+  void _Run() {
+    PinLoggerThread();
+    uint64_t generation = 0;
+    std::unique_lock<std::mutex> lock(lock_);
+    while (true) {
+      job_posted_.wait(lock, [this, generation] {
+        return stopping_ || (generation_ != generation && !finished_);
+      });
+      if (stopping_) {
+        return;
+      }
+
+      generation = generation_;
+      n_active_++;
+      Job job = job_;
+      lock.unlock();
+      _RenderSlices(job);
+      lock.lock();
+      if (--n_active_ == 0) {
+        job_done_.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::mutex lock_;
+  std::condition_variable job_posted_, job_done_;
+  Job job_ = {nullptr, nullptr, 0, nullptr};
+  std::atomic<std::size_t> next_{0};
+  uint64_t generation_ = 0;
+  bool finished_ = true;
+  int n_active_ = 0;
+  bool stopping_ = false;
+};
+
+/**
+ * The format pool, if --log_format_threads is set. Created by Init().
+ */
+std::unique_ptr<FormatPool> FORMAT_POOL;
+
+/**
+ * @brief      Emit a batch of messages in order, rendering them on the format
+ *             pool first if there is one.
+ */
+void _EmitBatch(const std::vector<const LogMessage*>& messages) {
+  if (FORMAT_POOL == nullptr) {
+    for (const auto* msg : messages) {
+      _DoEmitMessage(*msg);
+    }
+
+    return;
+  }
+
+  ScopedPinnedConfig pin;
+  const Config& config = _GetConfig();
+  if (!config.to_files && !config.to_stderr && !config.to_network) {
+    return;
+  }
+
+  // Reserve a typical line's worth up front, so that rendering doesn't
+  // allocate once the first batch is done.
+  static std::vector<RenderedMessage> rendered;
+  if (rendered.size() < messages.size()) {
+    std::size_t n_rendered = rendered.size();
+    rendered.resize(std::max<std::size_t>(messages.size(),
+                                          FLAGS_async_drain_batch_size));
+    for (std::size_t i = n_rendered; i < rendered.size(); i++) {
+      rendered[i].stderr_line.reserve(kRenderedLineReserve);
+      rendered[i].file_line.reserve(kRenderedLineReserve);
+    }
+  }
+
+  FORMAT_POOL->Render(messages.data(), rendered.data(), messages.size(),
+                      config);
+  for (std::size_t i = 0; i < messages.size(); i++) {
+    _WriteRenderedMessage(rendered[i]);
+  }
+}
+
+/**
+ * @brief      Function called within a thread to flush log files in
+ *             synchronous mode.
+ */
+void _ProcessLogFileFlushes() {
+  while (!SHUTTING_DOWN) {
+    EMITTER_WAKEUP.Wait(
+        std::chrono::milliseconds(FLAGS_logfile_flush_interval_ms),
+        [] { return SHUTTING_DOWN.load(std::memory_order_acquire); });
+
+    std::lock_guard<std::mutex> emit_lock(EMIT_LOCK);
+    _FlushLogFilesIfDue();
+  }
+}
+
+/**
+ * @brief      Push a message into a queue, applying the overflow policy if the
+ *             queue is full.
+ *
+ * @param      queue      The queue to push into.
+ * @param[in]  msg        The message to push.
+ * @param[in]  can_evict  Whether or not the calling thread is allowed to pop
+ *                        from the queue. If not, DROP_OLDEST behaves like
+ *                        DROP_NEWEST.
+ *
+ * @return     true if the message was pushed, false if it was dropped.
+ */
+template <typename Queue>
+bool _PushMessage(Queue* queue, LogMessage&& msg, bool can_evict) {
+  Level level = msg.level();
+  int attempt = 0;
+  std::chrono::steady_clock::time_point wait_start;
+  while (!queue->TryPush(std::move(msg))) {
+    // FATAL messages are never dropped.
+    const Config& config = _GetConfig();
+    auto policy = config.overflow_policy;
+    if (policy == DROP_OLDEST && !can_evict) {
+      policy = DROP_NEWEST;
+    }
+
+    if (level != FATAL) {
+      if (policy == DROP_NEWEST ||
+          (policy == DROP_BELOW && level < config.overflow_min_level)) {
+        MESSAGES_DROPPED[level].fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    }
+
+    if (policy == DROP_OLDEST) {
+      queue->TryPop([](LogMessage&& oldest) {
+        MESSAGES_DROPPED[oldest.level()].fetch_add(1,
+                                                   std::memory_order_relaxed);
+      });
+    } else {
+      if (attempt == 0) {
+        wait_start = std::chrono::steady_clock::now();
+      }
+
+      _Backoff(&attempt);
+    }
+  }
+
+  if (attempt > 0) {
+    auto waited = std::chrono::steady_clock::now() - wait_start;
+    PRODUCER_WAITS.fetch_add(1, std::memory_order_relaxed);
+    PRODUCER_WAIT_NS.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count(),
+        std::memory_order_relaxed);
+  }
+
+  return true;
+}
+
+/**
+ * @brief      Count a message as queued by the calling thread, claiming a set
+ *             of counts for the thread if this is its first message.
+ */
+void _CountEnqueued(Level level) {
+  auto* counts = PRODUCER_COUNTS_HANDLE.counts;
+  if (counts == nullptr) {
+    // Carry on from a thread which has exited, if there is one.
+    for (auto* free = PRODUCER_COUNTS.load(std::memory_order_acquire);
+         free != nullptr && counts == nullptr; free = free->next) {
+      bool in_use = false;
+      if (!free->in_use.load(std::memory_order_relaxed) &&
+          free->in_use.compare_exchange_strong(in_use, true,
+                                               std::memory_order_acquire)) {
+        counts = free;
+      }
+    }
+
+    if (counts == nullptr) {
+      counts = new ProducerCounts();
+      counts->in_use.store(true, std::memory_order_relaxed);
+      counts->next = PRODUCER_COUNTS.load(std::memory_order_relaxed);
+      while (!PRODUCER_COUNTS.compare_exchange_weak(
+          counts->next, counts, std::memory_order_release,
+          std::memory_order_relaxed)) {
+      }
+    }
+
+    PRODUCER_COUNTS_HANDLE.counts = counts;
+  }
+
+  auto& count = counts->enqueued[level];
+  count.store(count.load(std::memory_order_relaxed) + 1,
+              std::memory_order_relaxed);
+}
+
+/**
+ * @brief      Record how full the emitter found a queue. Only called by the
+ *             emitter.
+ */
+void _RecordQueueSize(uint64_t size) {
+  if (size > QUEUE_HIGH_WATER.load(std::memory_order_relaxed)) {
+    QUEUE_HIGH_WATER.store(size, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * @brief      Decide whether to shed a message rather than queue it, based on
+ *             how full the queue is, and count it if so.
+ *
+ * @details    Below the low watermark, nothing is shed. Between the
+ *             watermarks, TRACE and DEBUG messages are sampled. Above the high
+ *             one, TRACE and DEBUG messages are all shed and INFO messages are
+ *             sampled. WARNING and above are never shed.
+ *
+ * @return     true if the message was shed.
+ */
+template <typename Queue>
+bool _ShedMessage(const LogMessage& msg, const Queue& queue) {
+  const Config& config = _GetConfig();
+  uint32_t low = config.shed_low_watermark;
+  Level level = msg.level();
+  if (low == 0 || level >= WARNING) {
+    return false;
+  }
+
+  std::size_t size = queue.Size() * 1000, capacity = queue.Capacity();
+  if (size < capacity * low) {
+    return false;
+  }
+
+  bool above_high = size >= capacity * config.shed_high_watermark;
+  if (level == INFO && !above_high) {
+    return false;
+  }
+
+  // Sample with a per-thread xorshift generator.
+  if (level == INFO || !above_high) {
+    static thread_local uint32_t state = 0;
+    if (state == 0) {
+      state = uint32_t(reinterpret_cast<uintptr_t>(&state)) | 1;
+    }
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    if (state % config.shed_keep_one_in == 0) {
+      return false;
+    }
+  }
+
+  MESSAGES_SHED[level].fetch_add(1, std::memory_order_relaxed);
+  msg.site()->CountShed();
+  return true;
+}
+
+/**
+ * @brief      Get the calling thread's message buffer, creating and
+ *             registering it if this is the first message from this thread.
+ */
+ThreadBuffer* _GetThreadBuffer() {
+  if (THREAD_BUFFER.buffer == nullptr) {
+    THREAD_BUFFER.buffer =
+        std::make_shared<ThreadBuffer>(FLAGS_async_thread_buffer_len,
+                                       FLAGS_async_numa_local_buffers);
+
+    std::lock_guard<std::mutex> lock(THREAD_BUFFERS_LOCK);
+    THREAD_BUFFERS.push_back(THREAD_BUFFER.buffer);
+    THREAD_BUFFERS_GENERATION.fetch_add(1, std::memory_order_release);
+  }
+
+  return THREAD_BUFFER.buffer.get();
+}
+
+/**
+ * @brief      Log a summary of the messages shed since the last summary, at
+ *             most once per --async_shed_summary_interval_ms. Only called by
+ *             the emitter, which emits the summary itself rather than queueing
+ *             it behind everything else.
+ *
+ * @param[in]  final  Whether or not the emitter is exiting, in which case the
+ *                    summary is logged regardless of the interval.
+ */
+void _ReportShedMessages(bool final = false) {
+  static const std::size_t kMaxCallSites = 5;
+  static std::array<uint64_t, N_LEVELS> reported = {};
+  static auto last_report = std::chrono::steady_clock::now();
+
+  auto now = std::chrono::steady_clock::now();
+  auto elapsed_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(now - last_report)
+          .count();
+  ScopedPinnedConfig pin;
+  if (_GetConfig().shed_low_watermark == 0 ||
+      (!final && elapsed_ms < FLAGS_async_shed_summary_interval_ms)) {
+    return;
+  }
+
+  last_report = now;
+  uint64_t total = 0;
+  std::string levels;
+  for (int i = 0; i < N_LEVELS; i++) {
+    uint64_t shed = MESSAGES_SHED[i].load(std::memory_order_relaxed);
+    if (shed != reported[i]) {
+      levels += (levels.empty() ? "" : ", ") + _LevelToLongString(Level(i)) +
+                " " + std::to_string(shed - reported[i]);
+      total += shed - reported[i];
+      reported[i] = shed;
+    }
+  }
+
+  if (total == 0) {
+    return;
+  }
+
+  // List the call sites which shed the most.
+  std::vector<std::pair<uint64_t, const CallSite*>> sites;
+  {
+    std::lock_guard<std::mutex> lock(SHEDDING_CALL_SITES_LOCK);
+    for (const auto* site : SHEDDING_CALL_SITES) {
+      uint64_t shed = site->TakeShedCount();
+      if (shed > 0) {
+        sites.emplace_back(shed, site);
+      }
+    }
+  }
+
+  std::sort(sites.begin(), sites.end(),
+            [](const std::pair<uint64_t, const CallSite*>& a,
+               const std::pair<uint64_t, const CallSite*>& b) {
+              return a.first > b.first;
+            });
+  std::string top_sites;
+  for (std::size_t i = 0; i < sites.size() && i < kMaxCallSites; i++) {
+    top_sites += (i == 0 ? "" : ", ") + std::string(sites[i].second->file()) +
+                 ":" + std::to_string(sites[i].second->line()) + " " +
+                 std::to_string(sites[i].first);
+  }
+
+  static CallSite site(__FILE__, __LINE__, WARNING);
+  LogMessage summary(&site, 0,
+                     "Shed {} messages in the last {}ms to keep up with the "
+                     "async queue ({}). Most were from: {}",
+                     total, uint64_t(elapsed_ms), levels, top_sites);
+  _DoEmitMessage(summary);
+}
+
+/**
+ * @brief      Called by the emitter before it takes messages from the queue.
+ *             If a crash handler is writing things out, the emitter stops for
+ *             good (the program is about to die), so that the two don't write
+ *             at once.
+ */
+void _StopIfCrashing() {
+  if (!CRASH_WRITING.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  EMITTER_STOPPED.store(true, std::memory_order_release);
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+}
+
+/**
+ * @brief      Called by the emitter once it has written out everything which
+ *             was queued when it read `request` from DRAINS_REQUESTED. If that
+ *             is a new request, the log files and sink workers are flushed
+ *             before the requests up to it are marked as done.
+ */
+void _FinishDrain(uint64_t request) {
+  if (request == DRAINS_DONE.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  _FlushLogFiles();
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(FLAGS_log_drain_timeout_ms);
+  if (STDERR_WORKER != nullptr) {
+    STDERR_WORKER->WaitUntilWritten(deadline);
+  }
+
+  for (auto& worker : LOG_FILE_WORKERS) {
+    if (worker != nullptr) {
+      worker->WaitUntilWritten(deadline);
+    }
+  }
+
+  DRAINS_DONE.store(request, std::memory_order_release);
+  { std::lock_guard<std::mutex> lock(DRAIN_LOCK); }
+  DRAIN_DONE.notify_all();
+}
+
+/**
+ * @brief      Wait, for at most --log_drain_timeout_ms, for the emitter to
+ *             write out everything the calling thread has queued.
+ *
+ * @return     true if it did (or there is no emitter), false if the wait
+ *             timed out or the emitter itself called this.
+ */
+bool _DrainQueue() {
+  if (LOG_EMITTER == nullptr) {
+    return true;
+  } else if (IS_EMITTER) {
+    return false;
+  }
+
+  uint64_t request =
+      DRAINS_REQUESTED.fetch_add(1, std::memory_order_acq_rel) + 1;
+  EMITTER_WAKEUP.Notify();
+
+  std::unique_lock<std::mutex> lock(DRAIN_LOCK);
+  return DRAIN_DONE.wait_for(
+      lock, std::chrono::milliseconds(FLAGS_log_drain_timeout_ms),
+      [request] {
+        return DRAINS_DONE.load(std::memory_order_acquire) >= request;
+      });
+}
+
+/**
+ * @brief      Function called within a thread to process messages. Will only be
+ *             used if --async_logging is enabled.
+ */
+void _ProcessMessageQueue() {
+  IS_EMITTER = true;
+  PinLoggerThread();
+
+  std::vector<LogMessage> batch;
+  std::vector<const LogMessage*> ordered;
+  if (FORMAT_POOL != nullptr) {
+    batch.reserve(FLAGS_async_drain_batch_size);
+    ordered.reserve(FLAGS_async_drain_batch_size);
+  }
+
+  bool stopping = false;
+  while (!stopping) {
+    // Wait for something to appear. Wake up at least once per flush interval
+    // to write out buffered log lines.
+    EMITTER_WAKEUP.Wait(
+        std::chrono::milliseconds(FLAGS_logfile_flush_interval_ms), [] {
+          return SHUTTING_DOWN.load(std::memory_order_acquire) ||
+                 !LOG_MESSAGE_QUEUE->Empty() ||
+                 DRAINS_REQUESTED.load(std::memory_order_acquire) !=
+                     DRAINS_DONE.load(std::memory_order_relaxed);
+        });
+
+    // Everything queued before these are read is written out by this pass.
+    // Once shutting down, the pass takes at most a queue's worth, so that
+    // threads which carry on logging can't hold up the exit.
+    stopping = SHUTTING_DOWN.load(std::memory_order_acquire);
+    uint64_t drain_request = DRAINS_REQUESTED.load(std::memory_order_acquire);
+    uint64_t max_messages =
+        stopping ? LOG_MESSAGE_QUEUE->Capacity() : UINT64_MAX;
+    _RecordQueueSize(LOG_MESSAGE_QUEUE->Size());
+
+    // Emit everything which is in the queue. With a format pool, messages
+    // are taken out in batches so that they can be rendered together.
+    uint64_t n_messages = 0;
+    if (FORMAT_POOL == nullptr) {
+      while (n_messages < max_messages) {
+        _StopIfCrashing();
+        if (!LOG_MESSAGE_QUEUE->TryPop(
+                [](LogMessage&& msg) { _DoEmitMessage(msg); })) {
+          break;
+        }
+
+        n_messages++;
+      }
+    } else {
+      while (n_messages < max_messages) {
+        _StopIfCrashing();
+        batch.clear();
+        while (batch.size() < FLAGS_async_drain_batch_size &&
+               LOG_MESSAGE_QUEUE->TryPop([&batch](LogMessage&& msg) {
+                 batch.push_back(std::move(msg));
+               })) {
+        }
+
+        if (batch.empty()) {
+          break;
+        }
+
+        ordered.clear();
+        for (const auto& msg : batch) {
+          ordered.push_back(&msg);
+        }
+
+        _EmitBatch(ordered);
+        n_messages += batch.size();
+      }
+    }
+
+    _EndEmitterBatch(n_messages);
+    _FlushLogFilesIfDue();
+    _ReportShedMessages();
+    _FinishDrain(drain_request);
+  }
+
+  _ReportShedMessages(true);
+}
+
+/**
+ * @brief      Function called within a thread to process messages from the
+ *             per-thread buffers. Will only be used if --async_logging and
+ *             --async_per_thread_buffers are enabled.
+ *
+ *             Each pass takes up to --async_drain_batch_size messages from
+ *             every buffer, then emits them in order of log time. Messages
+ *             logged close together by different threads might still be
+ *             slightly out of order if they fall in different batches.
+ */
+void _ProcessThreadBuffers() {
+  IS_EMITTER = true;
+  PinLoggerThread();
+
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  uint64_t generation = UINT64_MAX;
+  std::vector<LogMessage> batch;
+  std::vector<const LogMessage*> ordered;
+
+  // Once shutting down, at most a buffer's worth more is taken from each
+  // buffer, so that threads which carry on logging can't hold up the exit.
+  uint32_t passes_left =
+      FLAGS_async_thread_buffer_len / FLAGS_async_drain_batch_size + 1;
+
+  while (true) {
+    // Everything queued before these are read (and so before the buffers
+    // are picked up) is taken by this pass or an earlier one.
+    bool stopping = SHUTTING_DOWN.load(std::memory_order_acquire);
+    uint64_t drain_request = DRAINS_REQUESTED.load(std::memory_order_acquire);
+
+    // Pick up any newly registered buffers.
+    if (THREAD_BUFFERS_GENERATION.load(std::memory_order_acquire) !=
+        generation) {
+      std::lock_guard<std::mutex> buffers_lock(THREAD_BUFFERS_LOCK);
+      generation = THREAD_BUFFERS_GENERATION.load(std::memory_order_relaxed);
+      buffers = THREAD_BUFFERS;
+    }
+
+    // Take a batch from each buffer. If none of them fills a batch, every
+    // buffer has been emptied.
+    _StopIfCrashing();
+    bool emptied = true;
+    for (auto& buffer : buffers) {
+      _RecordQueueSize(buffer->queue.Size());
+      uint32_t n_taken = 0;
+      while (n_taken < FLAGS_async_drain_batch_size &&
+             buffer->queue.TryPop([&batch](LogMessage&& msg) {
+               batch.push_back(std::move(msg));
+             })) {
+        n_taken++;
+      }
+
+      emptied = emptied && n_taken < FLAGS_async_drain_batch_size;
+    }
+
+    if (batch.empty()) {
+      _FinishDrain(drain_request);
+      if (stopping) {
+        break;
+      }
+
+      // Free the buffers of threads which have finished.
+      {
+        std::lock_guard<std::mutex> buffers_lock(THREAD_BUFFERS_LOCK);
+        auto finished = std::remove_if(
+            THREAD_BUFFERS.begin(), THREAD_BUFFERS.end(),
+            [](const std::shared_ptr<ThreadBuffer>& buffer) {
+              return buffer->abandoned.load(std::memory_order_acquire) &&
+                     buffer->queue.Empty();
+            });
+        if (finished != THREAD_BUFFERS.end()) {
+          THREAD_BUFFERS.erase(finished, THREAD_BUFFERS.end());
+          THREAD_BUFFERS_GENERATION.fetch_add(1, std::memory_order_release);
+        }
+      }
+
+      _FlushLogFilesIfDue();
+      _ReportShedMessages();
+
+      // Wait for something to appear, including in a newly registered
+      // buffer. Wake up at least once per flush interval to write out
+      // buffered log lines (and free the buffers of finished threads).
+      EMITTER_WAKEUP.Wait(
+          std::chrono::milliseconds(FLAGS_logfile_flush_interval_ms),
+          [&buffers, generation] {
+            if (SHUTTING_DOWN.load(std::memory_order_acquire) ||
+                DRAINS_REQUESTED.load(std::memory_order_acquire) !=
+                    DRAINS_DONE.load(std::memory_order_relaxed) ||
+                THREAD_BUFFERS_GENERATION.load(std::memory_order_acquire) !=
+                    generation) {
+              return true;
+            }
+
+            for (const auto& buffer : buffers) {
+              if (!buffer->queue.Empty()) {
+                return true;
+              }
+            }
+
+            return false;
+          });
+      continue;
+    }
+
+    // Emit the batch in time order. Each buffer is already in order, so a
+    // stable sort keeps messages from the same thread in the order they were
+    // logged.
+    ordered.clear();
+    for (const auto& msg : batch) {
+      ordered.push_back(&msg);
+    }
+
+    std::stable_sort(ordered.begin(), ordered.end(),
+                     [](const LogMessage* a, const LogMessage* b) {
+                       return a->log_time() < b->log_time();
+                     });
+    _EmitBatch(ordered);
+    _EndEmitterBatch(batch.size());
+    _ReportShedMessages();
+    batch.clear();
+    if (emptied) {
+      _FinishDrain(drain_request);
+    }
+
+    if (stopping && --passes_left == 0) {
+      break;
+    }
+  }
+
+  _ReportShedMessages(true);
+}
+
+/**
+ * @brief      Append an unsigned integer to a buffer, zero-padded on the left
+ *             to at least `width` digits. Digits are produced two at a time
+ *             and appended in one go. This doesn't allocate (provided the
+ *             buffer has enough capacity).
+ */
+void _AppendInt(uint64_t value, int width, std::string* out) {
+  static const char kDigitPairs[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233343"
+      "53637383940414243444546474849505152535455565758596061626364656667686970"
+      "7172737475767778798081828384858687888990919293949596979899";
+  static_assert(sizeof(kDigitPairs) == 201, "100 pairs and a terminator");
+
+  char digits[24];
+  char* end = digits + sizeof(digits);
+  char* start = end;
+  while (value >= 100) {
+    auto pair = (value % 100) * 2;
+    value /= 100;
+    *--start = kDigitPairs[pair + 1];
+    *--start = kDigitPairs[pair];
+  }
+
+  if (value >= 10) {
+    *--start = kDigitPairs[value * 2 + 1];
+    *--start = kDigitPairs[value * 2];
+  } else {
+    *--start = '0' + value;
+  }
+
+  while (end - start < width && start > digits) {
+    *--start = '0';
+  }
+
+  out->append(start, end - start);
+}
+
+/**
+ * The number of sub-second digits to show for each --datetime_precision.
+ */
+enum DatetimePrecision {
+  SECONDS = 0,
+  MILLISECONDS = 3,
+  MICROSECONDS = 6,
+  NANOSECONDS = 9
+};
+
+DatetimePrecision _StringToDatetimePrecision(const std::string& precision) {
+  auto precision_lower = string::ToLower(precision);
+  if (precision_lower == "ms") {
+    return MILLISECONDS;
+  } else if (precision_lower == "us") {
+    return MICROSECONDS;
+  } else if (precision_lower == "ns") {
+    return NANOSECONDS;
+  } else {
+    return SECONDS;
+  }
+}
+
+/**
+ * @brief      Convert a time to local time, in a thread-safe manner.
+ */
+void _LocalTime(std::time_t time, std::tm* local_time) {
+#ifdef OS_WINDOWS
+  localtime_s(local_time, &time);
+#else
+  localtime_r(&time, local_time);
+#endif  // OS_WINDOWS
+}
+
+/**
+ * @brief      Append the formatted time of a message to a buffer.
+ *
+ *             The --datetime_format part only changes once per second, so it
+ *             is cached (per thread) and strftime() is only called when the
+ *             second (or the config) changes. The sub-second part is appended
+ *             separately.
+ */
+void _AppendTimeString(
+    const std::chrono::time_point<std::chrono::system_clock>& log_time,
+    std::string* out) {
+  using namespace std::chrono;
+
+  struct TimestampCache {
+    std::time_t second = -1;
+    uint64_t config_generation = 0;
+    std::string prefix;
+  };
+  static thread_local TimestampCache cache;
+
+  // Format the datetime, if it isn't cached.
+  const Config& config = _GetConfig();
+  auto since_epoch = duration_cast<nanoseconds>(log_time.time_since_epoch());
+  auto log_time_c = static_cast<std::time_t>(
+      duration_cast<seconds>(since_epoch).count());
+  if (log_time_c != cache.second ||
+      cache.config_generation != config.generation) {
+    char time_str_buffer[256];
+    std::tm local_time;
+    _LocalTime(log_time_c, &local_time);
+    auto length = std::strftime(time_str_buffer, sizeof(time_str_buffer),
+                                config.datetime_format.c_str(), &local_time);
+
+    cache.second = log_time_c;
+    cache.config_generation = config.generation;
+    cache.prefix.assign(time_str_buffer, length);
+  }
+
+  out->append(cache.prefix);
+
+  // Add the sub-second time.
+  int n_digits = config.datetime_digits;
+  if (n_digits > 0) {
+    uint64_t sub_second_time = since_epoch.count() % 1000000000;
+    for (int i = n_digits; i < 9; i++) {
+      sub_second_time /= 10;
+    }
+
+    out->push_back('.');
+    _AppendInt(sub_second_time, n_digits, out);
+  }
+}
+
+/**
+ * @brief      Append the padded (or truncated) filename and line number of a
+ *             message to a buffer.
+ *
+ * @param[in]  line      The line number.
+ * @param[in]  filename  The filename, without any directories.
+ * @param      out       The buffer to append to.
+ */
+void _AppendFilenameToDisplay(int line, const char* filename,
+                              std::string* out) {
+  const Config& config = _GetConfig();
+  std::size_t filename_len = std::strlen(filename);
+
+  // Pad the filename to the maximum length.
+  if (filename_len <= config.max_filename_len) {
+    // Pad the filename with spaces (short files!).
+    out->append(config.max_filename_len - filename_len, ' ');
+    out->append(filename, filename_len);
+  } else {
+    // Truncate the filename (long files!). To do this, we separate the filename
+    // and the extension. We always want to show the extension + the last
+    // letter, and we always want to show the start (i.e. only truncate the
+    // middle of the filename).
+    const char* ext = std::strrchr(filename, '.');
+    if (ext == nullptr || ext == filename) {
+      ext = filename + filename_len;
+    }
+
+    std::size_t stem_len = ext - filename, ext_len = std::strlen(ext);
+
+    // Pick how many characters to remove from the file. The extension
+    // includes the dot, +3 for the ellipse, +2 for the last 2 characters.
+    int chars_left = config.max_filename_len - (ext_len + 3 + 2);
+
+    // If there are no characters left... then just display as many as we can.
+    if (chars_left <= 0 || stem_len < 2) {
+      out->append(filename,
+                  std::min<std::size_t>(stem_len, config.max_filename_len));
+    } else {
+      out->append(filename, std::min<std::size_t>(stem_len, chars_left));
+      out->append("...");
+      out->append(filename + stem_len - 2, 2);
+      out->append(ext, ext_len);
+    }
+  }
+
+  // Pad the line number to 4 characters. Because really, you shouldn't have any
+  // files longer than 9999 lines, right?
+  out->push_back(':');
+  std::size_t line_start = out->length();
+  _AppendInt(line, 0, out);
+  std::size_t line_number_len = out->length() - line_start;
+  if (line_number_len < config.max_line_number_len) {
+    out->append(config.max_line_number_len - line_number_len, ' ');
+  }
+}
+
+/**
+ * @brief      Get the OS id of the calling thread (as shown by e.g. top -H), or
+ *             a sequential id on platforms without one.
+ */
+uint64_t _GetOsThreadId() {
+#ifdef __linux__
+  return uint64_t(syscall(SYS_gettid));
+#else
+  static std::atomic<uint64_t> next_id(1);
+  static thread_local uint64_t id =
+      next_id.fetch_add(1, std::memory_order_relaxed);
+  return id;
+#endif  // __linux__
+}
+
+/**
+ * @brief      Get the identity for a thread id and name, creating it if it is
+ *             new. Threads with the same id and name (e.g. when the OS reuses
+ *             an id) share an identity, so only as many are created as there
+ *             are distinct threads.
+ */
+const ThreadIdentity* _InternThreadIdentity(uint64_t id,
+                                            const std::string& name) {
+  // Never freed, as messages might still be rendered during exit.
+  static std::mutex lock;
+  static auto* identities =
+      new std::map<std::pair<uint64_t, std::string>, const ThreadIdentity*>();
+
+  std::lock_guard<std::mutex> guard(lock);
+  auto& identity = (*identities)[std::make_pair(id, name)];
+  if (identity == nullptr) {
+    identity = new ThreadIdentity{id, name.empty() ? std::to_string(id) : name};
+  }
+
+  return identity;
+}
+
+/**
+ * The calling thread's identity, once it has logged something.
+ */
+thread_local const ThreadIdentity* THREAD_IDENTITY = nullptr;
+
+/**
+ * @brief      Turns arguments captured in an ArgBuffer back into a cppstring
+ *             format list.
+ */
+struct FormatListBuilder {
+  void operator()(bool value) { list->push_back(value); }
+  void operator()(char value) { list->push_back(value); }
+  void operator()(int64_t value) { list->push_back(value); }
+  void operator()(uint64_t value) { list->push_back(value); }
+  void operator()(double value) { list->push_back(value); }
+  void operator()(const void* value) { list->push_back(value); }
+  void operator()(const char* value, std::size_t length) {
+    list->push_back(std::string(value, length));
+  }
+
+  string::FormatListType* list;
+};
+
+/**
+ * @brief      Appends the fields of a structured message, captured in an
+ *             ArgBuffer as alternating keys and values: as key=value pairs
+ *             separated by spaces, or as JSON members separated by commas.
+ */
+struct FieldAppender {
+  /**
+   * @param[in]  separator  What to append before the first field.
+   * @param[in]  json       Whether to append JSON members.
+   * @param[out] out        The buffer to append to.
+   */
+  FieldAppender(const char* separator, bool json, std::string* out)
+      : separator(separator), json(json), out(out), first(true), is_key(true) {}
+
+  void operator()(bool value) { _Value(value ? "true" : "false"); }
+
+  void operator()(char value) { (*this)(&value, 1); }
+
+  void operator()(int64_t value) {
+    if (value < 0) {
+      out->push_back('-');
+    }
+
+    _AppendInt(value < 0 ? 0 - uint64_t(value) : uint64_t(value), 1, out);
+    is_key = true;
+  }
+
+  void operator()(uint64_t value) {
+    _AppendInt(value, 1, out);
+    is_key = true;
+  }
+
+  void operator()(double value) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.15g", value);
+    _Value(json && !std::isfinite(value) ? "null" : buffer);
+  }
+
+  void operator()(float value) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.7g", value);
+    _Value(json && !std::isfinite(value) ? "null" : buffer);
+  }
+
+  void operator()(const void* value) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%p", value);
+    (*this)(buffer, std::strlen(buffer));
+  }
+
+  void operator()(const char* value, std::size_t length) {
+    if (is_key) {
+      out->append(first ? separator : json ? "," : " ");
+      first = false;
+      if (json) {
+        AppendJsonString(value, length, out);
+        out->push_back(':');
+      } else {
+        out->append(value, length);
+        out->push_back('=');
+      }
+
+      is_key = false;
+      return;
+    }
+
+    // In text, only quote strings which can't be told apart from the rest of
+    // the line.
+    if (json || length == 0 || FindJsonEscape(value, length) < length ||
+        std::find_if(value, value + length, [](char c) {
+          return c == ' ' || c == '=';
+        }) != value + length) {
+      AppendJsonString(value, length, out);
+    } else {
+      out->append(value, length);
+    }
+
+    is_key = true;
+  }
+
+  void _Value(const char* text) {
+    out->append(text);
+    is_key = true;
+  }
+
+  const char* separator;
+  bool json;
+  std::string* out;
+  bool first, is_key;
+};
+
+/**
+ * @brief      Append a number in hexadecimal, without a prefix.
+ */
+void _AppendHex(uint64_t value, bool upper, std::string* out) {
+  const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  char buffer[16];
+  char* end = buffer + sizeof(buffer);
+  char* start = end;
+  do {
+    *--start = digits[value & 0xF];
+    value >>= 4;
+  } while (value != 0);
+
+  out->append(start, end - start);
+}
+
+/**
+ * @brief      Append a double as the shortest text which reads back as the
+ *             same value: the first of 15, 16 or 17 significant digits which
+ *             round-trips. Whole numbers (the usual case for counts and sizes)
+ *             below 2^53 skip snprintf() and are appended as integers.
+ *
+ * @param[in]  value   The value to append.
+ * @param[out] out     The buffer to append to.
+ * @param[in]  single  Whether `value` was a float: the text only has to read
+ *                     back as the same float (6 to 9 digits), so 0.1f is
+ *                     "0.1" rather than "0.10000000149011612".
+ */
+void _AppendShortestDouble(double value, std::string* out,
+                           bool single = false) {
+  if (std::isnan(value)) {
+    out->append("nan");
+    return;
+  }
+
+  if (std::signbit(value)) {
+    out->push_back('-');
+    value = -value;
+  }
+
+  if (std::isinf(value)) {
+    out->append("inf");
+    return;
+  }
+
+  if (value < 9007199254740992.0 && value == std::floor(value)) {
+    _AppendInt(uint64_t(value), 1, out);
+    return;
+  }
+
+  char buffer[32];
+  int length = 0;
+  for (int precision = single ? 6 : 15; precision <= (single ? 9 : 17);
+       precision++) {
+    length = std::snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+    if (single ? std::strtof(buffer, nullptr) == float(value)
+               : std::strtod(buffer, nullptr) == value) {
+      break;
+    }
+  }
+
+  out->append(buffer, std::size_t(length));
+}
+
+/**
+ * @brief      Append a duration in the largest unit (ns, us, ms or s) it has at
+ *             least one of, with three decimal places, e.g. "1.204ms".
+ */
+void _AppendDuration(int64_t ns, std::string* out) {
+  static const char* const kUnits[] = {"ns", "us", "ms", "s"};
+  uint64_t whole = uint64_t(ns), fraction = 0;
+  std::size_t unit = 0;
+  while (whole >= 1000 && unit < 3) {
+    fraction = whole % 1000;
+    whole /= 1000;
+    unit++;
+  }
+
+  _AppendInt(whole, 1, out);
+  if (unit > 0) {
+    out->push_back('.');
+    _AppendInt(fraction, 3, out);
+  }
+
+  out->append(kUnits[unit]);
+}
+
+/**
+ * @brief      Append a double with a fixed number of decimal places.
+ */
+void _AppendFixedDouble(double value, int precision, std::string* out) {
+  char buffer[64];
+  int length =
+      std::snprintf(buffer, sizeof(buffer), "%.*f", precision, value);
+  if (length < int(sizeof(buffer))) {
+    out->append(buffer, std::size_t(length));
+    return;
+  }
+
+  // Only huge values (up to 309 digits) with many decimal places get here.
+  std::size_t start = out->length();
+  out->resize(start + std::size_t(length) + 1);
+  std::snprintf(&(*out)[start], std::size_t(length) + 1, "%.*f", precision,
+                value);
+  out->resize(start + std::size_t(length));
+}
+
+/**
+ * @brief      Formats the message of a LOGF (see checked_format.h) from its
+ *             captured arguments, without cppstring: the format's text is
+ *             copied (with {{ and }} unescaped) and each argument is appended
+ *             in place of its placeholder. The format was checked when it was
+ *             compiled, so this only has to be safe (rather than helpful)
+ *             with a bad one, e.g. from a corrupt binary log.
+ */
+struct CheckedFormatter {
+  CheckedFormatter(const char* format, std::string* out)
+      : pos(format), out(out), hex(0), precision(-1) {}
+
+  void operator()(bool value) {
+    if (_NextPlaceholder()) {
+      out->append(value ? "true" : "false");
+    }
+  }
+
+  void operator()(char value) {
+    if (_NextPlaceholder()) {
+      out->push_back(value);
+    }
+  }
+
+  void operator()(int64_t value) {
+    if (!_NextPlaceholder()) {
+      return;
+    }
+
+    if (precision >= 0) {
+      _AppendFixedDouble(double(value), precision, out);
+      return;
+    }
+
+    if (value < 0) {
+      out->push_back('-');
+    }
+
+    _AppendMagnitude(value < 0 ? 0 - uint64_t(value) : uint64_t(value));
+  }
+
+  void operator()(uint64_t value) {
+    if (!_NextPlaceholder()) {
+      return;
+    }
+
+    if (precision >= 0) {
+      _AppendFixedDouble(double(value), precision, out);
+    } else {
+      _AppendMagnitude(value);
+    }
+  }
+
+  void operator()(double value) {
+    if (!_NextPlaceholder()) {
+      return;
+    }
+
+    if (precision >= 0) {
+      _AppendFixedDouble(value, precision, out);
+    } else {
+      _AppendShortestDouble(value, out);
+    }
+  }
+
+  void operator()(float value) {
+    if (!_NextPlaceholder()) {
+      return;
+    }
+
+    if (precision >= 0) {
+      _AppendFixedDouble(value, precision, out);
+    } else {
+      _AppendShortestDouble(value, out, true);
+    }
+  }
+
+  void operator()(const void* value) {
+    if (_NextPlaceholder()) {
+      out->append("0x");
+      _AppendHex(reinterpret_cast<uintptr_t>(value), false, out);
+    }
+  }
+
+  void operator()(const char* value, std::size_t length) {
+    if (_NextPlaceholder()) {
+      out->append(value, length);
+    }
+  }
+
+  /**
+   * @brief      Copy the rest of the format, after the last argument.
+   */
+  void Finish() {
+    while (_NextPlaceholder()) {
+    }
+  }
+
+  void _AppendMagnitude(uint64_t value) {
+    if (hex != 0) {
+      _AppendHex(value, hex == 'X', out);
+    } else {
+      _AppendInt(value, 1, out);
+    }
+  }
+
+  /**
+   * @brief      Copy the text up to the next placeholder and read its spec
+   *             into `hex` and `precision`.
+   *
+   * @return     Whether or not there was another placeholder.
+   */
+  bool _NextPlaceholder() {
+    hex = 0;
+    precision = -1;
+    while (*pos != '\0') {
+      const char* brace = std::strpbrk(pos, "{}");
+      if (brace == nullptr) {
+        out->append(pos);
+        pos += std::strlen(pos);
+        return false;
+      }
+
+      out->append(pos, brace - pos);
+      const char* end = *brace == '{' ? PlaceholderEnd(brace + 1) : nullptr;
+      if (end == nullptr) {
+        // {{, }} or a stray brace.
+        out->push_back(*brace);
+        pos = brace + (brace[1] == brace[0] ? 2 : 1);
+        continue;
+      }
+
+      if (brace[1] == ':' && brace[2] == '.') {
+        precision = brace[3] - '0';
+        if (brace[4] != 'f') {
+          precision = precision * 10 + (brace[4] - '0');
+        }
+      } else if (brace[1] == ':') {
+        hex = brace[2];
+      }
+
+      pos = end + 1;
+      return true;
+    }
+
+    return false;
+  }
+
+  const char* pos;
+  std::string* out;
+  char hex;
+  int precision;
+};
+
+/**
+ * The types of operation within a compiled line format.
+ */
+enum LineOpType {
+  LITERAL,
+  MESSAGE,
+  FILE_NAME,
+  DATETIME,
+  LEVEL,
+  THREAD,
+  FIELDS
+};
+
+/**
+ * @brief      A single operation within a compiled line format: either a piece
+ *             of literal text or a field to substitute.
+ */
+struct LineOp {
+  LineOpType type;
+
+  /**
+   * The text to append for LITERAL operations. For FIELDS, what to append
+   * before the first field.
+   */
+  std::string literal;
+
+  /**
+   * For fields which have a format spec (e.g. {level:>5}), a cppstring format
+   * string used to format the field. Empty if there is no spec.
+   */
+  std::string field_format;
+};
+
+typedef std::vector<LineOp> CompiledLine;
+
+/**
+ * @brief      A --line_format which has been parsed once into a list of
+ *             operations, so that rendering a line is a single pass.
+ *
+ *             Color tags are resolved when compiling: `plain` has them
+ *             removed, while `colored` has them replaced with ANSI codes. As
+ *             {lc} depends on the level, there is a colored line for each
+ *             level. `json` has the same fields as members of an object, and
+ *             the rest of the format dropped.
+ */
+struct CompiledLineFormat {
+  std::string source;
+  bool colorize = false;
+  CompiledLine plain, json;
+  std::array<CompiledLine, N_LEVELS> colored;
+};
+
+/**
+ * @brief      The values of fields for a single message. `kv` holds the fields
+ *             of a structured message, if it is one.
+ */
+struct LineFields {
+  std::string message, file, datetime, level, thread;
+  const CallSite* site = nullptr;
+  const ArgBuffer* kv = nullptr;
+};
+
+/**
+ * @brief      Get the ANSI code for a color tag, e.g. "red".
+ *
+ * @param[in]  tag    The name of the tag.
+ * @param[in]  level  The level of the line, used for {lc}.
+ * @param[out] code   Set to the ANSI code if the tag is a color tag.
+ *
+ * @return     true if `tag` is a color tag.
+ */
+bool _GetColorTag(const std::string& tag, Level level, std::string* code) {
+  static const std::array<std::pair<const char*, const std::string*>, 12>
+      kColors = {{
+          {"nc", &string::color::kReset},
+          {"bold", &string::color::kBold},
+          {"italic", &string::color::kItalic},
+          {"black", &string::color::kBlack},
+          {"red", &string::color::kRed},
+          {"green", &string::color::kGreen},
+          {"yellow", &string::color::kYellow},
+          {"blue", &string::color::kBlue},
+          {"magenta", &string::color::kMagenta},
+          {"cyan", &string::color::kCyan},
+          {"white", &string::color::kWhite},
+          {"gray", &string::color::kGray},
+      }};
+
+  if (tag == "lc") {
+    *code = _GetColor(level);
+    return true;
+  }
+
+  for (const auto& color : kColors) {
+    if (tag == color.first) {
+      *code = *color.second;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * @brief      Append a literal to a compiled line, merging it with the
+ *             previous literal if there is one.
+ */
+void _AppendLiteral(CompiledLine* line, const std::string& literal) {
+  if (literal.empty()) {
+    return;
+  }
+
+  if (!line->empty() && line->back().type == LITERAL) {
+    line->back().literal += literal;
+  } else {
+    line->push_back({LITERAL, literal, ""});
+  }
+}
+
+/**
+ * @brief      Compile a line format for a single level.
+ *
+ *             Structured messages' fields go wherever {fields} is, or else
+ *             straight after the message. In JSON, they are always the last
+ *             members of the object.
+ *
+ * @param[in]  line_fmt  The line format to compile.
+ * @param[in]  colorize  Whether or not to replace color tags with ANSI codes.
+ *                       If not, they are removed.
+ * @param[in]  level     The level to resolve {lc} for.
+ * @param[in]  json      Whether to compile a JSON object instead, with a
+ *                       member for each field and no literal text.
+ */
+CompiledLine _CompileLine(const std::string& line_fmt, bool colorize,
+                          Level level, bool json) {
+  static const std::array<std::pair<const char*, LineOpType>, 6> kFields = {{
+      {"message", MESSAGE},
+      {"file", FILE_NAME},
+      {"datetime", DATETIME},
+      {"level", LEVEL},
+      {"thread", THREAD},
+      {"fields", FIELDS},
+  }};
+
+  CompiledLine line;
+  bool has_members = false, has_fields = false;
+  std::size_t pos = 0;
+  while (pos < line_fmt.length()) {
+    auto open = line_fmt.find('{', pos);
+    auto close = open == std::string::npos ? open : line_fmt.find('}', open);
+    if (close == std::string::npos) {
+      if (!json) {
+        _AppendLiteral(&line, line_fmt.substr(pos));
+      }
+
+      break;
+    }
+
+    if (!json) {
+      _AppendLiteral(&line, line_fmt.substr(pos, open - pos));
+    }
+
+    pos = close + 1;
+
+    // Split the tag into name and spec, e.g. {level:>5}.
+    std::string tag = line_fmt.substr(open + 1, close - open - 1);
+    std::string spec;
+    auto colon = tag.find(':');
+    if (colon != std::string::npos) {
+      spec = tag.substr(colon);
+      tag = tag.substr(0, colon);
+    }
+
+    // Color tags become literals.
+    std::string color_code;
+    if (_GetColorTag(tag, level, &color_code)) {
+      if (colorize && !json) {
+        _AppendLiteral(&line, color_code);
+      }
+
+      continue;
+    }
+
+    // Unknown tags are removed, just like FormatTrimTags would.
+    for (const auto& field : kFields) {
+      if (tag != field.first) {
+        continue;
+      }
+
+      if (field.second == FIELDS) {
+        // In JSON, the fields are always added at the end, after the members
+        // which are always there.
+        if (!json) {
+          line.push_back({FIELDS, "", ""});
+          has_fields = true;
+        }
+      } else if (json) {
+        // Specs only pad or truncate, which just gets in the way in JSON.
+        _AppendLiteral(&line, std::string(has_members ? "," : "") + "\"" +
+                                  field.first + "\":");
+        line.push_back({field.second, "", ""});
+        has_members = true;
+      } else {
+        line.push_back(
+            {field.second, "", spec.empty() ? "" : "{" + spec + "}"});
+      }
+
+      break;
+    }
+  }
+
+  if (!has_fields) {
+    auto message = std::find_if(
+        line.begin(), line.end(),
+        [](const LineOp& op) { return op.type == MESSAGE; });
+    if (json) {
+      line.push_back({FIELDS, has_members ? "," : "", ""});
+    } else if (message != line.end()) {
+      line.insert(message + 1, {FIELDS, " ", ""});
+    }
+  }
+
+  if (json) {
+    line.insert(line.begin(), {LITERAL, "{", ""});
+    _AppendLiteral(&line, "}");
+  }
+
+  return line;
+}
+
+/**
+ * @brief      Compile a line format, plain, as JSON and colored for each
+ *             level.
+ */
+CompiledLineFormat* _CompileLineFormat(const std::string& line_fmt,
+                                       bool colorize) {
+  auto* compiled = new CompiledLineFormat();
+  compiled->source = line_fmt;
+  compiled->colorize = colorize;
+  compiled->plain = _CompileLine(line_fmt, false, TRACE, false);
+  compiled->json = _CompileLine(line_fmt, false, TRACE, true);
+  for (int i = 0; i < N_LEVELS; i++) {
+    compiled->colored[i] =
+        _CompileLine(line_fmt, colorize, static_cast<Level>(i), false);
+  }
+
+  return compiled;
+}
+
+Config::~Config() = default;
+
+/**
+ * @brief      Get the compiled version of a line format other than the
+ *             configured one (which each Config compiles and owns), for
+ *             LogMessage::Emit() and Render(). The result is cached and only
+ *             recompiled when the format (or `colorize`) changes. This is
+ *             thread-safe.
+ */
+const CompiledLineFormat& _GetCompiledLineFormat(const std::string& line_fmt,
+                                                 bool colorize) {
+  static std::atomic<const CompiledLineFormat*> current(nullptr);
+  static std::mutex compile_lock;
+
+  auto is_current = [&line_fmt, colorize](const CompiledLineFormat* compiled) {
+    return compiled != nullptr && compiled->source == line_fmt &&
+           compiled->colorize == colorize;
+  };
+
+  const CompiledLineFormat* compiled = current.load(std::memory_order_acquire);
+  if (is_current(compiled)) {
+    return *compiled;
+  }
+
+  std::lock_guard<std::mutex> lock(compile_lock);
+  compiled = current.load(std::memory_order_acquire);
+  if (!is_current(compiled)) {
+    // The old format is leaked, since another thread might still be rendering
+    // with it. Only callers which pass formats of their own get here, so this
+    // only grows when one of them switches between formats.
+    auto* recompiled = _CompileLineFormat(line_fmt, colorize);
+    current.store(recompiled, std::memory_order_release);
+    compiled = recompiled;
+  }
+
+  return *compiled;
+}
+
+/**
+ * @brief      Get the compiled version of a line format, using the config's
+ *             precompiled one when rendering with the configured format.
+ */
+const CompiledLineFormat& _GetCompiledLineFormat(const std::string& line_fmt,
+                                                 const Config& config) {
+  if (&line_fmt == &config.line_format) {
+    return *config.compiled_line_format;
+  }
+
+  return _GetCompiledLineFormat(line_fmt, config.colorize);
+}
+
+/**
+ * @brief      Render a compiled line into a buffer.
+ *
+ * @param[in]  line    The compiled line to render.
+ * @param[in]  fields  The values of the fields to substitute.
+ * @param[in]  json    Whether `line` is a JSON object, so that values need to
+ *                     be written as JSON strings.
+ * @param[out] out     The buffer to render into. It is cleared first.
+ */
+void _RenderLine(const CompiledLine& line, const LineFields& fields,
+                 bool json, std::string* out) {
+  out->clear();
+  for (const auto& op : line) {
+    const std::string* value = nullptr;
+    switch (op.type) {
+      case LITERAL:
+        out->append(op.literal);
+        continue;
+      case FIELDS:
+        if (fields.kv != nullptr) {
+          FieldAppender appender(op.literal.c_str(), json, out);
+          fields.kv->Visit(appender);
+        }
+
+        continue;
+      case MESSAGE:
+        value = &fields.message;
+        break;
+      case FILE_NAME:
+        value = &fields.file;
+        break;
+      case DATETIME:
+        value = &fields.datetime;
+        break;
+      case LEVEL:
+        value = &fields.level;
+        break;
+      case THREAD:
+        value = &fields.thread;
+        break;
+    }
+
+    if (json) {
+      if (op.type == FILE_NAME) {
+        // Without the padding used to line up text logs.
+        const char* file = fields.site->file();
+        AppendJsonString(file, std::strlen(file), out);
+        out->back() = ':';
+        _AppendInt(fields.site->line(), 1, out);
+        out->push_back('"');
+      } else {
+        AppendJsonString(*value, out);
+      }
+    } else if (op.field_format.empty()) {
+      out->append(*value);
+    } else {
+      out->append(string::Format(op.field_format, {*value}));
+    }
+  }
+}
+
+/**
+ * @brief      Where a crash handler writes a line: some file descriptors, and
+ *             some --logfile_mmap files.
+ */
+struct CrashTargets {
+  int fds[2 + N_LEVELS];
+  std::size_t n_fds = 0;
+  MmapFileSink* mmap_files[N_LEVELS];
+  std::size_t n_mmap_files = 0;
+};
+
+/**
+ * @brief      A line built by a crash handler. It is held in a fixed buffer,
+ *             since allocating isn't async-signal-safe, and anything which
+ *             doesn't fit is cut off.
+ */
+struct CrashLine {
+  char data[1024];
+  std::size_t length = 0;
+
+  void Append(const char* text, std::size_t text_length) {
+    // Leave room for the newline.
+    text_length = std::min(text_length, sizeof(data) - 1 - length);
+    std::memcpy(data + length, text, text_length);
+    length += text_length;
+  }
+
+  void Append(const char* text) { Append(text, std::strlen(text)); }
+
+  void AppendUnsigned(uint64_t value, int width) {
+    char digits[24];
+    int n_digits = 0;
+    do {
+      digits[n_digits++] = char('0' + value % 10);
+      value /= 10;
+    } while (value > 0 || n_digits < width);
+
+    while (n_digits > 0 && length < sizeof(data) - 1) {
+      data[length++] = digits[--n_digits];
+    }
+  }
+
+  void AppendHex(uint64_t value, bool upper) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char buffer[16];
+    int n_digits = 0;
+    do {
+      buffer[n_digits++] = digits[value & 0xF];
+      value >>= 4;
+    } while (value != 0);
+
+    while (n_digits > 0 && length < sizeof(data) - 1) {
+      data[length++] = buffer[--n_digits];
+    }
+  }
+
+  /**
+   * @brief      Append a double without snprintf() (which isn't
+   *             async-signal-safe): with `precision` decimal places (up to 9),
+   *             or if that is negative, up to 6 with trailing zeros trimmed.
+   *             Values of 1e18 and above are written in scientific notation.
+   */
+  void AppendDouble(double value, int precision) {
+    if (std::isnan(value)) {
+      Append("nan");
+      return;
+    }
+
+    if (std::signbit(value)) {
+      Append("-");
+      value = -value;
+    }
+
+    if (std::isinf(value)) {
+      Append("inf");
+      return;
+    }
+
+    int exponent = 0;
+    while (value >= 1e18 || (exponent > 0 && value >= 10)) {
+      value /= 10;
+      exponent++;
+    }
+
+    int digits = precision < 0 ? 6 : std::min(precision, 9);
+    uint64_t scale = 1;
+    for (int i = 0; i < digits; i++) {
+      scale *= 10;
+    }
+
+    auto whole = uint64_t(value);
+    auto fraction = uint64_t((value - double(whole)) * double(scale) + 0.5);
+    if (fraction >= scale) {
+      whole++;
+      fraction -= scale;
+    }
+
+    while (precision < 0 && digits > 0 && fraction % 10 == 0) {
+      fraction /= 10;
+      digits--;
+    }
+
+    AppendUnsigned(whole, 1);
+    if (digits > 0) {
+      Append(".");
+      AppendUnsigned(fraction, digits);
+    }
+
+    if (exponent > 0) {
+      Append("e+");
+      AppendUnsigned(uint64_t(exponent), 2);
+    }
+  }
+
+  /**
+   * @brief      End the line, and write it out.
+   */
+  void WriteLine(const CrashTargets& targets) {
+    data[length++] = '\n';
+    Write(targets);
+  }
+
+  /**
+   * @brief      Write out the line, which has already been ended.
+   */
+  void Write(const CrashTargets& targets) const {
+    iovec buffer;
+    buffer.iov_base = const_cast<char*>(data);
+    buffer.iov_len = length;
+    for (std::size_t i = 0; i < targets.n_fds; i++) {
+      WriteVectored(targets.fds[i], &buffer, 1);
+    }
+
+    for (std::size_t i = 0; i < targets.n_mmap_files; i++) {
+      targets.mmap_files[i]->WriteForCrash(data, length);
+    }
+  }
+};
+
+/**
+ * @brief      Fills in a message's placeholders with its captured arguments,
+ *             for a crash handler. This works like CheckedFormatter, but into a
+ *             CrashLine and without allocating. Only the specs which LOGF
+ *             checks ({:x}, {:X} and {:.Nf}) are understood; any others are
+ *             ignored. A placeholder left without an argument is copied as is.
+ *
+ *             For a structured message, the fields are appended as
+ *             " key=value" instead.
+ */
+struct CrashArgWriter {
+  CrashArgWriter(const char* format, std::size_t format_length, bool fields,
+                 CrashLine* line)
+      : pos(format),
+        end(format + format_length),
+        fields(fields),
+        line(line),
+        is_key(true),
+        placeholder(nullptr),
+        placeholder_length(0),
+        hex(0),
+        precision(-1) {}
+
+  void operator()(bool value) {
+    if (_NextPlaceholder()) {
+      line->Append(value ? "true" : "false");
+    }
+  }
+
+  void operator()(char value) {
+    if (_NextPlaceholder()) {
+      line->Append(&value, 1);
+    }
+  }
+
+  void operator()(int64_t value) {
+    if (!_NextPlaceholder()) {
+      return;
+    }
+
+    if (precision >= 0) {
+      line->AppendDouble(double(value), precision);
+      return;
+    }
+
+    if (value < 0) {
+      line->Append("-");
+    }
+
+    _AppendMagnitude(value < 0 ? 0 - uint64_t(value) : uint64_t(value));
+  }
+
+  void operator()(uint64_t value) {
+    if (!_NextPlaceholder()) {
+      return;
+    }
+
+    if (precision >= 0) {
+      line->AppendDouble(double(value), precision);
+    } else {
+      _AppendMagnitude(value);
+    }
+  }
+
+  void operator()(double value) {
+    if (_NextPlaceholder()) {
+      line->AppendDouble(value, precision);
+    }
+  }
+
+  void operator()(const void* value) {
+    if (_NextPlaceholder()) {
+      line->Append("0x");
+      line->AppendHex(reinterpret_cast<uintptr_t>(value), false);
+    }
+  }
+
+  void operator()(const char* value, std::size_t length) {
+    if (_NextPlaceholder()) {
+      line->Append(value, length);
+    }
+  }
+
+  /**
+   * @brief      Copy the rest of the format, after the last argument.
+   */
+  void Finish() {
+    while (!fields && _NextPlaceholder()) {
+      line->Append(placeholder, placeholder_length);
+    }
+  }
+
+  void _AppendMagnitude(uint64_t value) {
+    if (hex != 0) {
+      line->AppendHex(value, hex == 'X');
+    } else {
+      line->AppendUnsigned(value, 1);
+    }
+  }
+
+  /**
+   * @brief      Copy the text up to the next placeholder and read its spec
+   *             into `hex` and `precision` (or for fields, append what goes
+   *             before the next key or value).
+   *
+   * @return     Whether or not there was another placeholder.
+   */
+  bool _NextPlaceholder() {
+    hex = 0;
+    precision = -1;
+    if (fields) {
+      line->Append(is_key ? " " : "=");
+      is_key = !is_key;
+      return true;
+    }
+
+    while (pos < end) {
+      const char* brace = pos;
+      while (brace < end && *brace != '{' && *brace != '}') {
+        brace++;
+      }
+
+      line->Append(pos, std::size_t(brace - pos));
+      pos = brace;
+      if (brace == end) {
+        return false;
+      }
+
+      // {{, }} or a stray closing brace.
+      if (*brace == '}' || (brace + 1 < end && brace[1] == '{')) {
+        line->Append(brace, 1);
+        pos = brace + (brace + 1 < end && brace[1] == brace[0] ? 2 : 1);
+        continue;
+      }
+
+      const char* close = brace;
+      while (close < end && *close != '}') {
+        close++;
+      }
+
+      if (close == end) {
+        line->Append(brace, std::size_t(end - brace));
+        pos = end;
+        return false;
+      }
+
+      if (brace[1] == ':' && (brace[2] == 'x' || brace[2] == 'X')) {
+        hex = brace[2];
+      } else if (brace[1] == ':' && brace[2] == '.' && brace[3] >= '0' &&
+                 brace[3] <= '9') {
+        precision = brace[3] - '0';
+        if (brace[4] >= '0' && brace[4] <= '9') {
+          precision = precision * 10 + (brace[4] - '0');
+        }
+      }
+
+      placeholder = brace;
+      placeholder_length = std::size_t(close + 1 - brace);
+      pos = close + 1;
+      return true;
+    }
+
+    return false;
+  }
+
+  const char* pos;
+  const char* end;
+  bool fields;
+  CrashLine* line;
+  bool is_key;
+  const char* placeholder;
+  std::size_t placeholder_length;
+  char hex;
+  int precision;
+};
+
+#ifndef OS_WINDOWS
+/**
+ * The signals handled when --log_crash_handler is set, and the handlers which
+ * were installed for them before.
+ */
+constexpr int kCrashSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+constexpr std::size_t kNumCrashSignals =
+    sizeof(kCrashSignals) / sizeof(kCrashSignals[0]);
+struct sigaction PREVIOUS_CRASH_HANDLERS[kNumCrashSignals];
+bool CRASH_HANDLERS_INSTALLED = false;
+
+/**
+ * Set by the first thread to crash, and once it has written everything out.
+ * Any other thread which crashes meanwhile waits for it.
+ */
+std::atomic<bool> CRASHING(false), CRASH_FLUSHED(false);
+
+const char* _SignalName(int signal) {
+  switch (signal) {
+    case SIGSEGV:
+      return "SIGSEGV";
+    case SIGBUS:
+      return "SIGBUS";
+    case SIGFPE:
+      return "SIGFPE";
+    case SIGILL:
+      return "SIGILL";
+    case SIGABRT:
+      return "SIGABRT";
+    default:
+      return "signal";
+  }
+}
+
+/**
+ * @brief      Open a log file from a crash handler, truncating it as FileSink
+ *             does.
+ *
+ * @return     The file descriptor, or -1 if there is no such log (or it can't
+ *             be opened).
+ */
+int _OpenForCrash(const std::string& path) {
+  if (path.empty()) {
+    return -1;
+  }
+
+  return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+/**
+ * @brief      Write out as much as possible without allocating or locking,
+ *             before the program dies: whatever is buffered for each log file,
+ *             then every message still in the async queue. Those are written
+ *             in a minimal form (see LogMessage::FormatForCrash()) to stderr
+ *             and the text log files they belong in, opening any which haven't
+ *             been opened yet.
+ *
+ * @details    Only the emitter can pop from the per-thread buffers and wait
+ *             for the sink workers, so when those are used it is asked to
+ *             drain first, for at most --log_drain_timeout_ms in case it is
+ *             stuck on something the crashed thread holds. Then it is stopped.
+ *             If it doesn't stop in time, a line which it is writing at the
+ *             same time could come out twice or be cut short.
+ */
+void _FlushForCrash(int signal) {
+  if (LOG_EMITTER != nullptr && !IS_EMITTER &&
+      (THREAD_BUFFERS_ENABLED || SINK_WORKERS_ENABLED)) {
+    uint64_t request =
+        DRAINS_REQUESTED.fetch_add(1, std::memory_order_acq_rel) + 1;
+    for (uint32_t i = 0; i < FLAGS_log_drain_timeout_ms &&
+                         DRAINS_DONE.load(std::memory_order_acquire) < request;
+         i++) {
+      timespec pause = {0, 1000000};
+      nanosleep(&pause, nullptr);
+    }
+  }
+
+  // Stop the emitter, giving it a moment to finish the message (or batch) it
+  // is writing. Once this is set, Reconfigure() doesn't free any configs.
+  CRASH_WRITING.store(true, std::memory_order_seq_cst);
+  for (int i = 0; LOG_EMITTER != nullptr && !IS_EMITTER && i < 100 &&
+                  !EMITTER_STOPPED.load(std::memory_order_acquire);
+       i++) {
+    timespec pause = {0, 1000000};
+    nanosleep(&pause, nullptr);
+  }
+
+  for (const auto& log_file : LOG_FILES) {
+    if (log_file != nullptr) {
+      log_file->FlushForCrash();
+    }
+  }
+
+  if (SINGLE_LOG_FILE != nullptr) {
+    SINGLE_LOG_FILE->FlushForCrash();
+    SINGLE_LOG_INDEX->FlushForCrash();
+  }
+
+  if (BINARY_LOG.file != nullptr) {
+    BINARY_LOG.file->FlushForCrash();
+  }
+
+  if (!WRITE_BATCH.to_stderr.empty()) {
+    WriteVectored(STDERR_FILENO, WRITE_BATCH.to_stderr.data(),
+                  WRITE_BATCH.to_stderr.size());
+  }
+
+  // Work out which text logs each level's lines go in. A log file which
+  // hasn't been opened yet (e.g. because the emitter hadn't got to its first
+  // line) is opened here, truncated as FileSink would have. --logfile_mmap
+  // files are written through their mapping, which is already writable.
+  const Config* config = CONFIG.load(std::memory_order_seq_cst);
+  bool to_text_files =
+      config != nullptr && config->to_files && config->log_format != BINARY;
+  int single_fd = -1;
+  std::array<int, N_LEVELS> level_fds;
+  std::array<MmapFileSink*, N_LEVELS> level_mmap_files;
+  level_fds.fill(-1);
+  level_mmap_files.fill(nullptr);
+  if (to_text_files && config->logfile_single) {
+    single_fd = SINGLE_LOG_FILE != nullptr ? SINGLE_LOG_FILE->fd()
+                                           : _OpenForCrash(SINGLE_LOG_PATH);
+  } else if (to_text_files && MMAP_LOG_FILES_ENABLED) {
+    for (int i = 0; i < N_LEVELS; i++) {
+      level_mmap_files[i] = MMAP_LOG_FILES[i].get();
+    }
+  } else if (to_text_files) {
+    for (int i = config->min_file_level; i < N_LEVELS; i++) {
+      level_fds[i] = LOG_FILES[i] != nullptr ? LOG_FILES[i]->fd()
+                                             : _OpenForCrash(LOG_FILE_PATHS[i]);
+    }
+  }
+
+  // Which of those a line at some level goes to (along with stderr).
+  auto targets = [&](int max_level, bool to_stderr) {
+    CrashTargets line_targets;
+    if (to_stderr) {
+      line_targets.fds[line_targets.n_fds++] = STDERR_FILENO;
+    }
+
+    if (single_fd >= 0 && max_level >= 0) {
+      line_targets.fds[line_targets.n_fds++] = single_fd;
+    }
+
+    for (int i = 0; i <= max_level; i++) {
+      if (level_fds[i] >= 0) {
+        line_targets.fds[line_targets.n_fds++] = level_fds[i];
+      }
+
+      if (level_mmap_files[i] != nullptr) {
+        line_targets.mmap_files[line_targets.n_mmap_files++] =
+            level_mmap_files[i];
+      }
+    }
+
+    return line_targets;
+  };
+
+  // Mark where the unformatted lines start, in every text log. They aren't
+  // added to the --logfile_single index.
+  CrashLine banner;
+  banner.Append("*** ");
+  banner.Append(_SignalName(signal));
+  banner.Append(" received, writing out queued log messages ***");
+  banner.WriteLine(targets(N_LEVELS - 1, true));
+
+  if (LOG_MESSAGE_QUEUE == nullptr || config == nullptr) {
     return;
   }
 
-  if (!FLAGS_async_logging) emit_lock.lock();
-  msg.Emit(FLAGS_line_format);
-  if (!FLAGS_async_logging) emit_lock.unlock();
+  // Each message is moved somewhere it is never destroyed, since freeing its
+  // buffers isn't async-signal-safe. At most a queue's worth is written, in
+  // case other threads are still logging.
+  static std::aligned_storage<sizeof(LogMessage), alignof(LogMessage)>::type
+      storage;
+  auto write = [config, &targets](LogMessage&& msg) {
+    const auto* queued = new (&storage) LogMessage(std::move(msg));
+    Level level = queued->level();
+    int max_file_level = level >= config->min_file_level ? int(level) : -1;
+    CrashLine line;
+    line.length = queued->FormatForCrash(line.data, sizeof(line.data));
+    line.Write(targets(max_file_level, config->to_stderr &&
+                                           level >= config->min_stderr_level));
+  };
+
+  for (std::size_t i = 0; i < LOG_MESSAGE_QUEUE->Capacity(); i++) {
+    if (!LOG_MESSAGE_QUEUE->TryPop(write)) {
+      break;
+    }
+  }
 }
 
 /**
- * @brief      Function called within a thread to process messages. Will only be
- *             used if --async_logging is enabled.
+ * @brief      The handler for kCrashSignals. Once everything has been written
+ *             out, the signal is passed on to the handler which was installed
+ *             before (or its default action, e.g. dumping core).
  */
-void _ProcessMessageQueue() {
-  std::mutex mutex;
-  std::unique_lock<std::mutex> lock(mutex);
+void _HandleCrashSignal(int signal) {
+  if (!CRASHING.exchange(true)) {
+    _FlushForCrash(signal);
+    CRASH_FLUSHED.store(true);
+  } else {
+    // Wait a while (but not forever, in case this is the same thread crashing
+    // again).
+    for (int i = 0; i < 1000 && !CRASH_FLUSHED.load(); i++) {
+      timespec pause = {0, 1000000};
+      nanosleep(&pause, nullptr);
+    }
+  }
 
-  while (!SHUTTING_DOWN) {
-    // Wait for something to appear.
-    LOG_MESSAGE_QUEUE_INSERT.wait(
-        lock, [] { return SHUTTING_DOWN || LOG_MESSAGE_QUEUE.size() > 0; });
-
-    while (LOG_MESSAGE_QUEUE.size() > 0) {
-      // Get the next thing to display.
-      LOG_MESSAGE_QUEUE_INSERT_LOCK.lock();
-      auto msg = LOG_MESSAGE_QUEUE.front();
-      LOG_MESSAGE_QUEUE.pop_front();
-      LOG_MESSAGE_QUEUE_INSERT_LOCK.unlock();
-
-      // Emit the message.
-      _DoEmitMessage(msg);
+  for (std::size_t i = 0; i < kNumCrashSignals; i++) {
+    if (kCrashSignals[i] == signal) {
+      sigaction(signal, &PREVIOUS_CRASH_HANDLERS[i], nullptr);
     }
   }
+
+  raise(signal);
 }
+#endif  // OS_WINDOWS
 
-template <class Duration = std::chrono::milliseconds>
-void _GetSubSecondTimeIn(
-    const std::chrono::time_point<std::chrono::system_clock>& log_time,
-    int* sub_second_time, int* n_digits) {
-  using namespace std::chrono;
-  typename Duration::period period;
-
-  auto now = duration_cast<Duration>(log_time.time_since_epoch());
-  *sub_second_time = now.count() % period.den;
-  *n_digits = std::to_string(period.den).length() - 1;
-}
-
-std::string _GetTimeString(
-    const std::chrono::time_point<std::chrono::system_clock>& log_time) {
-  // Format the datetime.
-  char time_str_buffer[256];
-  auto log_time_c = std::chrono::system_clock::to_time_t(log_time);
-  std::strftime(time_str_buffer, sizeof(time_str_buffer),
-                FLAGS_datetime_format.c_str(), std::localtime(&log_time_c));
-  std::string time_str(time_str_buffer);
-
-  // Extract the sub-second time, as a string.
-  int sub_second_time = 0, n_digits = 0;
-  if (string::ToLower(FLAGS_datetime_precision) == "ms") {
-    _GetSubSecondTimeIn<std::chrono::milliseconds>(log_time, &sub_second_time,
-                                                   &n_digits);
-  } else if (string::ToLower(FLAGS_datetime_precision) == "us") {
-    _GetSubSecondTimeIn<std::chrono::microseconds>(log_time, &sub_second_time,
-                                                   &n_digits);
-  } else if (string::ToLower(FLAGS_datetime_precision) == "ns") {
-    _GetSubSecondTimeIn<std::chrono::nanoseconds>(log_time, &sub_second_time,
-                                                  &n_digits);
+/**
+ * @brief      Install the handlers for --log_crash_handler, remembering the
+ *             ones they replace.
+ */
+void _InstallCrashHandlers() {
+#ifndef OS_WINDOWS
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = _HandleCrashSignal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_ONSTACK;
+  for (std::size_t i = 0; i < kNumCrashSignals; i++) {
+    sigaction(kCrashSignals[i], &action, &PREVIOUS_CRASH_HANDLERS[i]);
   }
 
-  if (n_digits > 0) {
-    std::stringstream sub_second_time_str;
-    sub_second_time_str << "." << std::setw(n_digits) << std::setfill('0')
-                        << sub_second_time;
-    time_str += sub_second_time_str.str();
+  CRASH_HANDLERS_INSTALLED = true;
+#endif  // OS_WINDOWS
+}
+
+/**
+ * @brief      Put back the handlers replaced by _InstallCrashHandlers(), if it
+ *             was called.
+ */
+void _UninstallCrashHandlers() {
+#ifndef OS_WINDOWS
+  if (!CRASH_HANDLERS_INSTALLED) {
+    return;
+  }
+
+  for (std::size_t i = 0; i < kNumCrashSignals; i++) {
+    sigaction(kCrashSignals[i], &PREVIOUS_CRASH_HANDLERS[i], nullptr);
   }
 
-  return time_str;
+  CRASH_HANDLERS_INSTALLED = false;
+#endif  // OS_WINDOWS
 }
 
-std::string _GetFilenameToDisplay(int line, const std::string& file) {
-  boost::filesystem::path file_path(file);
-  std::string filename = file_path.filename().string();
-  std::string line_number = std::to_string(line);
+/**
+ * @brief      Write out everything and stop the logger's threads, when the
+ *             Logger returned by Init() is destroyed (or before exiting on a
+ *             FATAL message). Only the first call does anything.
+ */
+void _Shutdown() {
+  if (SHUTTING_DOWN.exchange(true, std::memory_order_acq_rel)) {
+    return;
+  }
 
-  // Pad the filename to the maximum length.
-  if (filename.length() <= FLAGS_max_filename_len) {
-    // Pad the filename with spaces (short files!).
-    filename =
-        std::string(FLAGS_max_filename_len - filename.length(), ' ') + filename;
-  } else {
-    // Truncate the filename (long files!). To do this, we separate the filename
-    // and the extension. We always want to show the extension + the last
-    // letter, and we always want to show the start (i.e. only truncate the
-    // middle of the filename).
-    std::string fname = file_path.stem().string();
-    std::string ext = file_path.extension().string();
+  if (LOG_EMITTER != nullptr) {
+    EMITTER_WAKEUP.Notify();
+    LOG_EMITTER->join();
+  }
 
-    // Pick how many characters to remove from the file. +1 for the extension
-    // dot and +3 for the ellipse, +2 for the last 2 characters.
-    int chars_left = FLAGS_max_filename_len - (ext.length() + 3 + 1 + 2);
+  // Let the sink workers write out what they have been given. Their log files
+  // are flushed below.
+  FORMAT_POOL.reset();
+  STDERR_WORKER.reset();
+  for (auto& worker : LOG_FILE_WORKERS) {
+    worker.reset();
+  }
 
-    // If there are no characters left... then just display as many as we can.
-    if (chars_left <= 0) {
-      filename = fname.substr(0, FLAGS_max_filename_len);
-    } else {
-      std::string first_part = fname.substr(0, chars_left);
-      filename =
-          first_part + "..." + fname.substr(fname.length() - 2) + "." + ext;
-    }
+  if (LOG_FLUSHER != nullptr) {
+    EMITTER_WAKEUP.Notify();
+    LOG_FLUSHER->join();
   }
 
-  // Pad the line number to 4 characters. Because really, you shouldn't have any
-  // files longer than 9999 lines, right?
-  if (line_number.length() < FLAGS_max_line_number_len) {
-    line_number +=
-        std::string(FLAGS_max_line_number_len - line_number.length(), ' ');
+  std::lock_guard<std::mutex> lock(EMIT_LOCK);
+  _FlushLogFiles();
+  NETWORK_SINK.reset();
+
+  // Finish any rotations which are in progress. Anything logged after this is
+  // rotated inline.
+  if (LOG_ROTATOR != nullptr) {
+    LOG_ROTATOR->Stop();
   }
 
-  return filename + ":" + line_number;
+  // Report the final statistics.
+  STATS_REPORTER.reset();
+  _UninstallCrashHandlers();
 }
 
 }  // namespace
 
-LogMessage::LogMessage(Level level, int verbosity, int line,
-                       const std::string& file, const std::string& msg_format,
+void CallSite::CountShed() const {
+  n_shed_.fetch_add(1, std::memory_order_relaxed);
+  if (!shed_registered_.load(std::memory_order_relaxed) &&
+      !shed_registered_.exchange(true, std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(SHEDDING_CALL_SITES_LOCK);
+    SHEDDING_CALL_SITES.push_back(this);
+  }
+}
+
+const ThreadIdentity* CurrentThreadIdentity() {
+  if (THREAD_IDENTITY == nullptr) {
+    THREAD_IDENTITY = _InternThreadIdentity(_GetOsThreadId(), "");
+  }
+
+  return THREAD_IDENTITY;
+}
+
+/**
+ * @brief      The rendered "file:line" text of a call site, along with the
+ *             flag values it was rendered with.
+ */
+struct RenderedCallSite {
+  uint32_t max_filename_len, max_line_number_len;
+  std::string text;
+};
+
+uint64_t CallSite::_ResolveVerbosity() const {
+  // Read the generation before the config, so that if Reconfigure() runs in
+  // between, the result is stamped with the old generation and looked up
+  // again next time.
+  uint32_t generation = VERBOSITY_GENERATION.load(std::memory_order_acquire);
+  ScopedPinnedConfig pin;
+  uint64_t resolved = uint64_t(generation) << 32 |
+                      _VerbosityForFile(_GetConfig(), file_);
+  verbosity_.store(resolved, std::memory_order_release);
+  return resolved;
+}
+
+const std::string& CallSite::FileAndLine() const {
+  ScopedPinnedConfig pin;
+  const Config& config = _GetConfig();
+  auto* rendered = rendered_.load(std::memory_order_acquire);
+  if (rendered != nullptr &&
+      rendered->max_filename_len == config.max_filename_len &&
+      rendered->max_line_number_len == config.max_line_number_len) {
+    return rendered->text;
+  }
+
+  auto* new_rendered = new RenderedCallSite{
+      config.max_filename_len, config.max_line_number_len, ""};
+  _AppendFilenameToDisplay(line_, file_, &new_rendered->text);
+
+  // If another emitter got here first with the same flags, use theirs and
+  // free ours. Old renderings are never freed, as another emitter might still
+  // be using them; they are only replaced if the filename flags change.
+  while (!rendered_.compare_exchange_weak(rendered, new_rendered,
+                                          std::memory_order_acq_rel)) {
+    if (rendered != nullptr &&
+        rendered->max_filename_len == config.max_filename_len &&
+        rendered->max_line_number_len == config.max_line_number_len) {
+      delete new_rendered;
+      return rendered->text;
+    }
+  }
+
+  return new_rendered->text;
+}
+
+LogMessage::LogMessage(const CallSite* site, int verbosity,
+                       const std::string& msg_format,
                        const string::FormatListType& format_args)
-    : level_(level),
+    : site_(site),
       verbosity_(verbosity),
-      line_(line),
-      file_(boost::filesystem::path(file).filename().string()),
       log_time_(std::chrono::system_clock::now()),
+      thread_(CurrentThreadIdentity()),
       msg_format_(msg_format),
       format_args_(format_args) {}
 
-LogMessage::LogMessage(Level level, int verbosity, int line,
-                       const std::string& file, const std::string& msg_format)
-    : level_(level),
+LogMessage::LogMessage(const CallSite* site, int verbosity,
+                       const std::string& msg_format)
+    : site_(site),
       verbosity_(verbosity),
-      line_(line),
-      file_(boost::filesystem::path(file).filename().string()),
       log_time_(std::chrono::system_clock::now()),
+      thread_(CurrentThreadIdentity()),
       msg_format_(msg_format) {}
 
+LogMessage::LogMessage(const CallSite* site, int verbosity,
+                       std::string&& msg_format,
+                       string::FormatListType&& format_args)
+    : site_(site),
+      verbosity_(verbosity),
+      log_time_(std::chrono::system_clock::now()),
+      thread_(CurrentThreadIdentity()),
+      msg_format_(std::move(msg_format)),
+      format_args_(std::move(format_args)) {}
+
+LogMessage::LogMessage(const CallSite* site, int verbosity,
+                       std::string&& msg_format)
+    : site_(site),
+      verbosity_(verbosity),
+      log_time_(std::chrono::system_clock::now()),
+      thread_(CurrentThreadIdentity()),
+      msg_format_(std::move(msg_format)) {}
+
+LogMessage::LogMessage(
+    const CallSite* site,
+    std::chrono::time_point<std::chrono::system_clock> log_time,
+    const std::string& msg_format, ArgBuffer&& args, bool checked)
+    : site_(site),
+      verbosity_(0),
+      log_time_(log_time),
+      thread_(CurrentThreadIdentity()),
+      msg_format_(msg_format),
+      args_(std::move(args)),
+      checked_format_(checked) {}
+
+void LogMessage::_FormatMessage(std::string* out, bool scope) const {
+  const char* format = static_format_;
+  std::size_t format_len = static_format_length_;
+  if (format == nullptr) {
+    format = msg_format_.data();
+    format_len = msg_format_.length();
+  }
+
+  // Messages without any braces don't need to be formatted (nor their lazy
+  // arguments worked out). The message of a structured message is never
+  // formatted, nor is text which is already formatted.
+  if (has_fields_ || preformatted_ ||
+      std::find_if(format, format + format_len, [](char c) {
+        return c == '{' || c == '}';
+      }) == format + format_len) {
+    out->assign(format, format_len);
+  } else {
+    // cppstring only takes a std::string format, so a static one is copied
+    // into a reused buffer rather than a new string.
+    static thread_local std::string format_buffer;
+    const std::string* format_string = &msg_format_;
+    if (static_format_ != nullptr && !checked_format_) {
+      format_buffer.assign(format, format_len);
+      format_string = &format_buffer;
+    }
+
+    const ArgBuffer& args = lazy_args_ != nullptr ? lazy_args_->Get() : args_;
+    if (checked_format_) {
+      out->clear();
+      CheckedFormatter formatter(format, out);
+      args.Visit(formatter);
+      formatter.Finish();
+    } else if (args.empty()) {
+      *out = string::Format(*format_string, format_args_);
+    } else {
+      // Decode the captured arguments.
+      static thread_local string::FormatListType decoded_args;
+      decoded_args.clear();
+      FormatListBuilder builder{&decoded_args};
+      args.Visit(builder);
+      *out = string::Format(*format_string, decoded_args);
+    }
+  }
+
+  if (suppressed_ > 0) {
+    out->append(" (");
+    _AppendInt(suppressed_, 1, out);
+    out->append(suppressed_ == 1 ? " message suppressed)"
+                                 : " messages suppressed)");
+  }
+
+  if (!scope) {
+    return;
+  }
+
+  if (span_ns_ >= 0) {
+    out->append(" (took ");
+    _AppendDuration(span_ns_, out);
+    out->push_back(')');
+  }
+
+  if (depth_ > 0) {
+    out->insert(0, std::size_t(depth_) * 2, ' ');
+  }
+}
+
 void LogMessage::Emit(const std::string& line_fmt) const {
+  // Reused between messages. This is per-thread, since messages going only to
+  // --logfile_mmap files are emitted concurrently.
+  static thread_local RenderedMessage rendered;
+  RenderOutputs(line_fmt, &rendered);
+  _WriteRenderedMessage(rendered);
+}
+
+void LogMessage::RenderOutputs(const std::string& line_fmt,
+                               RenderedMessage* out) const {
+  out->level = level();
+  out->to_stderr = out->to_files = out->to_binary = out->to_network = false;
+
   // If this message is too verbose, then just ignore it.
-  if (verbosity_ > FLAGS_v) {
+  if (verbosity_ > 0 && uint32_t(verbosity_) > site_->MaxVerbosity()) {
     return;
   }
 
-  // Format the message.
-  auto msg_formatted = string::Format(msg_format_, format_args_);
-
-  // Format the line.
-  auto line_formatted = string::FormatMap(
-      line_fmt, {{"message", msg_formatted},
-                 {"file", _GetFilenameToDisplay(line_, file_)},
-                 {"datetime", _GetTimeString(log_time_)},
-                 {"level", _LevelToString(level_)},
-                 {"thread", std::this_thread::get_id()}},
-      true);
-
-  // Add colors if requested.
-  std::string line_color = line_formatted;
-  if (FLAGS_colorize_output) {
-    line_color = string::FormatMap(line_color,
-                                   {
-                                       {"nc", string::color::kReset},
-                                       {"bold", string::color::kBold},
-                                       {"italic", string::color::kItalic},
-                                       {"black", string::color::kBlack},
-                                       {"red", string::color::kRed},
-                                       {"green", string::color::kGreen},
-                                       {"yellow", string::color::kYellow},
-                                       {"blue", string::color::kBlue},
-                                       {"magenta", string::color::kMagenta},
-                                       {"cyan", string::color::kCyan},
-                                       {"white", string::color::kWhite},
-                                       {"gray", string::color::kGray},
-                                       {"lc", _GetColor(level_)},
-                                   },
-                                   true);
-  }
-
-  // Output to stderr.
-  if (FLAGS_logtostderr && level_ >= _StringToLevel(FLAGS_min_log_level)) {
-    std::cerr << string::FormatTrimTags(line_color) << std::endl;
-  }
-
-  // Output to files.
-  if (FLAGS_logtofile) {
-    // Log to all of the relevant files.
-    auto min_level = _StringToLevel(FLAGS_min_log_level_file);
-    for (int i = min_level; i <= level_; i++) {
-      auto out_file_path =
-          boost::filesystem::path(FLAGS_logfile_dir) /
-          (FLAGS_logfile_name + "." + _LevelToLongString((Level)i));
-      std::ofstream& out_file = LOG_FILES[i];
-      if (!out_file.is_open()) {
-        out_file.open(out_file_path.string());
-      }
+  const Config& config = _GetConfig();
 
-      // Check to see if we need to rotate the file.
-      auto file_size = boost::filesystem::file_size(out_file_path);
-      if (file_size / 1024.0 / 1024.0 > FLAGS_logfile_max_size_mb) {
-        // Close the file.
-        out_file.close();
+  bool binary = config.log_format == BINARY;
+  bool json = config.log_format == JSON;
+  out->to_stderr = config.to_stderr && level() >= config.min_stderr_level;
+  out->to_files =
+      config.to_files && !binary && level() >= config.min_file_level;
+  out->to_binary =
+      config.to_files && binary && level() >= config.min_file_level;
+  out->to_network =
+      config.to_network && level() >= config.min_network_level;
+  out->log_time = log_time_;
 
-        // Move the file to the file + 1.
-        boost::filesystem::rename(out_file_path,
-                                  out_file_path.string() + ".old");
-        out_file.open(out_file_path.string());
-      }
+  // Binary logs don't need anything to be formatted.
+  if (out->to_binary) {
+    out->site = site_;
+    out->static_format = static_format_;
+    out->thread = thread_;
+    out->binary_payload.clear();
+    _AppendBinaryPayload(&out->binary_payload);
+  }
 
-      out_file << string::FormatTrimTags(line_formatted) << std::endl;
-      out_file.flush();
-    }
+  if (!out->to_stderr && !out->to_files && !out->to_network) {
+    return;
+  }
+
+  // Work out the value of each field. Once the buffers have grown large
+  // enough, this doesn't allocate (unless the message itself needs
+  // formatting).
+  static thread_local LineFields fields;
+  _FormatMessage(&fields.message);
+  fields.file.assign(site_->FileAndLine());
+  fields.datetime.clear();
+  _AppendTimeString(log_time_, &fields.datetime);
+  fields.level.assign(_LevelToString(level()));
+  fields.thread.assign(thread_->text);
+  fields.site = site_;
+  fields.kv = has_fields_ ? &args_ : nullptr;
+
+  const auto& compiled = _GetCompiledLineFormat(line_fmt, config);
+  if (out->to_stderr) {
+    _RenderLine(compiled.colored[level()], fields, false, &out->stderr_line);
+    out->stderr_line.push_back('\n');
+  }
+
+  // Files (and the network, which gets the same lines) are never colored.
+  if (out->to_files || out->to_network) {
+    _RenderLine(json ? compiled.json : compiled.plain, fields, json,
+                &out->file_line);
+    out->file_line.push_back('\n');
+  }
+}
+
+void LogMessage::Render(const std::string& line_fmt, bool colored,
+                        const std::string& thread, std::string* out) const {
+  ScopedPinnedConfig pin;
+  static thread_local LineFields fields;
+  _FormatMessage(&fields.message);
+  fields.file.assign(site_->FileAndLine());
+  fields.datetime.clear();
+  _AppendTimeString(log_time_, &fields.datetime);
+  fields.level.assign(_LevelToString(level()));
+  fields.thread.assign(thread);
+  fields.site = site_;
+  fields.kv = has_fields_ ? &args_ : nullptr;
+
+  const auto& compiled = _GetCompiledLineFormat(line_fmt, _GetConfig());
+  _RenderLine(colored ? compiled.colored[level()] : compiled.plain, fields,
+              false, out);
+}
+
+void LogMessage::_AppendBinaryPayload(std::string* out) const {
+  // Only messages with a fixed format can be stored unformatted, since the
+  // format goes in the dictionary. The suppressed count isn't part of it, and
+  // structured messages are stored with their fields as text. The scope a
+  // message is in (or ends) goes before its kind.
+  if (depth_ > 0) {
+    out->push_back(static_cast<char>(RECORD_DEPTH));
+    AppendVarint(depth_, out);
+  }
+
+  if (span_ns_ >= 0) {
+    out->push_back(static_cast<char>(RECORD_SPAN));
+    AppendVarint(uint64_t(span_ns_), out);
+  }
+
+  if (static_format_ != nullptr && format_args_.empty() && suppressed_ == 0 &&
+      !has_fields_) {
+    const ArgBuffer& args = lazy_args_ != nullptr ? lazy_args_->Get() : args_;
+    out->push_back(
+        static_cast<char>(checked_format_ ? RECORD_CHECKED_ARGS : RECORD_ARGS));
+    AppendVarint(args.size(), out);
+    out->append(args.data(), args.data_size());
+    return;
+  }
+
+  static thread_local std::string message;
+  _FormatMessage(&message, false);
+  if (has_fields_) {
+    FieldAppender appender(" ", false, &message);
+    args_.Visit(appender);
+  }
+
+  out->push_back(static_cast<char>(RECORD_TEXT));
+  out->append(message);
+}
+
+std::size_t LogMessage::FormatForCrash(char* data, std::size_t size) const {
+  auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                    log_time_.time_since_epoch())
+                    .count();
+  CrashLine line;
+  line.Append(_LevelToString(level()));
+  line.Append(" ");
+  line.AppendUnsigned(uint64_t(micros / 1000000), 1);
+  line.Append(".");
+  line.AppendUnsigned(uint64_t(micros % 1000000), 6);
+  line.Append(" ");
+  line.Append(site_->file());
+  line.Append(":");
+  line.AppendUnsigned(uint64_t(site_->line()), 1);
+  line.Append(" :: ");
+
+  const char* format = static_format_;
+  std::size_t format_len = static_format_length_;
+  if (format == nullptr) {
+    format = msg_format_.data();
+    format_len = msg_format_.length();
   }
+
+  // Lazy arguments would have to be worked out, and a cppstring argument list
+  // can't be rendered without allocating, so those formats are left as is.
+  if (has_fields_) {
+    line.Append(format, format_len);
+    CrashArgWriter writer(nullptr, 0, true, &line);
+    args_.Visit(writer);
+  } else if (preformatted_ || lazy_args_ != nullptr ||
+             (args_.empty() && !format_args_.empty())) {
+    line.Append(format, format_len);
+  } else {
+    CrashArgWriter writer(format, format_len, false, &line);
+    args_.Visit(writer);
+    writer.Finish();
+  }
+
+  line.data[line.length++] = '\n';
+
+  std::size_t length = std::min(line.length, size);
+  std::memcpy(data, line.data, length);
+  return length;
+}
+
+LogMessage LogMessage::_CopyForScopeEnd() const {
+  LogMessage copy(site_, log_time_, msg_format_, ArgBuffer(), checked_format_);
+  copy.verbosity_ = verbosity_;
+  copy.thread_ = thread_;
+  copy.static_format_ = static_format_;
+  copy.static_format_length_ = static_format_length_;
+  copy.format_args_ = format_args_;
+  copy.args_.Append(args_);
+  copy.has_fields_ = has_fields_;
+  copy.preformatted_ = preformatted_;
+  copy.depth_ = depth_;
+  return copy;
+}
+
+void LogScope::Start(LogMessage&& message) {
+  new (&end_) LogMessage(message._CopyForScopeEnd());
+  started_ = true;
+  QueueMessage(std::move(message));
+  ScopeDepth()++;
+  start_ = std::chrono::steady_clock::now();
+}
+
+void LogScope::_End() {
+  auto duration = std::chrono::steady_clock::now() - start_;
+  ScopeDepth()--;
+
+  auto* end = reinterpret_cast<LogMessage*>(&end_);
+  end->log_time_ = std::chrono::system_clock::now();
+  end->set_span(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(duration));
+  QueueMessage(std::move(*end));
+  end->~LogMessage();
 }
 
-void QueueMessage(const LogMessage& msg) {
-  if (FLAGS_async_logging) {
-    // Block until the message queue is a sensible size.
-    while (LOG_MESSAGE_QUEUE.size() > FLAGS_async_queue_max_len) {
-      ;
+void QueueMessage(LogMessage&& msg) {
+  ScopedPinnedConfig pin;
+  Level level = msg.level();
+  if (THREAD_BUFFERS_ENABLED) {
+    auto* buffer = _GetThreadBuffer();
+    if (!_ShedMessage(msg, buffer->queue) &&
+        _PushMessage(&buffer->queue, std::move(msg), false)) {
+      _CountEnqueued(level);
+      EMITTER_WAKEUP.Notify();
     }
+  } else if (LOG_MESSAGE_QUEUE != nullptr) {
+    if (!_ShedMessage(msg, *LOG_MESSAGE_QUEUE)) {
+      if (_PushMessage(LOG_MESSAGE_QUEUE.get(), std::move(msg), true)) {
+        _CountEnqueued(level);
+      }
 
-    LOG_MESSAGE_QUEUE_INSERT_LOCK.lock();
-    LOG_MESSAGE_QUEUE.push_back(msg);
-    LOG_MESSAGE_QUEUE_INSERT_LOCK.unlock();
-    LOG_MESSAGE_QUEUE_INSERT.notify_one();
+      EMITTER_WAKEUP.Notify();
+    }
   } else {
-    _DoEmitMessage(msg);
+    // Memory-mapped log files can be written by several threads at once. The
+    // config is pinned, so that a concurrent Reconfigure() can't switch an
+    // unlocked message onto an output which needs EMIT_LOCK part way through
+    // (nor mix two configs in one line).
+    const Config& config = _GetConfig();
+    if (_EmitsWithoutLock(config)) {
+      _DoEmitMessage(msg);
+    } else {
+      std::lock_guard<std::mutex> lock(EMIT_LOCK);
+      _DoEmitMessage(msg);
+    }
   }
 
-  // If the message was fatal, die.
-  if (msg.level() == FATAL) {
+  // If the message was fatal, write it out (along with everything queued
+  // before it), then die. The logger is only shut down if the emitter kept
+  // up, since otherwise it might never stop.
+  if (level == FATAL) {
+    if (_DrainQueue()) {
+      _Shutdown();
+    }
+
     std::exit(EXIT_FAILURE);
   }
 }
 
-Logger::~Logger() {
-  SHUTTING_DOWN = true;
-  if (LOG_EMITTER != nullptr) {
-    LOG_MESSAGE_QUEUE_INSERT.notify_one();
-    LOG_EMITTER->join();
-  }
-}
+Logger::~Logger() { _Shutdown(); }
 
 }  // namespace internal
 
 std::unique_ptr<internal::Logger> Init() {
+  // The logger's threads pin themselves as they start.
+  internal::SetLoggerCpus(internal::ParseCpuList(FLAGS_log_emitter_cpus));
+  if (string::ToLower(FLAGS_async_emitter_wait) == "spin") {
+    internal::EMITTER_WAKEUP.SetSpin(
+        std::chrono::microseconds(FLAGS_async_emitter_spin_us));
+  }
+
   // Start the thread, if required.
-  if (FLAGS_async_logging) {
+  internal::BATCH_WRITES = FLAGS_async_logging && FLAGS_async_batch_writes &&
+                           !FLAGS_async_sink_threads;
+  internal::SINK_WORKERS_ENABLED =
+      FLAGS_async_logging && FLAGS_async_sink_threads;
+  if (FLAGS_async_logging && FLAGS_log_format_threads > 0) {
+    internal::FORMAT_POOL.reset(
+        new internal::FormatPool(FLAGS_log_format_threads));
+  }
+
+  if (FLAGS_async_logging && FLAGS_async_per_thread_buffers) {
+    internal::THREAD_BUFFERS_ENABLED = true;
+    internal::LOG_EMITTER = new std::thread(internal::_ProcessThreadBuffers);
+  } else if (FLAGS_async_logging) {
+    internal::LOG_MESSAGE_QUEUE.reset(
+        new internal::RingBuffer<internal::LogMessage>(
+            FLAGS_async_queue_max_len));
     internal::LOG_EMITTER = new std::thread(internal::_ProcessMessageQueue);
   }
 
@@ -469,11 +4448,237 @@ std::unique_ptr<internal::Logger> Init() {
       FLAGS_logfile_name =
           boost::filesystem::basename(gflags::ProgramInvocationName());
     }
+
+    internal::_SetLogFilePaths();
+    internal::LOG_ROTATOR.reset(new internal::LogRotator(
+        FLAGS_logfile_compression, FLAGS_logfile_max_files,
+        uint64_t(FLAGS_logfile_max_total_mb) * 1024 * 1024));
+
+#ifndef OS_WINDOWS
+    // Memory-mapped files are opened up front, so that they never have to be
+    // created while other threads are writing.
+    std::size_t max_size = std::size_t(FLAGS_logfile_max_size_mb) * 1024 * 1024;
+    if (FLAGS_logfile_mmap && !FLAGS_logfile_single && max_size > 0 &&
+        internal::_StringToLogFormat(FLAGS_log_format) != internal::BINARY) {
+      auto min_level = internal::_StringToLevel(FLAGS_min_log_level_file);
+      for (int i = min_level; i < internal::N_LEVELS; i++) {
+        internal::MMAP_LOG_FILES[i].reset(new internal::MmapFileSink(
+            internal::LOG_FILE_PATHS[i], max_size, internal::LOG_ROTATOR.get(),
+            &internal::LOG_FILE_COUNTERS));
+      }
+
+      internal::MMAP_LOG_FILES_ENABLED = true;
+    }
+#endif  // OS_WINDOWS
+  }
+
+  if (!FLAGS_log_network.empty()) {
+    internal::NETWORK_SINK.reset(new internal::NetworkSink(
+        FLAGS_log_network,
+        boost::filesystem::basename(gflags::ProgramInvocationName()),
+        FLAGS_log_network_facility,
+        std::size_t(FLAGS_log_network_buffer_kb) * 1024,
+        std::chrono::milliseconds(FLAGS_log_network_flush_interval_ms),
+        &internal::NETWORK_COUNTERS, &internal::SINK_LINES_DROPPED));
+  }
+
+  // This also compiles the line format, before anything is emitted.
+  Reconfigure();
+
+  // In synchronous mode, nothing else would write out log lines which have
+  // been buffered for too long.
+  if (FLAGS_logtofile && !FLAGS_async_logging &&
+      !internal::MMAP_LOG_FILES_ENABLED) {
+    internal::LOG_FLUSHER =
+        new std::thread(internal::_ProcessLogFileFlushes);
+  }
+
+  if (!FLAGS_log_stats_file.empty() || !FLAGS_log_stats_statsd.empty()) {
+    internal::STATS_REPORTER.reset(new internal::StatsReporter(
+        std::chrono::milliseconds(std::max<uint32_t>(
+            1, FLAGS_log_stats_interval_ms)),
+        FLAGS_log_stats_file, FLAGS_log_stats_statsd,
+        FLAGS_log_stats_statsd_prefix));
+  }
+
+  if (FLAGS_log_crash_handler) {
+    internal::_InstallCrashHandlers();
   }
 
   return std::unique_ptr<internal::Logger>(new internal::Logger());
 }
 
-int MessagesInQueue() { return internal::LOG_MESSAGE_QUEUE.size(); }
+void Reconfigure() {
+  using internal::_StringToLevel;
+
+  std::unique_ptr<internal::Config> config(new internal::Config());
+  config->to_stderr = FLAGS_logtostderr;
+  config->to_files = FLAGS_logtofile;
+  config->min_stderr_level = _StringToLevel(FLAGS_min_log_level);
+  config->min_file_level = _StringToLevel(FLAGS_min_log_level_file);
+  config->to_network = !FLAGS_log_network.empty();
+  config->min_network_level = _StringToLevel(FLAGS_log_network_min_level);
+  config->verbosity = FLAGS_v;
+  config->vmodule = internal::_ParseVmodule(FLAGS_vmodule);
+  config->log_format = internal::_StringToLogFormat(FLAGS_log_format);
+  config->line_format = FLAGS_line_format;
+  config->colorize = FLAGS_colorize_output;
+  config->compiled_line_format.reset(
+      internal::_CompileLineFormat(config->line_format, config->colorize));
+  config->datetime_format = FLAGS_datetime_format;
+  config->datetime_digits =
+      internal::_StringToDatetimePrecision(FLAGS_datetime_precision);
+  config->max_filename_len = FLAGS_max_filename_len;
+  config->max_line_number_len = FLAGS_max_line_number_len;
+  config->logfile_single = FLAGS_logfile_single;
+  config->logfile_max_size = uint64_t(FLAGS_logfile_max_size_mb) * 1024 * 1024;
+  config->overflow_policy =
+      internal::_StringToOverflowPolicy(FLAGS_async_overflow_policy);
+  config->overflow_min_level = _StringToLevel(FLAGS_async_overflow_min_level);
+
+  auto to_thousandths = [](double fraction) {
+    return uint32_t(std::max(0.0, std::min(1.0, fraction)) * 1000);
+  };
+  config->shed_low_watermark = to_thousandths(FLAGS_async_shed_low_watermark);
+  config->shed_high_watermark = to_thousandths(FLAGS_async_shed_high_watermark);
+  config->shed_keep_one_in =
+      std::max<uint32_t>(1, FLAGS_async_shed_keep_one_in);
+
+  // Work out the lowest level any output will display. If nothing is being
+  // output, then only FATAL messages (which must still terminate) get through.
+  int min_level = internal::N_LEVELS;
+  if (config->to_stderr) {
+    min_level = std::min<int>(min_level, config->min_stderr_level);
+  }
+
+  if (config->to_files) {
+    min_level = std::min<int>(min_level, config->min_file_level);
+  }
+
+  if (config->to_network) {
+    min_level = std::min<int>(min_level, config->min_network_level);
+  }
+
+  // Only call sites which --v or some --vmodule pattern might let through
+  // need to look any further.
+  uint32_t max_verbosity = config->verbosity;
+  for (const auto& pattern : config->vmodule) {
+    max_verbosity = std::max(max_verbosity, pattern.second);
+  }
+
+  // Publish the new config before the levels it lets through, and before
+  // telling call sites to look up their verbosity in it. Then free the
+  // configs which nobody can still be using, and retire the old one.
+  std::lock_guard<std::mutex> lock(internal::CONFIG_LOCK);
+  config->generation = ++internal::CONFIG_GENERATION;
+  internal::CONFIG.store(config.get(), std::memory_order_seq_cst);
+  if (internal::CURRENT_CONFIG != nullptr) {
+    internal::RETIRED_CONFIGS.push_back(std::move(internal::CURRENT_CONFIG));
+  }
+
+  internal::CURRENT_CONFIG = std::move(config);
+  internal::_FreeUnpinnedConfigs();
+  internal::MIN_ENABLED_LEVEL.store(min_level, std::memory_order_relaxed);
+  internal::MAX_ENABLED_VERBOSITY.store(max_verbosity,
+                                        std::memory_order_relaxed);
+  internal::VERBOSITY_GENERATION.fetch_add(1, std::memory_order_release);
+}
+
+void SetThreadName(const std::string& name) {
+  internal::THREAD_IDENTITY = internal::_InternThreadIdentity(
+      internal::_GetOsThreadId(), name);
+}
+
+int MessagesInQueue() {
+  if (internal::THREAD_BUFFERS_ENABLED) {
+    std::lock_guard<std::mutex> lock(internal::THREAD_BUFFERS_LOCK);
+    int n_messages = 0;
+    for (const auto& buffer : internal::THREAD_BUFFERS) {
+      n_messages += buffer->queue.Size();
+    }
+
+    return n_messages;
+  }
+
+  if (internal::LOG_MESSAGE_QUEUE == nullptr) {
+    return 0;
+  }
+
+  return internal::LOG_MESSAGE_QUEUE->Size();
+}
+
+uint64_t MessagesDropped() {
+  uint64_t dropped = 0;
+  for (auto& count : internal::MESSAGES_DROPPED) {
+    dropped += count.load(std::memory_order_relaxed);
+  }
+
+  return dropped;
+}
+
+uint64_t MessagesShed() {
+  uint64_t shed = 0;
+  for (auto& count : internal::MESSAGES_SHED) {
+    shed += count.load(std::memory_order_relaxed);
+  }
+
+  return shed;
+}
+
+uint64_t SinkLinesDropped() {
+  return internal::SINK_LINES_DROPPED.load(std::memory_order_relaxed);
+}
+
+BatchStats GetBatchStats() {
+  BatchStats stats;
+  stats.batches = internal::EMITTER_BATCHES.load(std::memory_order_relaxed);
+  stats.messages =
+      internal::EMITTER_BATCH_MESSAGES.load(std::memory_order_relaxed);
+  stats.max_batch_size =
+      internal::EMITTER_MAX_BATCH_SIZE.load(std::memory_order_relaxed);
+  return stats;
+}
+
+Stats GetStats() {
+  Stats stats = Stats();
+  for (auto* counts = internal::PRODUCER_COUNTS.load(std::memory_order_acquire);
+       counts != nullptr; counts = counts->next) {
+    for (int i = 0; i < internal::N_LEVELS; i++) {
+      stats.enqueued[i] += counts->enqueued[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  for (int i = 0; i < internal::N_LEVELS; i++) {
+    stats.emitted[i] =
+        internal::MESSAGES_EMITTED[i].load(std::memory_order_relaxed);
+    stats.dropped[i] =
+        internal::MESSAGES_DROPPED[i].load(std::memory_order_relaxed);
+    stats.shed[i] = internal::MESSAGES_SHED[i].load(std::memory_order_relaxed);
+  }
+
+  // The thread buffers can't be counted up without locking, so only their
+  // capacity is given.
+  if (internal::THREAD_BUFFERS_ENABLED) {
+    stats.queue_capacity = FLAGS_async_thread_buffer_len;
+  } else if (internal::LOG_MESSAGE_QUEUE != nullptr) {
+    stats.queue_size = internal::LOG_MESSAGE_QUEUE->Size();
+    stats.queue_capacity = internal::LOG_MESSAGE_QUEUE->Capacity();
+  }
+
+  stats.queue_high_water =
+      internal::QUEUE_HIGH_WATER.load(std::memory_order_relaxed);
+  stats.producer_waits =
+      internal::PRODUCER_WAITS.load(std::memory_order_relaxed);
+  stats.producer_wait_ns =
+      internal::PRODUCER_WAIT_NS.load(std::memory_order_relaxed);
+  stats.sink_lines_dropped = SinkLinesDropped();
+  stats.batches = GetBatchStats();
+  internal::EMITTER_BATCH_SIZES.Snapshot(&stats.batch_sizes);
+  internal::STDERR_COUNTERS.Snapshot(&stats.stderr_output);
+  internal::LOG_FILE_COUNTERS.Snapshot(&stats.log_files);
+  internal::BINARY_LOG_COUNTERS.Snapshot(&stats.binary_log);
+  internal::NETWORK_COUNTERS.Snapshot(&stats.network);
+  return stats;
+}
 
 }  // namespace cpplog
@@ -1,11 +1,22 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
 #include <memory>
 #include <ostream>
 #include <string>
+#include <type_traits>
+#include <utility>
 
+#include "arg_buffer.h"
+#include "checked_format.h"
+#include "log_stream.h"
+#include "rate_limiter.h"
+#include "stats.h"
 #include "util/string/format.h"
 
 namespace cpplog {
@@ -17,18 +28,524 @@ namespace internal {
  */
 enum Level { TRACE, DEBUG, INFO, WARNING, ERROR, FATAL, N_LEVELS };
 
+/**
+ * Messages below this level are removed at compile time. Build with e.g.
+ * -DCPPLOG_STRIP_BELOW=INFO to compile out all TRACE and DEBUG messages.
+ */
+#ifndef CPPLOG_STRIP_BELOW
+#define CPPLOG_STRIP_BELOW TRACE
+#endif  // CPPLOG_STRIP_BELOW
+constexpr Level kStripBelow = CPPLOG_STRIP_BELOW;
+
+/**
+ * The lowest level which will be displayed by any output, and the highest
+ * verbosity which will be displayed. These are cached copies of the flags
+ * which are refreshed by cpplog::Reconfigure(). Until then, everything is let
+ * through and filtered when the message is emitted.
+ */
+extern std::atomic<int> MIN_ENABLED_LEVEL;
+extern std::atomic<unsigned int> MAX_ENABLED_VERBOSITY;
+
+/**
+ * Incremented by cpplog::Reconfigure(), so that call sites know to look up
+ * their --vmodule verbosity again. Call sites start at generation 0, so this
+ * starts at 1.
+ */
+extern std::atomic<uint32_t> VERBOSITY_GENERATION;
+
+/**
+ * @brief      Whether or not messages of the given level are compiled in.
+ *             FATAL messages are never stripped, as they terminate the
+ *             program.
+ */
+constexpr bool LevelCompiledIn(Level level) {
+  return level == FATAL || level >= kStripBelow;
+}
+
+/**
+ * @brief      Whether or not a message of the given level will be displayed
+ *             anywhere. This is checked before the message is constructed, so
+ *             disabled messages never evaluate their arguments.
+ */
+inline bool LevelEnabled(Level level) {
+  return level == FATAL ||
+         level >= MIN_ENABLED_LEVEL.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief      The padded "file:line" text of a call site. Defined in log.cc.
+ */
+struct RenderedCallSite;
+
+/**
+ * @brief      The identity of a thread which logs messages, as shown by
+ *             {thread}: its OS thread id, or the name given to
+ *             cpplog::SetThreadName(). Each is rendered once and never freed,
+ *             so messages can still refer to it after the thread has exited.
+ */
+struct ThreadIdentity {
+  uint64_t id;
+  std::string text;
+};
+
+/**
+ * @brief      Get the identity of the calling thread. Defined in log.cc.
+ */
+const ThreadIdentity* CurrentThreadIdentity();
+
+/**
+ * @brief      The number of LOG_SCOPED scopes the calling thread is inside.
+ *             Messages are indented by this much.
+ */
+inline uint32_t& ScopeDepth() {
+  static thread_local uint32_t depth = 0;
+  return depth;
+}
+
+/**
+ * @brief      A message rendered for each of its outputs, ready to be written.
+ *             Defined in log.cc.
+ */
+struct RenderedMessage;
+
+/**
+ * @brief      A descriptor for a single logging statement. Each logging macro
+ *             creates a static one of these, which is initialized at compile
+ *             time, so the file, line and level never need to be copied into
+ *             the message.
+ */
+class CallSite {
+ public:
+  constexpr CallSite(const char* file, int line, Level level)
+      : file_(_GetBasename(file, file)),
+        line_(line),
+        level_(level),
+        rendered_(nullptr),
+        n_shed_(0),
+        shed_registered_(false),
+        verbosity_(0) {}
+
+  CallSite(const CallSite&) = delete;
+  CallSite& operator=(const CallSite&) = delete;
+
+  /**
+   * @brief      The file the call site is in, without any directories.
+   */
+  const char* file() const { return file_; }
+
+  /**
+   * @brief      The line the call site is on.
+   */
+  int line() const { return line_; }
+
+  /**
+   * @brief      The level the call site logs at.
+   */
+  Level level() const { return level_; }
+
+  /**
+   * @brief      Get the filename and line number, padded or truncated
+   *             according to --max_filename_len and --max_line_number_len.
+   *             This is rendered the first time it is needed, and again only
+   *             if those flags change.
+   */
+  const std::string& FileAndLine() const;
+
+  /**
+   * @brief      Count a message from this call site which was shed because the
+   *             async queue was filling up (see --async_shed_low_watermark).
+   */
+  void CountShed() const;
+
+  /**
+   * @brief      Get the number of messages shed since the last call, and reset
+   *             it.
+   */
+  uint64_t TakeShedCount() const {
+    return n_shed_.exchange(0, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief      Get the highest verbosity shown from this call site: the level
+   *             for the first --vmodule pattern matching its file, or else
+   *             --v. Patterns are only matched the first time this is called,
+   *             and again after cpplog::Reconfigure().
+   */
+  unsigned int MaxVerbosity() const {
+    uint64_t cached = verbosity_.load(std::memory_order_acquire);
+    if (uint32_t(cached >> 32) !=
+        VERBOSITY_GENERATION.load(std::memory_order_relaxed)) {
+      cached = _ResolveVerbosity();
+    }
+
+    return uint32_t(cached);
+  }
+
+ private:
+  /**
+   * @brief      Match the call site against the current --vmodule and cache
+   *             the result, along with the generation it is valid for.
+   */
+  uint64_t _ResolveVerbosity() const;
+
+  static constexpr bool _IsSeparator(char c) { return c == '/' || c == '\\'; }
+
+  static constexpr const char* _GetBasename(const char* path,
+                                            const char* basename) {
+    return *path == '\0'
+               ? basename
+               : _GetBasename(path + 1, _IsSeparator(*path) ? path + 1
+                                                            : basename);
+  }
+
+  const char* file_;
+  int line_;
+  Level level_;
+  mutable std::atomic<const RenderedCallSite*> rendered_;
+  mutable std::atomic<uint64_t> n_shed_;
+  mutable std::atomic<bool> shed_registered_;
+
+  /**
+   * The VERBOSITY_GENERATION (in the high 32 bits) which the cached verbosity
+   * (in the low 32 bits) is valid for.
+   */
+  mutable std::atomic<uint64_t> verbosity_;
+};
+
+/**
+ * @brief      Whether or not a message of the given level and verbosity from a
+ *             call site will be displayed anywhere. Messages more verbose than
+ *             any --v or --vmodule level fail the first check, so only
+ *             messages which might be shown look at the call site.
+ */
+inline bool VerbosityEnabled(Level level, unsigned int verbosity,
+                             const CallSite& site) {
+  return level == FATAL ||
+         (level >= MIN_ENABLED_LEVEL.load(std::memory_order_relaxed) &&
+          verbosity <= MAX_ENABLED_VERBOSITY.load(std::memory_order_relaxed) &&
+          verbosity <= site.MaxVerbosity());
+}
+
+/**
+ * @brief      A key and value attached to a structured log message (see
+ *             LOG_KV). Both are copied into the message, the value in the
+ *             same binary form as any other argument.
+ */
+class KeyValue {
+ public:
+  template <typename T>
+  KeyValue(const char* key, const T& value) : key_(key) {
+    value_.Add(value);
+  }
+
+  const char* key() const { return key_; }
+  const ArgBuffer& value() const { return value_; }
+
+ private:
+  const char* key_;
+  ArgBuffer value_;
+};
+
+/**
+ * @brief      The text of a message which is already formatted (e.g. by
+ *             LOG_STREAM), and so is shown as it is, braces and all.
+ */
+struct PreformattedText {
+  std::string text;
+};
+
+/**
+ * @brief      A format string which lives as long as the program (e.g. one in
+ *             a static table), so that a message can store it rather than
+ *             copy it, as it does a string literal. This stands in for a
+ *             std::string_view, which C++11 doesn't have; the string must
+ *             still be NUL-terminated.
+ */
+struct StaticFormat {
+  explicit StaticFormat(const char* format)
+      : data(format), length(std::strlen(format)) {}
+
+  const char* data;
+  std::size_t length;
+};
+
+/**
+ * @brief      Marks a message whose arguments are worked out lazily (see
+ *             LOG_LAZY).
+ */
+struct Lazy {};
+
+/**
+ * @brief      The arguments of a LOG_LAZY message. They are only worked out
+ *             (once) when the message is about to be written somewhere, which
+ *             in async mode is on the emitter thread.
+ */
+class LazyArgs {
+ public:
+  virtual ~LazyArgs() = default;
+
+  /**
+   * @brief      Get the arguments, working them out the first time.
+   */
+  const ArgBuffer& Get() {
+    if (!evaluated_) {
+      _Evaluate(&args_);
+      evaluated_ = true;
+    }
+
+    return args_;
+  }
+
+ protected:
+  virtual void _Evaluate(ArgBuffer* args) = 0;
+
+ private:
+  ArgBuffer args_;
+  bool evaluated_ = false;
+};
+
+/**
+ * @brief      Calls some functions, capturing each result as an argument.
+ */
+template <typename... Fns>
+class LazyCalls;
+
+template <>
+class LazyCalls<> : public LazyArgs {
+ protected:
+  void _Evaluate(ArgBuffer*) override {}
+};
+
+template <typename Fn, typename... Rest>
+class LazyCalls<Fn, Rest...> : public LazyCalls<Rest...> {
+ public:
+  LazyCalls(Fn&& fn, Rest&&... rest)
+      : LazyCalls<Rest...>(std::move(rest)...), fn_(std::move(fn)) {}
+
+ protected:
+  void _Evaluate(ArgBuffer* args) override {
+    args->Add(fn_());
+    LazyCalls<Rest...>::_Evaluate(args);
+  }
+
+ private:
+  Fn fn_;
+};
+
+/**
+ * @brief      Marks a message whose format was checked at compile time (see
+ *             LOGF), and so is formatted by cpplog itself rather than by
+ *             cppstring.
+ */
+struct CheckedFormat {};
+
 /**
  * @brief      A class representing a single log message.
  */
 class LogMessage {
  public:
-  LogMessage(Level level, int verbosity, int line, const std::string& file,
+  /**
+   * @brief      Create a new log message.
+   *
+   * @param[in]  site         The call site the message was logged from.
+   *                          This must outlive the message.
+   * @param[in]  verbosity    The verbosity of the message (see VLOG).
+   * @param[in]  msg_format   The cppstring format string of the message.
+   * @param[in]  format_args  The arguments to format the message with.
+   */
+  LogMessage(const CallSite* site, int verbosity,
              const std::string& msg_format);
 
-  LogMessage(Level level, int verbosity, int line, const std::string& file,
-             const std::string& msg_format,
+  LogMessage(const CallSite* site, int verbosity, const std::string& msg_format,
              const string::FormatListType& format_args);
 
+  LogMessage(const CallSite* site, int verbosity, std::string&& msg_format);
+
+  LogMessage(const CallSite* site, int verbosity, std::string&& msg_format,
+             string::FormatListType&& format_args);
+
+  template <std::size_t N>
+  LogMessage(const CallSite* site, int verbosity, const char (&msg_format)[N],
+             const string::FormatListType& format_args)
+      : site_(site),
+        verbosity_(verbosity),
+        log_time_(std::chrono::system_clock::now()),
+        thread_(CurrentThreadIdentity()),
+        static_format_(msg_format),
+        static_format_length_(std::strlen(msg_format)),
+        format_args_(format_args) {}
+
+  template <std::size_t N>
+  LogMessage(const CallSite* site, int verbosity, const char (&msg_format)[N],
+             string::FormatListType&& format_args)
+      : site_(site),
+        verbosity_(verbosity),
+        log_time_(std::chrono::system_clock::now()),
+        thread_(CurrentThreadIdentity()),
+        static_format_(msg_format),
+        static_format_length_(std::strlen(msg_format)),
+        format_args_(std::move(format_args)) {}
+
+  /**
+   * @brief      Create a new log message, capturing the arguments in binary
+   *             form. Formatting is deferred until the message is emitted, so
+   *             this is much cheaper than passing a FormatListType, especially
+   *             in async mode. String literal formats are not copied.
+   *
+   *                 LOG_INFO("Took {}ms to handle {}", elapsed_ms, name);
+   */
+  template <std::size_t N, typename... Args>
+  LogMessage(const CallSite* site, int verbosity, const char (&msg_format)[N],
+             const Args&... args)
+      : site_(site),
+        verbosity_(verbosity),
+        log_time_(std::chrono::system_clock::now()),
+        thread_(CurrentThreadIdentity()),
+        static_format_(msg_format),
+        static_format_length_(std::strlen(msg_format)) {
+    args_.Add(args...);
+  }
+
+  template <typename... Args>
+  LogMessage(const CallSite* site, int verbosity, const std::string& msg_format,
+             const Args&... args)
+      : site_(site),
+        verbosity_(verbosity),
+        log_time_(std::chrono::system_clock::now()),
+        thread_(CurrentThreadIdentity()),
+        msg_format_(msg_format) {
+    args_.Add(args...);
+  }
+
+  /**
+   * @brief      Create a new log message from a temporary string (e.g. one
+   *             built for the message), which is moved in rather than copied.
+   */
+  template <typename... Args>
+  LogMessage(const CallSite* site, int verbosity, std::string&& msg_format,
+             const Args&... args)
+      : site_(site),
+        verbosity_(verbosity),
+        log_time_(std::chrono::system_clock::now()),
+        thread_(CurrentThreadIdentity()),
+        msg_format_(std::move(msg_format)) {
+    args_.Add(args...);
+  }
+
+  /**
+   * @brief      Create a new log message whose format is stored rather than
+   *             copied, as a string literal's is (see StaticFormat).
+   *
+   *                 LOG_INFO(cpplog::StaticFormat(kFormats[state]), id);
+   */
+  template <typename... Args>
+  LogMessage(const CallSite* site, int verbosity, StaticFormat msg_format,
+             const Args&... args)
+      : site_(site),
+        verbosity_(verbosity),
+        log_time_(std::chrono::system_clock::now()),
+        thread_(CurrentThreadIdentity()),
+        static_format_(msg_format.data),
+        static_format_length_(msg_format.length) {
+    args_.Add(args...);
+  }
+
+  /**
+   * @brief      Create a new log message whose arguments are the results of
+   *             some functions, which are only called once the message is
+   *             about to be written somewhere (see LOG_LAZY).
+   */
+  template <std::size_t N, typename... Fns>
+  LogMessage(const CallSite* site, int verbosity, Lazy,
+             const char (&msg_format)[N], Fns... fns)
+      : site_(site),
+        verbosity_(verbosity),
+        log_time_(std::chrono::system_clock::now()),
+        thread_(CurrentThreadIdentity()),
+        static_format_(msg_format),
+        static_format_length_(std::strlen(msg_format)),
+        lazy_args_(new LazyCalls<Fns...>(std::move(fns)...)) {}
+
+  /**
+   * @brief      Create a new log message whose format was checked at compile
+   *             time (see LOGF). The arguments are captured as they are for
+   *             LOG, but formatted without cppstring.
+   */
+  template <std::size_t N, typename... Args>
+  LogMessage(const CallSite* site, int verbosity, CheckedFormat,
+             const char (&msg_format)[N], const Args&... args)
+      : site_(site),
+        verbosity_(verbosity),
+        log_time_(std::chrono::system_clock::now()),
+        thread_(CurrentThreadIdentity()),
+        static_format_(msg_format),
+        static_format_length_(std::strlen(msg_format)),
+        checked_format_(true) {
+    args_.Add(args...);
+  }
+
+  /**
+   * @brief      Create a new structured log message: a fixed message with some
+   *             key/value fields, which --log_format=json writes as members
+   *             of the line's object.
+   *
+   *                 LOG_INFO_KV("Handled request", {"user", id},
+   *                             {"latency_us", latency_us});
+   */
+  template <std::size_t N>
+  LogMessage(const CallSite* site, int verbosity, const char (&message)[N],
+             std::initializer_list<KeyValue> fields)
+      : site_(site),
+        verbosity_(verbosity),
+        log_time_(std::chrono::system_clock::now()),
+        thread_(CurrentThreadIdentity()),
+        static_format_(message),
+        static_format_length_(std::strlen(message)),
+        has_fields_(true) {
+    _AddFields(fields);
+  }
+
+  LogMessage(const CallSite* site, int verbosity, const std::string& message,
+             std::initializer_list<KeyValue> fields)
+      : site_(site),
+        verbosity_(verbosity),
+        log_time_(std::chrono::system_clock::now()),
+        thread_(CurrentThreadIdentity()),
+        msg_format_(message),
+        has_fields_(true) {
+    _AddFields(fields);
+  }
+
+  /**
+   * @brief      Create a new log message whose text is already formatted. The
+   *             text is moved into the message.
+   */
+  LogMessage(const CallSite* site, int verbosity, PreformattedText&& message)
+      : site_(site),
+        verbosity_(verbosity),
+        log_time_(std::chrono::system_clock::now()),
+        thread_(CurrentThreadIdentity()),
+        msg_format_(std::move(message.text)),
+        preformatted_(true) {}
+
+  /**
+   * @brief      Recreate a message which was written to a binary log, so that
+   *             it can be rendered (see Render()).
+   *
+   * @param[in]  site        The call site the message was logged from.
+   * @param[in]  log_time    The time the message was logged.
+   * @param[in]  msg_format  The format string of the message.
+   * @param[in]  args        The captured arguments.
+   * @param[in]  checked     Whether or not the message was logged by LOGF.
+   */
+  LogMessage(const CallSite* site,
+             std::chrono::time_point<std::chrono::system_clock> log_time,
+             const std::string& msg_format, ArgBuffer&& args,
+             bool checked = false);
+
+  LogMessage(LogMessage&&) = default;
+  LogMessage& operator=(LogMessage&&) = default;
+
   /**
    * @brief      Emit this log message to the given stream using some format.
    *
@@ -38,6 +555,10 @@ class LogMessage {
    *             - {message} will be replaced with the message.
    *             - {datetime} will be the date the message was created.
    *             - {file} will be the file the message was logged from.
+   *             - {thread} will be the thread which logged the message.
+   *             - {fields} will be the fields of a structured message (see
+   *               LOG_KV), as key=value pairs. Without it, they follow
+   *               {message}.
    *
    *             If `color` is set to `true`:
    *
@@ -51,26 +572,91 @@ class LogMessage {
    */
   void Emit(const std::string& line_fmt) const;
 
+  /**
+   * @brief      Render this message as a line of text, as Emit() would (but
+   *             without a trailing newline).
+   *
+   * @param[in]  line_fmt  The format string of the line.
+   * @param[in]  colored   Whether or not to color the line.
+   * @param[in]  thread    The value of the {thread} field.
+   * @param[out] out       The buffer to render into. It is cleared first.
+   */
+  void Render(const std::string& line_fmt, bool colored,
+              const std::string& thread, std::string* out) const;
+
+  /**
+   * @brief      Do the first half of Emit(): render this message for every
+   *             output it goes to, without writing anything. This can be done
+   *             on any thread.
+   *
+   * @param[in]  line_fmt  The format string of the line to output.
+   * @param[out] out       Where to render the message. Its buffers are reused.
+   */
+  void RenderOutputs(const std::string& line_fmt, RenderedMessage* out) const;
+
+  /**
+   * @brief      Render a minimal line for this message (its level, log time,
+   *             file, line and message, with its captured arguments filled in)
+   *             into a fixed buffer. This is async-signal-safe, so that a crash
+   *             handler can write out messages which were still queued.
+   *
+   * @param[out] data  Where to put the line. Anything which doesn't fit is
+   *                   cut off.
+   * @param[in]  size  The size of `data`.
+   *
+   * @return     The length of the line, including its newline.
+   */
+  std::size_t FormatForCrash(char* data, std::size_t size) const;
+
+  /**
+   * @brief      Note that this many similar messages were suppressed before
+   *             this one (by a rate-limited macro such as LOG_EVERY). This is
+   *             shown after the message.
+   */
+  void set_suppressed(uint64_t suppressed) { suppressed_ = suppressed; }
+
+  /**
+   * @brief      Set the number of LOG_SCOPED scopes this message was logged
+   *             inside. It defaults to the calling thread's depth.
+   */
+  void set_depth(uint32_t depth) { depth_ = depth; }
+
+  /**
+   * @brief      Mark this message as the end of a scope (see LOG_SCOPED) which
+   *             lasted some time. The duration is shown after the message.
+   */
+  void set_span(std::chrono::nanoseconds duration) {
+    span_ns_ = duration.count();
+  }
+
+  /**
+   * @brief      Get the call site the log message was logged from.
+   */
+  const CallSite* site() const { return site_; }
+
   /**
    * @brief      Get the level the log message was logged at.
    */
-  Level level() const { return level_; }
+  Level level() const { return site_->level(); }
 
- private:
   /**
-   * The level this log message is being printed at.
+   * @brief      Get the time the log message was logged at.
    */
-  Level level_;
+  const std::chrono::time_point<std::chrono::system_clock>& log_time() const {
+    return log_time_;
+  }
 
+ private:
   /**
-   * The line this log messages was printed on.
+   * The call site this message was logged from. This holds the level, file
+   * and line.
    */
-  int verbosity_, line_;
+  const CallSite* site_;
 
   /**
-   * The filename that this log message was printed from.
+   * The verbosity of this message.
    */
-  std::string file_;
+  int verbosity_;
 
   /**
    * Time that this message was logged.
@@ -78,25 +664,147 @@ class LogMessage {
   std::chrono::time_point<std::chrono::system_clock> log_time_;
 
   /**
-   * The message to be displayed to the screen. This is not a format string, but
-   * a full message which can be displayed as-is.
+   * The thread which logged this message.
+   */
+  const ThreadIdentity* thread_;
+
+  /**
+   * The format string of the message, if it was a string literal. This is
+   * stored rather than copied. If nullptr, then `msg_format_` is used instead.
+   */
+  const char* static_format_ = nullptr;
+
+  /**
+   * The length of `static_format_`.
+   */
+  std::size_t static_format_length_ = 0;
+
+  /**
+   * The format string of the message, if it wasn't a string literal.
    */
   std::string msg_format_;
 
   /**
-   * The formatting args required to format `msg`.
+   * The formatting args required to format `msg`, if given as a list.
    */
   string::FormatListType format_args_;
 
-  static std::array<std::ofstream*, N_LEVELS> _log_files;
+  /**
+   * The formatting args required to format `msg`, if given individually. For
+   * structured messages, the fields instead, as alternating keys and values.
+   */
+  ArgBuffer args_;
+
+  /**
+   * The functions giving the formatting args, for a LOG_LAZY message.
+   */
+  std::unique_ptr<LazyArgs> lazy_args_;
+
+  /**
+   * Whether or not this is a structured message, i.e. `args_` holds fields.
+   */
+  bool has_fields_ = false;
+
+  /**
+   * Whether or not `msg_format_` is the final text (see PreformattedText).
+   */
+  bool preformatted_ = false;
+
+  /**
+   * Whether or not the format was checked at compile time (see LOGF).
+   */
+  bool checked_format_ = false;
+
+  /**
+   * The number of similar messages suppressed before this one.
+   */
+  uint64_t suppressed_ = 0;
+
+  /**
+   * The number of scopes this message was logged inside.
+   */
+  uint32_t depth_ = ScopeDepth();
+
+  /**
+   * How long the scope this message ends lasted, in nanoseconds, or -1 if it
+   * doesn't end a scope.
+   */
+  int64_t span_ns_ = -1;
+
+  /**
+   * @brief      Format the message itself (without the rest of the line).
+   *
+   * @param[out] out    The buffer to format into.
+   * @param[in]  scope  Whether to indent the message by its depth and show
+   *                    the duration of the scope it ends.
+   */
+  void _FormatMessage(std::string* out, bool scope = true) const;
+
+  void _AddFields(std::initializer_list<KeyValue> fields) {
+    for (const auto& field : fields) {
+      args_.Add(field.key());
+      args_.Append(field.value());
+    }
+  }
+
+  /**
+   * @brief      Append the kind and payload of this message's binary log
+   *             record (see binary_log.h).
+   */
+  void _AppendBinaryPayload(std::string* out) const;
+
+  /**
+   * @brief      Copy this message, to be logged again when its scope ends.
+   */
+  LogMessage _CopyForScopeEnd() const;
+
+  friend class LogScope;
 };
 
 /**
  * @brief      Queue a message into the messaging queue.
  *
- * @param[in]  message  The message to queue.
+ * @param[in]  message  The message to queue. It is moved into the queue.
+ */
+void QueueMessage(LogMessage&& message);
+
+/**
+ * @brief      Logs a message when it starts and again, with how long it lasted,
+ *             when it is destroyed (see LOG_SCOPED). The calling thread's
+ *             messages are indented in between.
  */
-void QueueMessage(const LogMessage& message);
+class LogScope {
+ public:
+  LogScope() : started_(false) {}
+
+  ~LogScope() {
+    if (started_) {
+      _End();
+    }
+  }
+
+  LogScope(const LogScope&) = delete;
+  LogScope& operator=(const LogScope&) = delete;
+
+  /**
+   * @brief      Log the message which starts the scope, and start timing it.
+   *             This is only called if the level is enabled, so a disabled
+   *             scope costs nothing but a check of the level.
+   */
+  void Start(LogMessage&& message);
+
+ private:
+  void _End();
+
+  bool started_;
+  std::chrono::steady_clock::time_point start_;
+
+  /**
+   * The message to log when the scope ends, once started.
+   */
+  typename std::aligned_storage<sizeof(LogMessage), alignof(LogMessage)>::type
+      end_;
+};
 
 /**
  * @brief      A Logger is a utility class that will, when destroyed, wait for
@@ -111,6 +819,8 @@ class Logger {
 
 }  // namespace internal
 
+using internal::StaticFormat;
+
 /**
  * @brief      Initialize the logging system. This function is only required if
  *             --async_logging is set. This should be called in the main()
@@ -121,16 +831,172 @@ class Logger {
  *                   static auto _ = cpplog::Init();
  *                 }
  *
- *             Without this init() call, no log messages will display. This can
- *             be omitted when using synchronous logging.
+ *             Without this init() call, messages will be displayed
+ *             synchronously. This can be omitted when using synchronous
+ *             logging.
  */
 std::unique_ptr<internal::Logger> Init();
 
+/**
+ * @brief      Re-read the logging flags. This is called by Init(), and must be
+ *             called again after changing any of the logging flags at runtime
+ *             (e.g. --logtostderr, --min_log_level, --v or --vmodule): until
+ *             then, the old values are used.
+ *
+ * @details    The flags are parsed into an immutable snapshot which is
+ *             swapped in atomically, so this can be called while other threads
+ *             (including the async emitter) are logging, and logging never
+ *             reads the flags themselves. Flags which set up the logger (e.g.
+ *             --async_logging, --logfile_dir or --logfile_mmap) only take
+ *             effect in Init().
+ *
+ *             This isn't async-signal-safe. To change settings on a signal,
+ *             e.g. to raise the verbosity on SIGUSR1, block the signal before
+ *             starting any threads and wait for it on a thread of its own:
+ *
+ *                 sigset_t signals;
+ *                 sigemptyset(&signals);
+ *                 sigaddset(&signals, SIGUSR1);
+ *                 pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+ *                 std::thread([signals] {
+ *                   int signal;
+ *                   while (sigwait(&signals, &signal) == 0) {
+ *                     FLAGS_v++;
+ *                     cpplog::Reconfigure();
+ *                   }
+ *                 }).detach();
+ */
+void Reconfigure();
+
+/**
+ * @brief      Name the calling thread in log lines (the {thread} field), e.g.
+ *             "worker-3". Messages it has already logged keep the old name.
+ *             An empty name goes back to showing the thread's id.
+ */
+void SetThreadName(const std::string& name);
+
 /**
  * @brief      Get the number of messages inside the queue.
  */
 int MessagesInQueue();
 
+/**
+ * @brief      Get the number of messages which have been dropped because the
+ *             async queue was full (see --async_overflow_policy).
+ */
+uint64_t MessagesDropped();
+
+/**
+ * @brief      Get the number of messages which have been shed because the
+ *             async queue was filling up (see --async_shed_low_watermark).
+ */
+uint64_t MessagesShed();
+
+/**
+ * @brief      Get the number of lines which have been dropped because a
+ *             destination's thread couldn't keep up (see --async_sink_threads
+ *             and --log_network).
+ */
+uint64_t SinkLinesDropped();
+
+/**
+ * @brief      Statistics about the batches of messages emitted by the async
+ *             emitter. Each time it wakes up, the emitter drains what's in the
+ *             queue as one batch (which is written with one writev() per
+ *             destination if --async_batch_writes is set).
+ */
+struct BatchStats {
+  /**
+   * The number of batches emitted.
+   */
+  uint64_t batches;
+
+  /**
+   * The total number of messages in those batches.
+   */
+  uint64_t messages;
+
+  /**
+   * The largest number of messages emitted in one batch.
+   */
+  uint64_t max_batch_size;
+};
+
+/**
+ * @brief      Get statistics about the async emitter's batches.
+ */
+BatchStats GetBatchStats();
+
+/**
+ * @brief      A snapshot of the logger's own statistics (see GetStats()).
+ *             Counters are totals since the program started.
+ */
+struct Stats {
+  /**
+   * Per level: the messages queued for the async emitter, the messages
+   * written to at least one output, the messages dropped because the queue
+   * was full, and the messages shed because it was filling up.
+   */
+  std::array<uint64_t, internal::N_LEVELS> enqueued, emitted, dropped, shed;
+
+  /**
+   * The number of messages in the queue now, its capacity and the most the
+   * emitter has found in it when waking up. With --async_per_thread_buffers,
+   * the capacity and high-water mark are for the fullest single buffer.
+   */
+  uint64_t queue_size, queue_capacity, queue_high_water;
+
+  /**
+   * The number of messages whose producer had to wait for space in the
+   * queue, and the total time spent waiting.
+   */
+  uint64_t producer_waits, producer_wait_ns;
+
+  /**
+   * See SinkLinesDropped().
+   */
+  uint64_t sink_lines_dropped;
+
+  /**
+   * See GetBatchStats(). `batch_sizes` has the distribution.
+   */
+  BatchStats batches;
+  Histogram batch_sizes;
+
+  /**
+   * Writes to stderr, to the text log files (--logfile_single and
+   * --logfile_mmap files included), to the --log_format=binary log, and to
+   * --log_network (a write being a sendmmsg() or a batch sent over TCP).
+   */
+  SinkStats stderr_output, log_files, binary_log, network;
+};
+
+/**
+ * @brief      Get a snapshot of the logger's statistics. This doesn't take any
+ *             locks, so it can be called as often as needed (e.g. to alert on
+ *             the queue filling up), but counters are read one at a time and
+ *             might not be exactly consistent with each other.
+ */
+Stats GetStats();
+
+/**
+ * @brief      Write statistics in the Prometheus text exposition format, with
+ *             every metric name starting "cpplog_".
+ */
+std::string StatsToPrometheus(const Stats& stats);
+
+/**
+ * @brief      Write statistics as StatsD lines, one per metric. Counters are
+ *             sent as the change since `previous`, if given, and everything
+ *             else as gauges.
+ *
+ * @param[in]  stats     The statistics to write.
+ * @param[in]  previous  The statistics last sent, or nullptr to send totals.
+ * @param[in]  prefix    The prefix for metric names, e.g. "myapp.cpplog".
+ */
+std::string StatsToStatsd(const Stats& stats, const Stats* previous,
+                          const std::string& prefix);
+
 }  // namespace cpplog
 
 /**
@@ -140,10 +1006,15 @@ int MessagesInQueue();
  * @param      MSG_FORMAT  The cppstring format string for the  message.
  * @param      ...         The cppstring argument list.
  */
-#define LOG(LEVEL, ...)                                                  \
-  do {                                                                   \
-    ::cpplog::internal::QueueMessage(::cpplog::internal::LogMessage(     \
-        ::cpplog::internal::LEVEL, 0, __LINE__, __FILE__, __VA_ARGS__)); \
+#define LOG(LEVEL, ...)                                                   \
+  do {                                                                    \
+    if (::cpplog::internal::LevelCompiledIn(::cpplog::internal::LEVEL) && \
+        ::cpplog::internal::LevelEnabled(::cpplog::internal::LEVEL)) {    \
+      static ::cpplog::internal::CallSite _cpplog_site(                   \
+          __FILE__, __LINE__, ::cpplog::internal::LEVEL);                 \
+      ::cpplog::internal::QueueMessage(                                   \
+          ::cpplog::internal::LogMessage(&_cpplog_site, 0, __VA_ARGS__)); \
+    }                                                                     \
   } while (false)
 
 #define LOG_TRACE(...) LOG(TRACE, __VA_ARGS__)
@@ -153,69 +1024,308 @@ int MessagesInQueue();
 #define LOG_ERROR(...) LOG(ERROR, __VA_ARGS__)
 #define LOG_FATAL(...) LOG(FATAL, __VA_ARGS__)
 
-#if _cplusplus >= 201402L
-
-using namespace std::literals;
-using namespace std::chrono_literals;
-#define LOG_EVERY(FREQ, LEVEL, MSG_FORMAT, ...)                            \
-  do {                                                                     \
-    static std::chrono::high_resolution_clock::time_point                  \
-        _cpplog_every##__LINE__;                                           \
-    if ((std::chrono::high_resolution_clock::now() -                       \
-         _cpplog_every##__LINE__) > FREQ) {                                \
-      _cpplog_every##__LINE__ = std::chrono::high_resolution_clock::now(); \
-      ::cpplog::internal::QueueMessage(::cpplog::internal::LogMessage(     \
-          ::cpplog::internal::LEVEL, 0, __LINE__, __FILE__, MSG_FORMAT,    \
-          __VA_ARGS__));                                                   \
-    }                                                                      \
+/**
+ * @brief      Log a message whose format is checked against its arguments at
+ *             compile time, e.g.
+ *
+ *                 LOGF_INFO("Took {:.2f}ms to send {:x}", ms, id);
+ *
+ *             The format must be a string literal, with a {} (or {:x} for an
+ *             integer in hex, or {:.Nf} for a number with N decimal places)
+ *             for each argument: anything else fails to compile. Arguments
+ *             are captured as for LOG, and formatted by cpplog itself rather
+ *             than cppstring: integers two digits at a time, and doubles as
+ *             the shortest text which reads back as the same value.
+ *
+ * @param      LEVEL  The level to log at, e.g. INFO or WARNING.
+ * @param      ...    The format, followed by its arguments.
+ */
+#define LOGF(LEVEL, ...)                                                  \
+  do {                                                                    \
+    CPPLOG_CHECK_FORMAT(__VA_ARGS__);                                     \
+    if (::cpplog::internal::LevelCompiledIn(::cpplog::internal::LEVEL) && \
+        ::cpplog::internal::LevelEnabled(::cpplog::internal::LEVEL)) {    \
+      static ::cpplog::internal::CallSite _cpplog_site(                   \
+          __FILE__, __LINE__, ::cpplog::internal::LEVEL);                 \
+      ::cpplog::internal::QueueMessage(::cpplog::internal::LogMessage(    \
+          &_cpplog_site, 0, ::cpplog::internal::CheckedFormat(),          \
+          __VA_ARGS__));                                                  \
+    }                                                                     \
+  } while (false)
+
+#define LOGF_TRACE(...) LOGF(TRACE, __VA_ARGS__)
+#define LOGF_DEBUG(...) LOGF(DEBUG, __VA_ARGS__)
+#define LOGF_INFO(...) LOGF(INFO, __VA_ARGS__)
+#define LOGF_WARNING(...) LOGF(WARNING, __VA_ARGS__)
+#define LOGF_ERROR(...) LOGF(ERROR, __VA_ARGS__)
+#define LOGF_FATAL(...) LOGF(FATAL, __VA_ARGS__)
+
+/**
+ * @brief      Log a message whose arguments are the results of some functions,
+ *             which are only called once the message is about to be written
+ *             somewhere (in async mode, on the emitter thread), e.g.
+ *
+ *                 LOG_DEBUG_LAZY("State: {}", [state] { return Dump(state); });
+ *
+ *             This is for arguments which are expensive to work out. The
+ *             functions run later, maybe on another thread, so they should
+ *             capture by value. They aren't called if the level is disabled,
+ *             or if no output shows the message (e.g. it is too verbose, or
+ *             dropped from a full queue).
+ *
+ * @param      LEVEL   The level to log at, e.g. INFO or WARNING.
+ * @param      FORMAT  The cppstring format string, a string literal.
+ * @param      ...     A function for each argument.
+ */
+#define LOG_LAZY(LEVEL, FORMAT, ...) \
+  LOG(LEVEL, ::cpplog::internal::Lazy(), FORMAT, __VA_ARGS__)
+
+#define LOG_TRACE_LAZY(...) LOG_LAZY(TRACE, __VA_ARGS__)
+#define LOG_DEBUG_LAZY(...) LOG_LAZY(DEBUG, __VA_ARGS__)
+#define LOG_INFO_LAZY(...) LOG_LAZY(INFO, __VA_ARGS__)
+#define LOG_WARNING_LAZY(...) LOG_LAZY(WARNING, __VA_ARGS__)
+#define LOG_ERROR_LAZY(...) LOG_LAZY(ERROR, __VA_ARGS__)
+#define LOG_FATAL_LAZY(...) LOG_LAZY(FATAL, __VA_ARGS__)
+
+/**
+ * @brief      Write an operator<< chain to one of the calling thread's reused
+ *             streams, giving the text as a PreformattedText.
+ */
+#define CPPLOG_STREAM_TEXT(...)                         \
+  [&]() {                                               \
+    ::cpplog::internal::ScopedLogStream _cpplog_stream; \
+    _cpplog_stream.stream() << __VA_ARGS__;             \
+    return ::cpplog::internal::PreformattedText{        \
+        _cpplog_stream.stream().Take()};                \
+  }()
+
+/**
+ * @brief      Log a message built with operator<<, e.g.
+ *
+ *                 LOG_INFO_STREAM("Took " << elapsed_ms << "ms for " << name);
+ *
+ *             As with LOG, nothing in the chain is evaluated unless the level
+ *             is enabled. The text isn't formatted again, so it can contain
+ *             braces.
+ *
+ * @param      LEVEL  The level to log at, e.g. INFO or WARNING.
+ * @param      ...    The operator<< chain.
+ */
+#define LOG_STREAM(LEVEL, ...) LOG(LEVEL, CPPLOG_STREAM_TEXT(__VA_ARGS__))
+
+#define LOG_TRACE_STREAM(...) LOG_STREAM(TRACE, __VA_ARGS__)
+#define LOG_DEBUG_STREAM(...) LOG_STREAM(DEBUG, __VA_ARGS__)
+#define LOG_INFO_STREAM(...) LOG_STREAM(INFO, __VA_ARGS__)
+#define LOG_WARNING_STREAM(...) LOG_STREAM(WARNING, __VA_ARGS__)
+#define LOG_ERROR_STREAM(...) LOG_STREAM(ERROR, __VA_ARGS__)
+#define LOG_FATAL_STREAM(...) LOG_STREAM(FATAL, __VA_ARGS__)
+
+/**
+ * @brief      Log a structured message with some key/value fields, e.g.
+ *
+ *                 LOG_INFO_KV("Handled request", {"user", id}, {"ms", ms});
+ *
+ *             Text lines show the fields as key=value after the message (or
+ *             wherever {fields} is in --line_format), and --log_format=json
+ *             writes them as members of the line's object.
+ *
+ * @param      LEVEL    The level to log at, e.g. INFO or WARNING.
+ * @param      MESSAGE  The message, which isn't formatted.
+ * @param      ...      The fields, as {key, value} pairs.
+ */
+#define LOG_KV(LEVEL, MESSAGE, ...)                                       \
+  do {                                                                    \
+    if (::cpplog::internal::LevelCompiledIn(::cpplog::internal::LEVEL) && \
+        ::cpplog::internal::LevelEnabled(::cpplog::internal::LEVEL)) {    \
+      static ::cpplog::internal::CallSite _cpplog_site(                   \
+          __FILE__, __LINE__, ::cpplog::internal::LEVEL);                 \
+      ::cpplog::internal::QueueMessage(::cpplog::internal::LogMessage(    \
+          &_cpplog_site, 0, MESSAGE,                                      \
+          std::initializer_list<::cpplog::internal::KeyValue>{            \
+              __VA_ARGS__}));                                             \
+    }                                                                     \
+  } while (false)
+
+#define LOG_TRACE_KV(...) LOG_KV(TRACE, __VA_ARGS__)
+#define LOG_DEBUG_KV(...) LOG_KV(DEBUG, __VA_ARGS__)
+#define LOG_INFO_KV(...) LOG_KV(INFO, __VA_ARGS__)
+#define LOG_WARNING_KV(...) LOG_KV(WARNING, __VA_ARGS__)
+#define LOG_ERROR_KV(...) LOG_KV(ERROR, __VA_ARGS__)
+#define LOG_FATAL_KV(...) LOG_KV(FATAL, __VA_ARGS__)
+
+#define CPPLOG_CONCAT_(A, B) A##B
+#define CPPLOG_CONCAT(A, B) CPPLOG_CONCAT_(A, B)
+
+/**
+ * @brief      Log a message now and again when the enclosing scope ends, with
+ *             how long it took, e.g.
+ *
+ *                 {
+ *                   LOG_INFO_SCOPED("Handling request {}", id);
+ *                   ...
+ *                 }
+ *
+ *             logs "Handling request 7", then "Handling request 7 (took
+ *             1.204ms)". Messages logged by the same thread in between are
+ *             indented. If the level is disabled, nothing is evaluated or
+ *             timed. With --log_format=binary, cpplog_decode --chrome_trace
+ *             turns the scopes into trace events.
+ *
+ * @param      LEVEL  The level to log at, e.g. INFO or WARNING.
+ * @param      ...    The message, as for LOG.
+ */
+#define LOG_SCOPED(LEVEL, ...)                                            \
+  ::cpplog::internal::LogScope CPPLOG_CONCAT(_cpplog_scope_, __LINE__);   \
+  do {                                                                    \
+    if (::cpplog::internal::LevelCompiledIn(::cpplog::internal::LEVEL) && \
+        ::cpplog::internal::LevelEnabled(::cpplog::internal::LEVEL)) {    \
+      static ::cpplog::internal::CallSite _cpplog_site(                   \
+          __FILE__, __LINE__, ::cpplog::internal::LEVEL);                 \
+      CPPLOG_CONCAT(_cpplog_scope_, __LINE__)                             \
+          .Start(::cpplog::internal::LogMessage(&_cpplog_site, 0,         \
+                                                __VA_ARGS__));            \
+    }                                                                     \
   } while (false)
 
-#define LOG_TRACE_EVERY(FREQ, MSG_FORMAT, ...) \
-  LOG_EVERY(FREQ, TRACE, MSG_FORMAT, __VA_ARGS__)
-#define LOG_DEBUG_EVERY(FREQ, MSG_FORMAT, ...) \
-  LOG_EVERY(FREQ, DEBUG, MSG_FORMAT, __VA_ARGS__)
-#define LOG_INFO_EVERY(FREQ, MSG_FORMAT, ...) \
-  LOG_EVERY(FREQ, INFO, MSG_FORMAT, __VA_ARGS__)
-#define LOG_WARNING_EVERY(FREQ, MSG_FORMAT, ...) \
-  LOG_EVERY(FREQ, WARNING, MSG_FORMAT, __VA_ARGS__)
-#define LOG_ERROR_EVERY(FREQ, MSG_FORMAT, ...) \
-  LOG_EVERY(FREQ, ERROR, MSG_FORMAT, __VA_ARGS__)
-
-#endif  // _cplusplus14
-
-#define LOG_FIRST(N, LEVEL, MSG_FORMAT, ...)                            \
-  do {                                                                  \
-    static int _cpplog_count##__LINE__ = 0;                             \
-    if (_cpplog_count##__LINE__ < N) {                                  \
-      _cpplog_count##__LINE__++;                                        \
-      ::cpplog::internal::QueueMessage(::cpplog::internal::LogMessage(  \
-          ::cpplog::internal::LEVEL, 0, __LINE__, __FILE__, MSG_FORMAT, \
-          __VA_ARGS__));                                                \
-    }                                                                   \
+#define LOG_TRACE_SCOPED(...) LOG_SCOPED(TRACE, __VA_ARGS__)
+#define LOG_DEBUG_SCOPED(...) LOG_SCOPED(DEBUG, __VA_ARGS__)
+#define LOG_INFO_SCOPED(...) LOG_SCOPED(INFO, __VA_ARGS__)
+#define LOG_WARNING_SCOPED(...) LOG_SCOPED(WARNING, __VA_ARGS__)
+#define LOG_ERROR_SCOPED(...) LOG_SCOPED(ERROR, __VA_ARGS__)
+
+/**
+ * @brief      Log a message if the call site allows it.
+ *
+ * @param      LIMITER  The type of limiter to check (see rate_limiter.h).
+ * @param      ALLOW    The arguments to its Allow() function, which should
+ *                      end with the output for the number of messages
+ *                      suppressed, _cpplog_suppressed.
+ * @param      LEVEL    The level to log at, e.g. INFO or WARNING.
+ */
+#define LOG_LIMITED(LIMITER, ALLOW, LEVEL, ...)                           \
+  do {                                                                    \
+    static ::cpplog::internal::LIMITER _cpplog_limiter;                   \
+    uint64_t _cpplog_suppressed = 0;                                      \
+    if (::cpplog::internal::LevelCompiledIn(::cpplog::internal::LEVEL) && \
+        ::cpplog::internal::LevelEnabled(::cpplog::internal::LEVEL) &&    \
+        _cpplog_limiter.Allow ALLOW) {                                    \
+      static ::cpplog::internal::CallSite _cpplog_site(                   \
+          __FILE__, __LINE__, ::cpplog::internal::LEVEL);                 \
+      ::cpplog::internal::LogMessage _cpplog_message(&_cpplog_site, 0,    \
+                                                     __VA_ARGS__);        \
+      _cpplog_message.set_suppressed(_cpplog_suppressed);                 \
+      ::cpplog::internal::QueueMessage(std::move(_cpplog_message));       \
+    }                                                                     \
   } while (false)
 
-#define LOG_TRACE_FIRST(N, MSG_FORMAT, ...) \
-  LOG_FIRST(N, TRACE, MSG_FORMAT, __VA_ARGS__)
-#define LOG_DEBUG_FIRST(N, MSG_FORMAT, ...) \
-  LOG_FIRST(N, DEBUG, MSG_FORMAT, __VA_ARGS__)
-#define LOG_INFO_FIRST(N, MSG_FORMAT, ...) \
-  LOG_FIRST(N, INFO, MSG_FORMAT, __VA_ARGS__)
-#define LOG_WARNING_FIRST(N, MSG_FORMAT, ...) \
-  LOG_FIRST(N, WARNING, MSG_FORMAT, __VA_ARGS__)
-#define LOG_ERROR_FIRST(N, MSG_FORMAT, ...) \
-  LOG_FIRST(N, ERROR, MSG_FORMAT, __VA_ARGS__)
-
-#define VLOG(V, LEVEL, MSG_FORMAT, ...)                                        \
-  do {                                                                         \
-    ::cpplog::internal::QueueMessage(                                          \
-        ::cpplog::internal::LogMessage(::cpplog::internal::LEVEL, V, __LINE__, \
-                                       __FILE__, MSG_FORMAT, __VA_ARGS__));    \
+/**
+ * @brief      Log at most one message per interval from this call site, e.g.
+ *
+ *                 LOG_WARNING_EVERY(std::chrono::seconds(1), "Slow: {}", x);
+ *
+ *             The next message through says how many were suppressed.
+ *
+ * @param      FREQ   The minimum interval between messages, as a
+ *                    std::chrono::duration.
+ * @param      LEVEL  The level to log at, e.g. INFO or WARNING.
+ */
+#define LOG_EVERY(FREQ, LEVEL, ...)                                       \
+  LOG_LIMITED(IntervalLimiter,                                            \
+              (std::chrono::duration_cast<std::chrono::nanoseconds>(FREQ) \
+                   .count(),                                              \
+               &_cpplog_suppressed),                                      \
+              LEVEL, __VA_ARGS__)
+
+#define LOG_TRACE_EVERY(FREQ, ...) LOG_EVERY(FREQ, TRACE, __VA_ARGS__)
+#define LOG_DEBUG_EVERY(FREQ, ...) LOG_EVERY(FREQ, DEBUG, __VA_ARGS__)
+#define LOG_INFO_EVERY(FREQ, ...) LOG_EVERY(FREQ, INFO, __VA_ARGS__)
+#define LOG_WARNING_EVERY(FREQ, ...) LOG_EVERY(FREQ, WARNING, __VA_ARGS__)
+#define LOG_ERROR_EVERY(FREQ, ...) LOG_EVERY(FREQ, ERROR, __VA_ARGS__)
+
+/**
+ * @brief      A stream version of LOG_EVERY, e.g.
+ *
+ *                 LOG_WARNING_STREAM_EVERY(std::chrono::seconds(1),
+ *                                          "Slow: " << x);
+ */
+#define LOG_STREAM_EVERY(FREQ, LEVEL, ...) \
+  LOG_EVERY(FREQ, LEVEL, CPPLOG_STREAM_TEXT(__VA_ARGS__))
+
+#define LOG_TRACE_STREAM_EVERY(FREQ, ...) \
+  LOG_STREAM_EVERY(FREQ, TRACE, __VA_ARGS__)
+#define LOG_DEBUG_STREAM_EVERY(FREQ, ...) \
+  LOG_STREAM_EVERY(FREQ, DEBUG, __VA_ARGS__)
+#define LOG_INFO_STREAM_EVERY(FREQ, ...) \
+  LOG_STREAM_EVERY(FREQ, INFO, __VA_ARGS__)
+#define LOG_WARNING_STREAM_EVERY(FREQ, ...) \
+  LOG_STREAM_EVERY(FREQ, WARNING, __VA_ARGS__)
+#define LOG_ERROR_STREAM_EVERY(FREQ, ...) \
+  LOG_STREAM_EVERY(FREQ, ERROR, __VA_ARGS__)
+
+/**
+ * @brief      Log only the first N messages from this call site.
+ */
+#define LOG_FIRST(N, LEVEL, ...) \
+  LOG_LIMITED(FirstLimiter, (N), LEVEL, __VA_ARGS__)
+
+#define LOG_TRACE_FIRST(N, ...) LOG_FIRST(N, TRACE, __VA_ARGS__)
+#define LOG_DEBUG_FIRST(N, ...) LOG_FIRST(N, DEBUG, __VA_ARGS__)
+#define LOG_INFO_FIRST(N, ...) LOG_FIRST(N, INFO, __VA_ARGS__)
+#define LOG_WARNING_FIRST(N, ...) LOG_FIRST(N, WARNING, __VA_ARGS__)
+#define LOG_ERROR_FIRST(N, ...) LOG_FIRST(N, ERROR, __VA_ARGS__)
+
+/**
+ * @brief      Log the first message from this call site, then every Nth
+ *             after it.
+ */
+#define LOG_EVERY_N(N, LEVEL, ...) \
+  LOG_LIMITED(EveryNLimiter, (N, &_cpplog_suppressed), LEVEL, __VA_ARGS__)
+
+#define LOG_TRACE_EVERY_N(N, ...) LOG_EVERY_N(N, TRACE, __VA_ARGS__)
+#define LOG_DEBUG_EVERY_N(N, ...) LOG_EVERY_N(N, DEBUG, __VA_ARGS__)
+#define LOG_INFO_EVERY_N(N, ...) LOG_EVERY_N(N, INFO, __VA_ARGS__)
+#define LOG_WARNING_EVERY_N(N, ...) LOG_EVERY_N(N, WARNING, __VA_ARGS__)
+#define LOG_ERROR_EVERY_N(N, ...) LOG_EVERY_N(N, ERROR, __VA_ARGS__)
+
+/**
+ * @brief      Log at most N_PER_SEC messages per second on average from this
+ *             call site, allowing bursts of up to N_PER_SEC. The next message
+ *             through says how many were suppressed. If N_PER_SEC isn't
+ *             positive, nothing is logged.
+ */
+#define LOG_RATE(N_PER_SEC, LEVEL, ...)                             \
+  LOG_LIMITED(RateLimiter, (N_PER_SEC, &_cpplog_suppressed), LEVEL, \
+              __VA_ARGS__)
+
+#define LOG_TRACE_RATE(N_PER_SEC, ...) LOG_RATE(N_PER_SEC, TRACE, __VA_ARGS__)
+#define LOG_DEBUG_RATE(N_PER_SEC, ...) LOG_RATE(N_PER_SEC, DEBUG, __VA_ARGS__)
+#define LOG_INFO_RATE(N_PER_SEC, ...) LOG_RATE(N_PER_SEC, INFO, __VA_ARGS__)
+#define LOG_WARNING_RATE(N_PER_SEC, ...) \
+  LOG_RATE(N_PER_SEC, WARNING, __VA_ARGS__)
+#define LOG_ERROR_RATE(N_PER_SEC, ...) LOG_RATE(N_PER_SEC, ERROR, __VA_ARGS__)
+
+/**
+ * @brief      Log a message with a verbosity, which is only shown if it is no
+ *             higher than --v, or the --vmodule level for this file.
+ *
+ * @param      V      The verbosity of the message.
+ * @param      LEVEL  The level to log at, e.g. INFO or WARNING.
+ */
+#define VLOG(V, LEVEL, ...)                                               \
+  do {                                                                    \
+    static ::cpplog::internal::CallSite _cpplog_site(                     \
+        __FILE__, __LINE__, ::cpplog::internal::LEVEL);                   \
+    if (::cpplog::internal::LevelCompiledIn(::cpplog::internal::LEVEL) && \
+        ::cpplog::internal::VerbosityEnabled(::cpplog::internal::LEVEL,   \
+                                             V, _cpplog_site)) {          \
+      ::cpplog::internal::QueueMessage(                                   \
+          ::cpplog::internal::LogMessage(&_cpplog_site, V, __VA_ARGS__)); \
+    }                                                                     \
   } while (false)
 
-#define VLOG_TRACE(V, MSG_FORMAT, ...) VLOG(V, TRACE, MSG_FORMAT, __VA_ARGS__)
-#define VLOG_DEBUG(V, MSG_FORMAT, ...) VLOG(V, DEBUG, MSG_FORMAT, __VA_ARGS__)
-#define VLOG_INFO(V, MSG_FORMAT, ...) VLOG(V, INFO, MSG_FORMAT, __VA_ARGS__)
-#define VLOG_WARNING(V, MSG_FORMAT, ...) \
-  VLOG(V, WARNING, MSG_FORMAT, __VA_ARGS__)
-#define VLOG_ERROR(V, MSG_FORMAT, ...) VLOG(V, ERROR, MSG_FORMAT, __VA_ARGS__)
-#define VLOG_FATAL(V, MSG_FORMAT, ...) VLOG(V, FATAL, MSG_FORMAT, __VA_ARGS__)
+#define VLOG_TRACE(V, ...) VLOG(V, TRACE, __VA_ARGS__)
+#define VLOG_DEBUG(V, ...) VLOG(V, DEBUG, __VA_ARGS__)
+#define VLOG_INFO(V, ...) VLOG(V, INFO, __VA_ARGS__)
+#define VLOG_WARNING(V, ...) VLOG(V, WARNING, __VA_ARGS__)
+#define VLOG_ERROR(V, ...) VLOG(V, ERROR, __VA_ARGS__)
+#define VLOG_FATAL(V, ...) VLOG(V, FATAL, __VA_ARGS__)
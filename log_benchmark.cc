@@ -0,0 +1,446 @@
+#include "log.h"
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gflags/gflags.h>
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+DECLARE_bool(async_logging);
+DECLARE_bool(logtofile);
+DECLARE_bool(logtostderr);
+DECLARE_string(line_format);
+DECLARE_string(logfile_dir);
+DECLARE_string(logfile_name);
+DECLARE_string(min_log_level);
+DECLARE_string(min_log_level_file);
+
+DEFINE_string(threads, "1,2,4,8,16,32,64",
+              "Comma-separated numbers of producer threads to run with.");
+DEFINE_string(modes, "sync,async",
+              "Comma-separated logging modes to run with: sync and/or async. "
+              "Any other --async_* flags given apply to async runs.");
+DEFINE_string(sinks, "none,null,file",
+              "Comma-separated outputs to run with. none: every output is off, "
+              "so this measures the cost of a disabled LOG_INFO(). null: "
+              "stderr, redirected to /dev/null. stderr: stderr as it is. "
+              "file: log files in --benchmark_dir.");
+DEFINE_string(arg_counts, "0,2",
+              "Comma-separated numbers of arguments to log with each message: "
+              "0, 1, 2 or 4.");
+DEFINE_string(line_formats, "default",
+              "Comma-separated line formats to run with. default: "
+              "--line_format. minimal: just the message. Anything else is "
+              "used as the line format itself.");
+DEFINE_uint32(messages_per_thread, 20000,
+              "The number of messages each producer thread logs per run.");
+DEFINE_string(benchmark_dir, "benchmark_logs",
+              "The directory to write log files to for the file sink. It is "
+              "emptied before each run.");
+DEFINE_string(output_format, "json",
+              "How to write the results: json (an array of objects) or csv.");
+DEFINE_string(output, "",
+              "The file to write the results to, rather than stdout.");
+
+using namespace std::chrono;
+
+namespace {
+
+/**
+ * @brief      A histogram of latencies in nanoseconds. Buckets are spaced so
+ *             that each has a width of at most 1/16 of its value, so values
+ *             read back are within about 6%.
+ */
+class LatencyHistogram {
+ public:
+  void Record(uint64_t ns) {
+    counts_[_Bucket(ns)]++;
+    max_ = std::max(max_, ns);
+    count_++;
+  }
+
+  void Merge(const LatencyHistogram& other) {
+    for (std::size_t i = 0; i < kBuckets; i++) {
+      counts_[i] += other.counts_[i];
+    }
+
+    max_ = std::max(max_, other.max_);
+    count_ += other.count_;
+  }
+
+  /**
+   * @brief      Get the upper bound of the bucket holding the given
+   *             percentile (0-100).
+   */
+  uint64_t Percentile(double percentile) const {
+    uint64_t rank = uint64_t(percentile / 100 * count_);
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < kBuckets; i++) {
+      seen += counts_[i];
+      if (seen > rank) {
+        return std::min(_UpperBound(i), max_);
+      }
+    }
+
+    return max_;
+  }
+
+  uint64_t max() const { return max_; }
+
+ private:
+  static constexpr int kSubBucketBits = 4;
+  static constexpr uint64_t kSubBuckets = 1 << kSubBucketBits;
+  static constexpr std::size_t kBuckets = kSubBuckets * (64 - kSubBucketBits);
+
+  static std::size_t _Bucket(uint64_t ns) {
+    if (ns < kSubBuckets) {
+      return ns;
+    }
+
+    int exponent = 63 - __builtin_clzll(ns);
+    int shift = exponent - kSubBucketBits;
+    return kSubBuckets * (shift + 1) + ((ns >> shift) & (kSubBuckets - 1));
+  }
+
+  static uint64_t _UpperBound(std::size_t bucket) {
+    if (bucket < kSubBuckets) {
+      return bucket;
+    }
+
+    int shift = int(bucket / kSubBuckets) - 1;
+    uint64_t sub_bucket = bucket % kSubBuckets;
+    return ((kSubBuckets + sub_bucket + 1) << shift) - 1;
+  }
+
+  std::array<uint64_t, kBuckets> counts_ = {};
+  uint64_t max_ = 0;
+  uint64_t count_ = 0;
+};
+
+/**
+ * @brief      The settings for one run of the benchmark.
+ */
+struct Config {
+  int threads;
+  bool async;
+  std::string sink;
+  int arg_count;
+  std::string line_format;
+};
+
+/**
+ * @brief      The results of one run, as sent back from the child process.
+ */
+struct Result {
+  bool ok;
+  uint64_t messages;
+
+  /**
+   * The time taken for the producers to log everything, and for everything
+   * to be written out (including draining the async queue).
+   */
+  double producer_seconds, total_seconds;
+
+  /**
+   * The latency of each LOG_INFO(), including one steady_clock::now().
+   */
+  uint64_t p50_ns, p99_ns, p999_ns, max_ns;
+
+  uint64_t dropped;
+};
+
+std::vector<std::string> _Split(const std::string& list) {
+  std::vector<std::string> items;
+  std::istringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+
+  return items;
+}
+
+/**
+ * @brief      Log one message with the given number of arguments.
+ */
+void _LogMessage(int arg_count, uint64_t i) {
+  switch (arg_count) {
+    case 0:
+      LOG_INFO("Benchmark message");
+      break;
+    case 1:
+      LOG_INFO("Benchmark message {}", i);
+      break;
+    case 2:
+      LOG_INFO("Benchmark message {} from {}", i, "producer");
+      break;
+    case 4:
+      LOG_INFO("Benchmark message {} from {}: {} {}", i, "producer", 3.25,
+               true);
+      break;
+  }
+}
+
+/**
+ * @brief      Run a configuration. This is done in its own process, since the
+ *             logger can only be initialized once.
+ */
+Result _Run(const Config& config) {
+  Result result = {};
+  FLAGS_async_logging = config.async;
+  FLAGS_logtostderr = config.sink == "null" || config.sink == "stderr";
+  FLAGS_logtofile = config.sink == "file";
+  FLAGS_min_log_level = "info";
+  FLAGS_min_log_level_file = "info";
+  if (config.line_format == "minimal") {
+    FLAGS_line_format = "{message}";
+  } else if (config.line_format != "default") {
+    FLAGS_line_format = config.line_format;
+  }
+
+  if (config.sink == "null") {
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0 || dup2(null_fd, STDERR_FILENO) < 0) {
+      return result;
+    }
+  } else if (config.sink == "file") {
+    boost::system::error_code error;
+    boost::filesystem::remove_all(FLAGS_benchmark_dir, error);
+    FLAGS_logfile_dir = FLAGS_benchmark_dir;
+    FLAGS_logfile_name = "benchmark";
+  }
+
+  auto logger = cpplog::Init();
+
+  // Start all of the producers at once.
+  std::vector<LatencyHistogram> histograms(config.threads);
+  std::vector<std::thread> producers;
+  std::atomic<int> ready(0);
+  std::atomic<bool> start(false);
+  for (int t = 0; t < config.threads; t++) {
+    producers.emplace_back([&, t] {
+      auto& histogram = histograms[t];
+      ready.fetch_add(1);
+      while (!start.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+
+      auto before = steady_clock::now();
+      for (uint32_t i = 0; i < FLAGS_messages_per_thread; i++) {
+        _LogMessage(config.arg_count, i);
+        auto after = steady_clock::now();
+        histogram.Record(duration_cast<nanoseconds>(after - before).count());
+        before = after;
+      }
+    });
+  }
+
+  while (ready.load() < config.threads) {
+    std::this_thread::yield();
+  }
+
+  auto start_time = steady_clock::now();
+  start.store(true, std::memory_order_release);
+  for (auto& producer : producers) {
+    producer.join();
+  }
+
+  auto producer_time = steady_clock::now() - start_time;
+  logger.reset();
+  auto total_time = steady_clock::now() - start_time;
+
+  LatencyHistogram latencies;
+  for (const auto& histogram : histograms) {
+    latencies.Merge(histogram);
+  }
+
+  result.ok = true;
+  result.messages = uint64_t(config.threads) * FLAGS_messages_per_thread;
+  result.producer_seconds = duration<double>(producer_time).count();
+  result.total_seconds = duration<double>(total_time).count();
+  result.p50_ns = latencies.Percentile(50);
+  result.p99_ns = latencies.Percentile(99);
+  result.p999_ns = latencies.Percentile(99.9);
+  result.max_ns = latencies.max();
+  result.dropped = cpplog::MessagesDropped() + cpplog::MessagesShed();
+  return result;
+}
+
+/**
+ * @brief      Run a configuration in a child process, and wait for its
+ *             results.
+ */
+Result _RunInChild(const Config& config) {
+  Result result = {};
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return result;
+  }
+
+  std::fflush(nullptr);
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    Result child_result = _Run(config);
+    bool written = write(fds[1], &child_result, sizeof(child_result)) ==
+                   ssize_t(sizeof(child_result));
+    _exit(written ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  close(fds[1]);
+  if (pid > 0) {
+    if (read(fds[0], &result, sizeof(result)) != ssize_t(sizeof(result))) {
+      result.ok = false;
+    }
+
+    waitpid(pid, nullptr, 0);
+  }
+
+  close(fds[0]);
+  return result;
+}
+
+/**
+ * @brief      Quote a string for JSON or CSV output.
+ */
+std::string _Quote(const std::string& value) {
+  std::string quoted = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      quoted.push_back(FLAGS_output_format == "csv" ? '"' : '\\');
+    }
+
+    quoted.push_back(c);
+  }
+
+  return quoted + "\"";
+}
+
+void _WriteResult(const Config& config, const Result& result, bool first,
+                  std::FILE* out) {
+  const char* mode = config.async ? "async" : "sync";
+  double rate = result.messages / result.producer_seconds;
+  if (FLAGS_output_format == "csv") {
+    std::fprintf(out, "%d,%s,%s,%d,%s,%llu,%.6f,%.6f,%.0f,%llu,%llu,%llu,%llu,"
+                 "%llu\n",
+                 config.threads, mode, config.sink.c_str(), config.arg_count,
+                 _Quote(config.line_format).c_str(),
+                 (unsigned long long)result.messages, result.producer_seconds,
+                 result.total_seconds, rate, (unsigned long long)result.p50_ns,
+                 (unsigned long long)result.p99_ns,
+                 (unsigned long long)result.p999_ns,
+                 (unsigned long long)result.max_ns,
+                 (unsigned long long)result.dropped);
+    return;
+  }
+
+  std::fprintf(out,
+               "%s\n  {\"threads\": %d, \"mode\": \"%s\", \"sink\": \"%s\", "
+               "\"arg_count\": %d, \"line_format\": %s, \"messages\": %llu, "
+               "\"producer_seconds\": %.6f, \"total_seconds\": %.6f, "
+               "\"messages_per_second\": %.0f, \"p50_ns\": %llu, "
+               "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu, "
+               "\"dropped\": %llu}",
+               first ? "" : ",", config.threads, mode, config.sink.c_str(),
+               config.arg_count, _Quote(config.line_format).c_str(),
+               (unsigned long long)result.messages, result.producer_seconds,
+               result.total_seconds, rate, (unsigned long long)result.p50_ns,
+               (unsigned long long)result.p99_ns,
+               (unsigned long long)result.p999_ns,
+               (unsigned long long)result.max_ns,
+               (unsigned long long)result.dropped);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage(
+      "Benchmark cpplog with different numbers of threads, modes, outputs, "
+      "argument counts and line formats. Each run is done in its own process. "
+      "Results are written as JSON or CSV.");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  std::vector<Config> configs;
+  for (const auto& threads : _Split(FLAGS_threads)) {
+    for (const auto& mode : _Split(FLAGS_modes)) {
+      for (const auto& sink : _Split(FLAGS_sinks)) {
+        for (const auto& arg_count : _Split(FLAGS_arg_counts)) {
+          for (const auto& line_format : _Split(FLAGS_line_formats)) {
+            Config config = {std::atoi(threads.c_str()), mode == "async", sink,
+                             std::atoi(arg_count.c_str()), line_format};
+            if (config.threads < 1 || (mode != "sync" && mode != "async") ||
+                (sink != "none" && sink != "null" && sink != "stderr" &&
+                 sink != "file") ||
+                (config.arg_count != 0 && config.arg_count != 1 &&
+                 config.arg_count != 2 && config.arg_count != 4)) {
+              std::fprintf(stderr, "Invalid run: %s threads, %s, %s, %s args\n",
+                           threads.c_str(), mode.c_str(), sink.c_str(),
+                           arg_count.c_str());
+              return EXIT_FAILURE;
+            }
+
+            configs.push_back(config);
+          }
+        }
+      }
+    }
+  }
+
+  std::FILE* out = stdout;
+  if (!FLAGS_output.empty()) {
+    out = std::fopen(FLAGS_output.c_str(), "w");
+    if (out == nullptr) {
+      std::fprintf(stderr, "Can't open %s\n", FLAGS_output.c_str());
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (FLAGS_output_format == "csv") {
+    std::fprintf(out,
+                 "threads,mode,sink,arg_count,line_format,messages,"
+                 "producer_seconds,total_seconds,messages_per_second,p50_ns,"
+                 "p99_ns,p999_ns,max_ns,dropped\n");
+  } else {
+    std::fprintf(out, "[");
+  }
+
+  bool ok = true, first_written = false;
+  for (std::size_t i = 0; i < configs.size(); i++) {
+    Result result = _RunInChild(configs[i]);
+    if (!result.ok) {
+      std::fprintf(stderr, "Run %zu failed\n", i + 1);
+      ok = false;
+      continue;
+    }
+
+    // Failed runs are skipped, so the first result isn't necessarily run 0.
+    _WriteResult(configs[i], result, !first_written, out);
+    first_written = true;
+    std::fflush(out);
+  }
+
+  if (FLAGS_output_format != "csv") {
+    std::fprintf(out, "\n]\n");
+  }
+
+  if (out != stdout) {
+    std::fclose(out);
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
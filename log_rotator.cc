@@ -0,0 +1,398 @@
+#include "log_rotator.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <ctime>
+#include <tuple>
+#include <vector>
+
+#include <fcntl.h>
+#ifdef OS_WINDOWS
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#endif  // OS_WINDOWS
+
+#include <zlib.h>
+#include <boost/filesystem.hpp>
+
+namespace cpplog {
+
+namespace internal {
+
+namespace {
+
+/**
+ * The suffix of a log file's spare.
+ */
+const char kSpareSuffix[] = ".next";
+
+/**
+ * The suffix added to gzipped archives.
+ */
+const char kGzipSuffix[] = ".gz";
+
+int _OpenFile(const std::string& path) {
+#ifdef OS_WINDOWS
+  return _open(path.c_str(), _O_RDWR | _O_CREAT | _O_TRUNC | _O_BINARY,
+               _S_IREAD | _S_IWRITE);
+#else
+  return open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif  // OS_WINDOWS
+}
+
+void _CloseFile(int fd, int64_t length) {
+#ifdef OS_WINDOWS
+  if (length >= 0) {
+    _chsize_s(fd, length);
+  }
+
+  _close(fd);
+#else
+  if (length >= 0 && ftruncate(fd, off_t(length)) != 0) {
+    // Nothing sensible to do; the file just keeps its padding.
+  }
+
+  close(fd);
+#endif  // OS_WINDOWS
+}
+
+/**
+ * @brief      Parse the part of an archive's name after the log file's name
+ *             (e.g. "20170102-030405.2.gz").
+ *
+ * @param[in]  suffix  The suffix to parse.
+ * @param[out] stamp   Set to the archive's timestamp.
+ * @param[out] n       Set to the archive's .N suffix (0 if there isn't one).
+ *
+ * @return     Whether or not the name is that of an archive.
+ */
+bool _ParseArchiveSuffix(std::string suffix, std::string* stamp, int* n) {
+  std::size_t gzip_length = sizeof(kGzipSuffix) - 1;
+  if (suffix.length() > gzip_length &&
+      suffix.compare(suffix.length() - gzip_length, gzip_length,
+                     kGzipSuffix) == 0) {
+    suffix.resize(suffix.length() - gzip_length);
+  }
+
+  // YYYYMMDD-HHMMSS
+  static const std::size_t kStampLength = 15;
+  if (suffix.length() < kStampLength) {
+    return false;
+  }
+
+  for (std::size_t i = 0; i < kStampLength; i++) {
+    bool valid = i == 8 ? suffix[i] == '-' : std::isdigit(suffix[i]) != 0;
+    if (!valid) {
+      return false;
+    }
+  }
+
+  *stamp = suffix.substr(0, kStampLength);
+  *n = 0;
+  if (suffix.length() == kStampLength) {
+    return true;
+  }
+
+  if (suffix[kStampLength] != '.' || suffix.length() == kStampLength + 1) {
+    return false;
+  }
+
+  for (std::size_t i = kStampLength + 1; i < suffix.length(); i++) {
+    if (!std::isdigit(suffix[i])) {
+      return false;
+    }
+
+    *n = *n * 10 + (suffix[i] - '0');
+  }
+
+  return true;
+}
+
+/**
+ * @brief      Gzip a file, replacing it with `path` + ".gz". If something goes
+ *             wrong, the original file is left alone.
+ */
+void _GzipFile(const std::string& path) {
+  std::string gzip_path = path + kGzipSuffix;
+  std::string tmp_path = gzip_path + ".tmp";
+
+  std::FILE* in = std::fopen(path.c_str(), "rb");
+  if (in == nullptr) {
+    return;
+  }
+
+  gzFile out = gzopen(tmp_path.c_str(), "wb");
+  if (out == nullptr) {
+    std::fclose(in);
+    return;
+  }
+
+  bool ok = true;
+  std::vector<char> buffer(64 * 1024);
+  std::size_t length;
+  while ((length = std::fread(buffer.data(), 1, buffer.size(), in)) > 0) {
+    if (gzwrite(out, buffer.data(), static_cast<unsigned>(length)) !=
+        static_cast<int>(length)) {
+      ok = false;
+      break;
+    }
+  }
+
+  ok = !std::ferror(in) && ok;
+  std::fclose(in);
+  ok = gzclose(out) == Z_OK && ok;
+
+  if (!ok) {
+    std::remove(tmp_path.c_str());
+    return;
+  }
+
+  std::rename(tmp_path.c_str(), gzip_path.c_str());
+  std::remove(path.c_str());
+}
+
+}  // namespace
+
+LogRotator::LogRotator(const std::string& compression, uint32_t max_files,
+                       uint64_t max_total_bytes)
+    : compression_(compression),
+      max_files_(max_files),
+      max_total_bytes_(max_total_bytes),
+      stopping_(false),
+      thread_(&LogRotator::_Run, this) {}
+
+LogRotator::~LogRotator() { Stop(); }
+
+void LogRotator::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (stopping_) {
+      return;
+    }
+
+    stopping_ = true;
+  }
+
+  jobs_added_.notify_all();
+  thread_.join();
+
+  // Get rid of any spares which were never used.
+  std::lock_guard<std::mutex> lock(lock_);
+  for (auto& path_and_spare : spares_) {
+    auto& spare = path_and_spare.second;
+    if (spare.state == Spare::READY) {
+      _CloseFile(spare.fd, -1);
+      std::remove((path_and_spare.first + kSpareSuffix).c_str());
+      spare.state = Spare::NONE;
+      spare.fd = -1;
+    }
+  }
+}
+
+void LogRotator::PrepareSpare(const std::string& path, uint64_t preallocate) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    spares_[path].preallocate = preallocate;
+    if (stopping_) {
+      return;
+    }
+
+    jobs_.push_back(Job{Job::PREPARE, path, -1, -1});
+  }
+
+  jobs_added_.notify_one();
+}
+
+int LogRotator::TakeSpare(const std::string& path) {
+  std::unique_lock<std::mutex> lock(lock_);
+  auto& spare = spares_[path];
+
+  // If the last spare hasn't been renamed yet (i.e. the file is being rotated
+  // faster than the rotator can keep up), wait for it.
+  spare_renamed_.wait(lock, [&spare] { return spare.state != Spare::IN_USE; });
+
+  if (spare.state == Spare::NONE) {
+    spare.fd = _OpenSpare(path, spare.preallocate);
+    if (spare.fd < 0) {
+      return -1;
+    }
+  }
+
+  spare.state = Spare::IN_USE;
+  int fd = spare.fd;
+  spare.fd = -1;
+  return fd;
+}
+
+void LogRotator::Retire(const std::string& path, int old_fd, int64_t length) {
+  Job job{Job::RETIRE, path, old_fd, length};
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (!stopping_) {
+      jobs_.push_back(job);
+      jobs_added_.notify_one();
+      return;
+    }
+  }
+
+  _Do(job);
+}
+
+void LogRotator::_Run() {
+  std::unique_lock<std::mutex> lock(lock_);
+  while (true) {
+    jobs_added_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+    if (jobs_.empty()) {
+      return;
+    }
+
+    Job job = jobs_.front();
+    jobs_.pop_front();
+
+    lock.unlock();
+    _Do(job);
+    lock.lock();
+  }
+}
+
+void LogRotator::_Do(const Job& job) {
+  if (job.type == Job::PREPARE) {
+    _Prepare(job.path);
+    return;
+  }
+
+  // Close the old file and move the spare into its place.
+  _CloseFile(job.fd, job.length);
+  std::string archive = _ArchivePath(job.path);
+  std::rename(job.path.c_str(), archive.c_str());
+  std::rename((job.path + kSpareSuffix).c_str(), job.path.c_str());
+
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    spares_[job.path].state = Spare::NONE;
+  }
+
+  spare_renamed_.notify_all();
+  _Prepare(job.path);
+
+  if (compression_ == "gzip") {
+    _GzipFile(archive);
+  }
+
+  _EnforceRetention(job.path);
+}
+
+void LogRotator::_Prepare(const std::string& path) {
+  // The lock is held while opening, so that TakeSpare() can't open the same
+  // spare at the same time.
+  std::lock_guard<std::mutex> lock(lock_);
+  auto& spare = spares_[path];
+  if (stopping_ || spare.state != Spare::NONE) {
+    return;
+  }
+
+  spare.fd = _OpenSpare(path, spare.preallocate);
+  if (spare.fd >= 0) {
+    spare.state = Spare::READY;
+  }
+}
+
+int LogRotator::_OpenSpare(const std::string& path, uint64_t preallocate) {
+  int fd = _OpenFile(path + kSpareSuffix);
+#ifndef OS_WINDOWS
+  if (fd >= 0 && preallocate > 0 &&
+      posix_fallocate(fd, 0, off_t(preallocate)) != 0) {
+    close(fd);
+    return -1;
+  }
+#endif  // OS_WINDOWS
+
+  return fd;
+}
+
+std::string LogRotator::_ArchivePath(const std::string& path) {
+  std::time_t now = std::time(nullptr);
+  std::tm now_tm;
+#ifdef OS_WINDOWS
+  localtime_s(&now_tm, &now);
+#else
+  localtime_r(&now, &now_tm);
+#endif  // OS_WINDOWS
+
+  char stamp[32];
+  std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &now_tm);
+
+  // Within the same second, keep counting up from the last archive: lower
+  // numbers might have been freed up by retention, and reusing them would
+  // break the ordering.
+  std::lock_guard<std::mutex> lock(lock_);
+  auto& last = last_archives_[path];
+  int n = last.first == stamp ? last.second + 1 : 0;
+
+  std::string base = path + "." + stamp;
+  std::string archive;
+  while (true) {
+    archive = n == 0 ? base : base + "." + std::to_string(n);
+    if (!boost::filesystem::exists(archive) &&
+        !boost::filesystem::exists(archive + kGzipSuffix)) {
+      break;
+    }
+
+    n++;
+  }
+
+  last = std::make_pair(std::string(stamp), n);
+  return archive;
+}
+
+void LogRotator::_EnforceRetention(const std::string& path) {
+  if (max_files_ == 0 && max_total_bytes_ == 0) {
+    return;
+  }
+
+  namespace fs = boost::filesystem;
+  fs::path log_path(path);
+  fs::path dir = log_path.has_parent_path() ? log_path.parent_path() : ".";
+  std::string prefix = log_path.filename().string() + ".";
+
+  // Find all of the archives of this log file.
+  std::vector<std::tuple<std::string, int, fs::path>> archives;
+  boost::system::error_code error;
+  for (fs::directory_iterator it(dir, error), end; !error && it != end;
+       it.increment(error)) {
+    std::string name = it->path().filename().string();
+    std::string stamp;
+    int n;
+    if (name.compare(0, prefix.length(), prefix) == 0 &&
+        _ParseArchiveSuffix(name.substr(prefix.length()), &stamp, &n)) {
+      archives.emplace_back(stamp, n, it->path());
+    }
+  }
+
+  // Keep the newest archives which fit inside the limits.
+  std::sort(archives.rbegin(), archives.rend());
+  uint32_t kept = 0;
+  uint64_t total_bytes = 0;
+  for (const auto& archive : archives) {
+    const auto& archive_path = std::get<2>(archive);
+    uint64_t size = fs::file_size(archive_path, error);
+    if (error) {
+      continue;
+    }
+
+    if ((max_files_ > 0 && kept >= max_files_) ||
+        (max_total_bytes_ > 0 && total_bytes + size > max_total_bytes_)) {
+      fs::remove(archive_path, error);
+    } else {
+      kept++;
+      total_bytes += size;
+    }
+  }
+}
+
+}  // namespace internal
+
+}  // namespace cpplog
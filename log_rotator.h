@@ -0,0 +1,137 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace cpplog {
+
+namespace internal {
+
+/**
+ * @brief      Does the slow parts of rotating log files on a background
+ *             thread.
+ *
+ * @details    For each log file, the rotator keeps a spare file (`path` +
+ *             ".next") open and ready. Rotating is then just a matter of
+ *             swapping the log file's descriptor for the spare one and handing
+ *             the old descriptor to Retire(), so the logging path never waits
+ *             for the filesystem.
+ *
+ *             On its thread, the rotator then closes the old file, archives
+ *             it as `path`.YYYYMMDD-HHMMSS, moves the spare into place,
+ *             compresses the archive (if requested), deletes archives beyond
+ *             the retention limits and opens a new spare.
+ *
+ *             All methods are thread-safe.
+ */
+class LogRotator {
+ public:
+  /**
+   * @brief      Start the rotator's thread.
+   *
+   * @param[in]  compression      How to compress archives: "none" or "gzip".
+   * @param[in]  max_files        The maximum number of archives to keep for
+   *                              each log file. 0 means no limit.
+   * @param[in]  max_total_bytes  The maximum total size of the archives of
+   *                              each log file. 0 means no limit.
+   */
+  LogRotator(const std::string& compression, uint32_t max_files,
+             uint64_t max_total_bytes);
+
+  /**
+   * @brief      Stop the rotator (see Stop()).
+   */
+  ~LogRotator();
+
+  LogRotator(const LogRotator&) = delete;
+  LogRotator& operator=(const LogRotator&) = delete;
+
+  /**
+   * @brief      Finish any outstanding work and stop the thread. Unused spare
+   *             files are removed. Afterwards, everything is done immediately
+   *             on the calling thread.
+   */
+  void Stop();
+
+  /**
+   * @brief      Start preparing a spare file for a log file. This returns
+   *             straight away; the spare is created in the background.
+   *
+   * @param[in]  path         The path of the log file.
+   * @param[in]  preallocate  The number of bytes to preallocate in the spare
+   *                          (for memory-mapped files), or 0.
+   */
+  void PrepareSpare(const std::string& path, uint64_t preallocate);
+
+  /**
+   * @brief      Take the spare file for a log file. If the spare isn't ready
+   *             yet, it is opened on the calling thread.
+   *
+   * @return     The spare's file descriptor, or -1 if it couldn't be opened.
+   *             The spare is still named `path` + ".next" until Retire() has
+   *             been called.
+   */
+  int TakeSpare(const std::string& path);
+
+  /**
+   * @brief      Archive the old version of a log file after its spare has been
+   *             swapped in. This returns straight away.
+   *
+   * @param[in]  path       The path of the log file.
+   * @param[in]  old_fd     The old file's descriptor, which will be closed.
+   * @param[in]  length     If not negative, the old file is truncated to this
+   *                        length before being closed.
+   */
+  void Retire(const std::string& path, int old_fd, int64_t length);
+
+ private:
+  struct Spare {
+    /**
+     * NONE: there is no spare file. READY: `fd` is open and waiting to be
+     * taken. IN_USE: the spare has been taken, but not renamed yet.
+     */
+    enum State { NONE, READY, IN_USE } state = NONE;
+    int fd = -1;
+    uint64_t preallocate = 0;
+  };
+
+  struct Job {
+    enum Type { PREPARE, RETIRE } type;
+    std::string path;
+    int fd;
+    int64_t length;
+  };
+
+  void _Run();
+  void _Do(const Job& job);
+  void _Prepare(const std::string& path);
+  int _OpenSpare(const std::string& path, uint64_t preallocate);
+  std::string _ArchivePath(const std::string& path);
+  void _EnforceRetention(const std::string& path);
+
+  const std::string compression_;
+  const uint32_t max_files_;
+  const uint64_t max_total_bytes_;
+
+  std::mutex lock_;
+  std::condition_variable jobs_added_, spare_renamed_;
+  std::deque<Job> jobs_;
+  std::map<std::string, Spare> spares_;
+
+  /**
+   * The timestamp and .N suffix of the last archive of each log file.
+   */
+  std::map<std::string, std::pair<std::string, int>> last_archives_;
+  bool stopping_;
+  std::thread thread_;
+};
+
+}  // namespace internal
+
+}  // namespace cpplog
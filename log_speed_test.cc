@@ -2,7 +2,11 @@
 
 #include <gflags/gflags.h>
 
+#include <atomic>
 #include <chrono>
+#include <cstdlib>
+#include <new>
+#include <thread>
 
 DECLARE_bool(logtostderr);
 DECLARE_string(line_format);
@@ -12,8 +16,25 @@ using namespace std::chrono;
 DEFINE_int32(test, 1, "The test to run.");
 DEFINE_int32(n, 10000, "Number of log messages to emit.");
 
+// Count every heap allocation made by the program, so that test 4 can check
+// how many allocations a single LOG_INFO() makes.
+std::atomic<uint64_t> n_allocations(0);
+
+void* operator new(std::size_t size) {
+  n_allocations.fetch_add(1, std::memory_order_relaxed);
+  void* ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+
 void TestLoggingWhenLoggingDisabled() {
   FLAGS_logtostderr = false;
+  cpplog::Reconfigure();
   auto start_log = system_clock::now();
   for (int i = 0; i < FLAGS_n; i++) {
     LOG_INFO("Test 1");
@@ -34,10 +55,11 @@ void TestLoggingWhenLoggingDisabled() {
   unsigned int log_time_int = log_time.count(),
                clean_time_int = clean_time.count();
   while (cpplog::MessagesInQueue() > 0) {
-    ;
+    std::this_thread::yield();
   }
 
   FLAGS_logtostderr = true;
+  cpplog::Reconfigure();
   LOG_INFO("Time with LOG_INFO(): {}ms ({:.2f}ns per LOG_INFO())",
            {log_time_int, double(log_time_int) / FLAGS_n * 1000});
   LOG_INFO("Time with    nothing: {}ms ({:.2f}ns per loop)",
@@ -72,6 +94,7 @@ void TestLoggingComparedToPrintf() {
 
 void TestLoggingComparedToPrintfWithSimpleFormat() {
   FLAGS_line_format = "{message}";
+  cpplog::Reconfigure();
   auto start_log = system_clock::now();
   for (int i = 0; i < FLAGS_n; i++) {
     LOG_INFO("Test 3");
@@ -97,11 +120,89 @@ void TestLoggingComparedToPrintfWithSimpleFormat() {
            {clean_time_int, double(clean_time_int) / FLAGS_n * 1000});
 }
 
+// Check that calling `log` (with the message's index) doesn't allocate once
+// warmed up.
+template <typename LogFunction>
+void CheckNoAllocationsPerLog(const char* name, LogFunction log) {
+  // Log a few messages first so that any buffers have grown to size (and the
+  // call site has been rendered). In async mode, wait for the emitter to pick
+  // them up too, so that it has started any threads it needs.
+  uint64_t start_allocations = 0;
+  for (int i = -10; i < FLAGS_n; i++) {
+    if (i == 0) {
+      while (cpplog::MessagesInQueue() > 0) {
+        std::this_thread::yield();
+      }
+
+      std::this_thread::sleep_for(milliseconds(10));
+      start_allocations = n_allocations.load();
+    }
+
+    log(i);
+  }
+  uint64_t end_allocations = n_allocations.load();
+
+  double allocations_per_log =
+      double(end_allocations - start_allocations) / FLAGS_n;
+  LOGF_INFO("Allocations per {}: {:.2f}", name, allocations_per_log);
+  if (allocations_per_log > 0) {
+    LOGF_FATAL("{} should not allocate once warmed up!", name);
+  }
+}
+
+// Zero allocations are only claimed for LOG_INFO() without arguments and for
+// LOGF_INFO(). LOG_INFO() with arguments is formatted by cppstring's
+// string::Format(), which allocates the formatted message (and a string for
+// each string argument) when it is rendered, so it isn't checked.
+void TestAllocationsPerLog() {
+  CheckNoAllocationsPerLog("LOG_INFO() without arguments",
+                           [](int) { LOG_INFO("Test 4"); });
+
+  // A more typical message, with a checked format whose arguments are
+  // rendered in place.
+  const std::string path = "/api/v1/users/profile";
+  CheckNoAllocationsPerLog("LOGF_INFO() with arguments", [&path](int i) {
+    LOGF_INFO(
+        "Test 4: finished handling request {} for {} from client {} with "
+        "status {} after {} retries",
+        i, path, i % 1000, 200, i % 3);
+  });
+}
+
+void TestCheckedFormatComparedToLogInfo() {
+  FLAGS_line_format = "{message}";
+  cpplog::Reconfigure();
+  auto start_log = system_clock::now();
+  for (int i = 0; i < FLAGS_n; i++) {
+    LOG_INFO("Test 5: {} took {}ms", i, i * 0.25);
+  }
+  auto end_log = system_clock::now();
+
+  auto start_checked = system_clock::now();
+  for (int i = 0; i < FLAGS_n; i++) {
+    LOGF_INFO("Test 5: {} took {}ms", i, i * 0.25);
+  }
+  auto end_checked = system_clock::now();
+
+  // Calculate time of each segment.
+  auto log_time = duration_cast<microseconds>(end_log - start_log);
+  auto checked_time = duration_cast<microseconds>(end_checked - start_checked);
+
+  // Print some stats.
+  unsigned int log_time_int = log_time.count(),
+               checked_time_int = checked_time.count();
+  LOGF_INFO("Time with  LOG_INFO(): {}us ({:.2f}ns per LOG_INFO())",
+            log_time_int, double(log_time_int) / FLAGS_n * 1000);
+  LOGF_INFO("Time with LOGF_INFO(): {}us ({:.2f}ns per LOGF_INFO())",
+            checked_time_int, double(checked_time_int) / FLAGS_n * 1000);
+}
+
 int main(int argc, char** argv) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
   auto _ = cpplog::Init();
 
   FLAGS_logtostderr = true;
+  cpplog::Reconfigure();
   LOG_INFO("Starting speed tests!");
 
   if (FLAGS_test == 1) {
@@ -116,7 +217,16 @@ int main(int argc, char** argv) {
     LOG_INFO(
         "3. How does LOG_INFO() with a simple format compare to printf()?");
     TestLoggingComparedToPrintfWithSimpleFormat();
+  } else if (FLAGS_test == 4) {
+    LOG_INFO(
+        "4. How many allocations do LOG_INFO() without arguments and "
+        "LOGF_INFO() make?");
+    TestAllocationsPerLog();
+  } else if (FLAGS_test == 5) {
+    LOG_INFO(
+        "5. How does LOGF_INFO() with arguments compare to LOG_INFO()?");
+    TestCheckedFormatComparedToLogInfo();
   } else {
-    LOG_FATAL("Invalid test id %s", {3});
+    LOGF_FATAL("Invalid test id {}", FLAGS_test);
   }
 }
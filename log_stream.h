@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstddef>
+#include <ios>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cpplog {
+
+namespace internal {
+
+/**
+ * @brief      A streambuf which appends to a string, so that the text can be
+ *             moved out rather than copied (as std::stringbuf::str() does).
+ */
+class StringStreamBuffer : public std::streambuf {
+ public:
+  std::string& str() { return str_; }
+
+ protected:
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      str_.push_back(traits_type::to_char_type(c));
+    }
+
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char* data, std::streamsize length) override {
+    str_.append(data, static_cast<std::size_t>(length));
+    return length;
+  }
+
+ private:
+  std::string str_;
+};
+
+/**
+ * @brief      The stream which LOG_STREAM messages are written to. Creating an
+ *             ostream is slow (it sets up a locale, among other things), so
+ *             each thread keeps a few of these and reuses them (see
+ *             ScopedLogStream).
+ */
+class LogStream : public std::ostream {
+ public:
+  LogStream() : std::ostream(nullptr) { rdbuf(&buffer_); }
+
+  LogStream(const LogStream&) = delete;
+  LogStream& operator=(const LogStream&) = delete;
+
+  /**
+   * @brief      Empty the stream and put its formatting (e.g. std::hex or
+   *             std::setprecision()) back to the defaults.
+   */
+  void Reset() {
+    buffer_.str().clear();
+    clear();
+    flags(std::ios_base::dec | std::ios_base::skipws);
+    precision(6);
+    width(0);
+    fill(' ');
+  }
+
+  /**
+   * @brief      Move out the text written so far. The buffer is grown back to
+   *             the same size, so the next message of about the same length
+   *             only allocates once.
+   */
+  std::string Take() {
+    std::string text = std::move(buffer_.str());
+    buffer_.str().clear();
+    buffer_.str().reserve(text.length());
+    return text;
+  }
+
+ private:
+  StringStreamBuffer buffer_;
+};
+
+/**
+ * @brief      Borrow one of the calling thread's LogStreams until this is
+ *             destroyed. A message logged while another is being written
+ *             (e.g. from an operator<<) gets a stream of its own.
+ */
+class ScopedLogStream {
+ public:
+  ScopedLogStream() : pool_(_GetPool()) {
+    if (pool_.depth == pool_.streams.size()) {
+      pool_.streams.emplace_back(new LogStream());
+    }
+
+    stream_ = pool_.streams[pool_.depth++].get();
+    stream_->Reset();
+  }
+
+  ~ScopedLogStream() { pool_.depth--; }
+
+  ScopedLogStream(const ScopedLogStream&) = delete;
+  ScopedLogStream& operator=(const ScopedLogStream&) = delete;
+
+  LogStream& stream() { return *stream_; }
+
+ private:
+  /**
+   * The calling thread's streams. Those below `depth` are in use.
+   */
+  struct Pool {
+    std::vector<std::unique_ptr<LogStream>> streams;
+    std::size_t depth = 0;
+  };
+
+  static Pool& _GetPool() {
+    static thread_local Pool pool;
+    return pool;
+  }
+
+  Pool& pool_;
+  LogStream* stream_;
+};
+
+}  // namespace internal
+
+}  // namespace cpplog
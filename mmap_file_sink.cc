@@ -0,0 +1,183 @@
+#include "mmap_file_sink.h"
+
+#ifndef OS_WINDOWS
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "log_rotator.h"
+
+namespace cpplog {
+
+namespace internal {
+
+namespace {
+
+int _OpenFile(const std::string& path) {
+  return open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+}  // namespace
+
+MmapFileSink::MmapFileSink(const std::string& path, std::size_t size,
+                           LogRotator* rotator, SinkCounters* counters)
+    : path_(path), size_(size), rotator_(rotator), counters_(counters) {
+  segment_.store(_Map(_OpenFile(path_), false), std::memory_order_release);
+  if (rotator_ != nullptr) {
+    rotator_->PrepareSpare(path_, size_);
+  }
+}
+
+MmapFileSink::~MmapFileSink() {
+  Segment* segment = segment_.load(std::memory_order_acquire);
+  std::size_t used = std::min(
+      segment->reserved.load(std::memory_order_acquire), segment->capacity);
+  _Unmap(segment, used);
+  _CountFinished(used, false);
+}
+
+void MmapFileSink::Write(const char* data, std::size_t length) {
+  while (true) {
+    Segment* segment = segment_.load(std::memory_order_acquire);
+    if (segment->data == nullptr || length > segment->capacity) {
+      return;
+    }
+
+    std::size_t offset =
+        segment->reserved.fetch_add(length, std::memory_order_relaxed);
+    if (offset + length <= segment->capacity) {
+      std::memcpy(segment->data + offset, data, length);
+      segment->committed.fetch_add(length, std::memory_order_release);
+      return;
+    }
+
+    // Reservations are contiguous, so exactly one writer crosses the end of
+    // the segment. That writer rotates; everyone else waits and tries again.
+    if (offset <= segment->capacity) {
+      _Rotate(segment, offset);
+    } else {
+      while (segment_.load(std::memory_order_acquire) == segment) {
+        std::this_thread::yield();
+      }
+    }
+  }
+}
+
+void MmapFileSink::WriteForCrash(const char* data, std::size_t length) {
+  Segment* segment = segment_.load(std::memory_order_acquire);
+  if (segment->data == nullptr) {
+    return;
+  }
+
+  // Only reserve space which fits, so that this never becomes the writer
+  // which crosses the end (and has to rotate).
+  std::size_t offset = segment->reserved.load(std::memory_order_relaxed);
+  do {
+    if (offset + length > segment->capacity) {
+      return;
+    }
+  } while (!segment->reserved.compare_exchange_weak(
+      offset, offset + length, std::memory_order_relaxed));
+
+  std::memcpy(segment->data + offset, data, length);
+  segment->committed.fetch_add(length, std::memory_order_release);
+}
+
+MmapFileSink::Segment* MmapFileSink::_Map(int fd, bool preallocated) {
+  segments_.emplace_back(new Segment());
+  Segment* segment = segments_.back().get();
+
+  segment->fd = fd;
+  if (segment->fd < 0) {
+    return segment;
+  }
+
+  // Allocate the space up front: writing to a sparse mapping when the disk
+  // is full would crash the process with SIGBUS.
+  if (!preallocated && posix_fallocate(segment->fd, 0, off_t(size_)) != 0) {
+    return segment;
+  }
+
+  void* data =
+      mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+  if (data == MAP_FAILED) {
+    return segment;
+  }
+
+  segment->data = static_cast<char*>(data);
+  segment->capacity = size_;
+  return segment;
+}
+
+void MmapFileSink::_Unmap(Segment* segment, std::size_t used) {
+  // The segment's fields are left alone: other writers might still be reading
+  // them (although they will never write to the old mapping).
+  if (segment->data != nullptr) {
+    munmap(segment->data, segment->capacity);
+  }
+
+  if (segment->fd >= 0) {
+    if (ftruncate(segment->fd, off_t(used)) != 0) {
+      // Nothing sensible to do; the file just keeps its padding.
+    }
+
+    close(segment->fd);
+    segment->fd = -1;
+  }
+}
+
+void MmapFileSink::_Rotate(Segment* full, std::size_t used) {
+  // Wait for everyone who had space in the old segment to finish copying.
+  while (full->committed.load(std::memory_order_acquire) < used) {
+    std::this_thread::yield();
+  }
+
+  _CountFinished(used, true);
+
+  // With a rotator, the spare has already been preallocated, and the old file
+  // is truncated and archived in the background. The old segment is full, so
+  // unlike FileSink we can't keep writing to it if there's no spare: rotate
+  // inline instead, and try the rotator again next time.
+  if (rotator_ != nullptr) {
+    int spare = rotator_->TakeSpare(path_);
+    if (spare >= 0) {
+      munmap(full->data, full->capacity);
+      Segment* next = _Map(spare, true);
+      rotator_->Retire(path_, full->fd, int64_t(used));
+      segment_.store(next, std::memory_order_release);
+      return;
+    }
+  }
+
+  _Unmap(full, used);
+
+  // Move the file to the file + 1.
+  std::string old_path = path_ + ".old";
+  std::remove(old_path.c_str());
+  std::rename(path_.c_str(), old_path.c_str());
+
+  segment_.store(_Map(_OpenFile(path_), false), std::memory_order_release);
+}
+
+void MmapFileSink::_CountFinished(std::size_t used, bool rotated) {
+  if (counters_ == nullptr) {
+    return;
+  }
+
+  counters_->bytes.fetch_add(used, std::memory_order_relaxed);
+  if (rotated) {
+    counters_->rotations.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+}  // namespace internal
+
+}  // namespace cpplog
+
+#endif  // OS_WINDOWS
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "stats.h"
+
+namespace cpplog {
+
+namespace internal {
+
+class LogRotator;
+
+/**
+ * @brief      A log file which is written through a memory mapping.
+ *
+ * @details    The file is preallocated to its maximum size and mapped into
+ *             memory. Writing a line reserves space with an atomic
+ *             fetch_add() on the write cursor and then memcpy()s the line
+ *             into the mapping, so any number of threads can write at once
+ *             without a lock. Because the data lives in the page cache, it
+ *             isn't lost if the process crashes.
+ *
+ *             When a line doesn't fit, the writer which crossed the end of
+ *             the file rotates it: it waits for the other writers to finish
+ *             copying and maps a fresh file (the rotator's preallocated spare,
+ *             if there is one). The old file is truncated to the length
+ *             actually used and archived (by the rotator, or by moving it to
+ *             `path` + ".old"). Other writers wait
+ *             for the new file to appear. Until the file is closed (or
+ *             rotated), it is padded with NUL bytes after the last line.
+ *
+ *             Not supported on Windows.
+ */
+class MmapFileSink {
+ public:
+  /**
+   * @brief      Create (and truncate) a log file and map it.
+   *
+   * @param[in]  path  The path of the file.
+   * @param[in]  size     The size to preallocate, in bytes. The file is
+   *                      rotated once it is full. Must be greater than 0.
+   * @param[in]  rotator  Used to rotate the file without blocking, or nullptr.
+   * @param[in]  counters Where to count bytes and rotations, or nullptr. So
+   *                      that writing stays a single fetch_add(), bytes are
+   *                      only counted as each file is finished.
+   */
+  MmapFileSink(const std::string& path, std::size_t size,
+               LogRotator* rotator = nullptr, SinkCounters* counters = nullptr);
+
+  /**
+   * @brief      Unmap the file and truncate it to the length used.
+   */
+  ~MmapFileSink();
+
+  MmapFileSink(const MmapFileSink&) = delete;
+  MmapFileSink& operator=(const MmapFileSink&) = delete;
+
+  /**
+   * @brief      Append a line to the file. This is thread-safe. If the file
+   *             couldn't be mapped, or the line is larger than the whole
+   *             file, the line is dropped.
+   *
+   * @param[in]  data    The line to write, including the newline.
+   * @param[in]  length  The length of `data`.
+   */
+  void Write(const char* data, std::size_t length);
+
+  /**
+   * @brief      Append a line from a crash handler. This is async-signal-safe:
+   *             rather than rotating, a line which doesn't fit in the current
+   *             file is dropped.
+   *
+   * @param[in]  data    The line to write, including the newline.
+   * @param[in]  length  The length of `data`.
+   */
+  void WriteForCrash(const char* data, std::size_t length);
+
+  /**
+   * @brief      The path of the file.
+   */
+  const std::string& path() const { return path_; }
+
+ private:
+  /**
+   * A single mapped file. These are never freed while the sink exists, since
+   * writers might still be looking at an old segment's cursor.
+   */
+  struct Segment {
+    int fd = -1;
+    char* data = nullptr;
+    std::size_t capacity = 0;
+
+    /**
+     * The number of bytes handed out to writers, and the number of bytes
+     * they have finished copying in.
+     */
+    std::atomic<std::size_t> reserved{0}, committed{0};
+  };
+
+  Segment* _Map(int fd, bool preallocated);
+  void _Unmap(Segment* segment, std::size_t used);
+  void _Rotate(Segment* full, std::size_t used);
+  void _CountFinished(std::size_t used, bool rotated);
+
+  std::string path_;
+  std::size_t size_;
+  LogRotator* rotator_;
+  SinkCounters* counters_;
+
+  std::atomic<Segment*> segment_;
+
+  /**
+   * Every segment which has been mapped. Only the writer doing a rotation
+   * adds to this (before publishing the new segment), so only one thread
+   * ever touches it at once.
+   */
+  std::vector<std::unique_ptr<Segment>> segments_;
+};
+
+}  // namespace internal
+
+}  // namespace cpplog
@@ -0,0 +1,434 @@
+#include "network_sink.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#ifndef OS_WINDOWS
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif  // OS_WINDOWS
+
+#include "cpu_affinity.h"
+
+namespace cpplog {
+
+namespace internal {
+
+namespace {
+
+/**
+ * Once this many bytes are waiting, they are sent without waiting for the
+ * flush interval.
+ */
+constexpr std::size_t kBatchSize = 32 * 1024;
+
+/**
+ * The most datagrams to send with one sendmmsg().
+ */
+constexpr std::size_t kMaxDatagramsPerSend = 64;
+
+/**
+ * How long a TCP connect or send can block before the connection is given up
+ * on, so that an unreachable or stalled collector can't hang the program while
+ * it exits. (Resolving the collector's name is still up to the resolver's own
+ * timeouts.)
+ */
+constexpr int kSendTimeoutSeconds = 5;
+
+/**
+ * @brief      Read the octet count at the start of a frame.
+ *
+ * @param[in]  frames  The framed messages.
+ * @param      pos     The start of the frame. Set to the start of its message.
+ *
+ * @return     The length of the message.
+ */
+std::size_t _ReadFrameLength(const std::string& frames, std::size_t* pos) {
+  std::size_t length = 0;
+  while (frames[*pos] != ' ') {
+    length = length * 10 + std::size_t(frames[*pos] - '0');
+    (*pos)++;
+  }
+
+  (*pos)++;
+  return length;
+}
+
+#ifndef OS_WINDOWS
+/**
+ * @brief      Connect a socket. A TCP connect gives up after
+ *             kSendTimeoutSeconds, rather than waiting out the kernel's SYN
+ *             retries (UDP sockets connect straight away).
+ *
+ * @return     true if the socket connected.
+ */
+bool _Connect(int fd, const sockaddr* address, socklen_t length) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    return false;
+  }
+
+  if (connect(fd, address, length) != 0) {
+    if (errno != EINPROGRESS) {
+      return false;
+    }
+
+    pollfd poll_fd = {fd, POLLOUT, 0};
+    int ready;
+    do {
+      ready = poll(&poll_fd, 1, kSendTimeoutSeconds * 1000);
+    } while (ready < 0 && errno == EINTR);
+
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    if (ready != 1 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) != 0 ||
+        error != 0) {
+      return false;
+    }
+  }
+
+  return fcntl(fd, F_SETFL, flags) == 0;
+}
+#endif  // OS_WINDOWS
+
+}  // namespace
+
+int ConnectSocket(const std::string& address, bool stream) {
+#ifdef OS_WINDOWS
+  return -1;
+#else
+  auto colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    return -1;
+  }
+
+  std::string host = address.substr(0, colon);
+  std::string port = address.substr(colon + 1);
+  if (host.length() >= 2 && host.front() == '[' && host.back() == ']') {
+    host = host.substr(1, host.length() - 2);
+  }
+
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = stream ? SOCK_STREAM : SOCK_DGRAM;
+  addrinfo* results = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0) {
+    return -1;
+  }
+
+  int fd = -1;
+  for (addrinfo* result = results; result != nullptr;
+       result = result->ai_next) {
+    fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (fd >= 0 && _Connect(fd, result->ai_addr, result->ai_addrlen)) {
+      break;
+    }
+
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  freeaddrinfo(results);
+  return fd;
+#endif  // OS_WINDOWS
+}
+
+NetworkSink::NetworkSink(const std::string& address,
+                         const std::string& app_name, uint32_t facility,
+                         std::size_t max_buffered,
+                         std::chrono::milliseconds flush_interval,
+                         SinkCounters* counters,
+                         std::atomic<uint64_t>* dropped)
+    : address_(address),
+      stream_(false),
+      facility_(std::min<uint32_t>(facility, 23)),
+      max_buffered_(max_buffered),
+      flush_interval_(flush_interval),
+      counters_(counters),
+      dropped_(dropped),
+      fd_(-1),
+      n_pending_(0),
+      urgent_(false),
+      timestamp_second_(-1),
+      stopping_(false) {
+  auto scheme = address_.find("://");
+  if (scheme != std::string::npos) {
+    stream_ = address_.compare(0, scheme, "tcp") == 0;
+    address_ = address_.substr(scheme + 3);
+  }
+
+  // Fields can't contain spaces, and are limited in length (RFC 5424 section
+  // 6). An empty field is written as "-".
+  auto field = [](std::string value, std::size_t max_length) {
+    value = value.substr(0, max_length);
+    std::replace(value.begin(), value.end(), ' ', '_');
+    return value.empty() ? std::string("-") : value;
+  };
+
+  std::string hostname, procid;
+#ifndef OS_WINDOWS
+  char name[256] = {};
+  if (gethostname(name, sizeof(name) - 1) == 0) {
+    hostname = name;
+  }
+
+  procid = std::to_string(getpid());
+#endif  // OS_WINDOWS
+  header_suffix_ = " " + field(hostname, 255) + " " + field(app_name, 48) +
+                   " " + field(procid, 128) + " - - ";
+
+  pending_.reserve(max_buffered_);
+  sending_.reserve(max_buffered_);
+  thread_ = std::thread(&NetworkSink::_Run, this);
+}
+
+NetworkSink::~NetworkSink() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stopping_ = true;
+  }
+
+  wake_.notify_one();
+  thread_.join();
+
+#ifndef OS_WINDOWS
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+#endif  // OS_WINDOWS
+}
+
+void NetworkSink::Write(int severity,
+                        std::chrono::system_clock::time_point log_time,
+                        const char* line, std::size_t length) {
+  if (length > 0 && line[length - 1] == '\n') {
+    length--;
+  }
+
+  std::lock_guard<std::mutex> lock(lock_);
+
+  // <PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID MSGID STRUCTURED-DATA MSG
+  char priority[16];
+  std::snprintf(priority, sizeof(priority), "<%u>1 ",
+                facility_ * 8 + uint32_t(severity));
+  header_.assign(priority);
+  _AppendTimestamp(log_time);
+  header_.append(header_suffix_);
+
+  char octets[24];
+  int octets_length = std::snprintf(octets, sizeof(octets), "%zu ",
+                                    header_.length() + length);
+  std::size_t frame_length = std::size_t(octets_length) + header_.length() +
+                             length;
+  if (pending_.length() + frame_length > max_buffered_) {
+    dropped_->fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  pending_.append(octets, std::size_t(octets_length));
+  pending_.append(header_);
+  pending_.append(line, length);
+  n_pending_++;
+
+  // Only wake the sender once there's a batch worth sending.
+  bool was_urgent = urgent_;
+  urgent_ = urgent_ || severity <= 3;
+  if (pending_.length() >= kBatchSize || (urgent_ && !was_urgent)) {
+    wake_.notify_one();
+  }
+}
+
+void NetworkSink::_AppendTimestamp(
+    std::chrono::system_clock::time_point log_time) {
+  auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                    log_time.time_since_epoch())
+                    .count();
+  int64_t second = micros / 1000000;
+  if (second != timestamp_second_) {
+    std::time_t time = std::time_t(second);
+    std::tm utc_time;
+#ifdef OS_WINDOWS
+    gmtime_s(&utc_time, &time);
+#else
+    gmtime_r(&time, &utc_time);
+#endif  // OS_WINDOWS
+
+    char buffer[32];
+    std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &utc_time);
+    timestamp_ = buffer;
+    timestamp_second_ = second;
+  }
+
+  char fraction[16];
+  std::snprintf(fraction, sizeof(fraction), ".%06dZ",
+                int(micros - second * 1000000));
+  header_.append(timestamp_);
+  header_.append(fraction);
+}
+
+void NetworkSink::_Run() {
+  PinLoggerThread();
+  std::unique_lock<std::mutex> lock(lock_);
+  while (true) {
+    wake_.wait_for(lock, flush_interval_, [this] {
+      return stopping_ || urgent_ || pending_.length() >= kBatchSize;
+    });
+
+    if (pending_.empty()) {
+      if (stopping_) {
+        return;
+      }
+
+      continue;
+    }
+
+    sending_.swap(pending_);
+    uint64_t n_messages = n_pending_;
+    n_pending_ = 0;
+    urgent_ = false;
+
+    lock.unlock();
+    _Send(sending_, n_messages);
+    sending_.clear();
+    lock.lock();
+  }
+}
+
+void NetworkSink::_Send(const std::string& frames, uint64_t n_messages) {
+#ifdef OS_WINDOWS
+  dropped_->fetch_add(n_messages, std::memory_order_relaxed);
+#else
+  if (fd_ < 0) {
+    // Don't try to reconnect for every batch if the collector is down.
+    auto now = std::chrono::steady_clock::now();
+    if (last_connect_.time_since_epoch().count() == 0 ||
+        now - last_connect_ >= flush_interval_) {
+      last_connect_ = now;
+      fd_ = ConnectSocket(address_, stream_);
+      if (fd_ >= 0 && stream_) {
+        int enable = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        timeval timeout = {kSendTimeoutSeconds, 0};
+        setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+        setsockopt(fd_, SOL_SOCKET, SO_NOSIGPIPE, &enable, sizeof(enable));
+#endif  // SO_NOSIGPIPE
+      }
+    }
+
+    if (fd_ < 0) {
+      dropped_->fetch_add(n_messages, std::memory_order_relaxed);
+      return;
+    }
+  }
+
+  if (stream_) {
+    if (!_SendStream(frames)) {
+      dropped_->fetch_add(n_messages, std::memory_order_relaxed);
+      close(fd_);
+      fd_ = -1;
+    }
+  } else {
+    dropped_->fetch_add(_SendDatagrams(frames), std::memory_order_relaxed);
+  }
+#endif  // OS_WINDOWS
+}
+
+bool NetworkSink::_SendStream(const std::string& frames) {
+#ifdef OS_WINDOWS
+  return false;
+#else
+#ifdef MSG_NOSIGNAL
+  const int flags = MSG_NOSIGNAL;
+#else
+  const int flags = 0;
+#endif  // MSG_NOSIGNAL
+
+  // The frames are already octet-counted, so the whole buffer is written as
+  // is, in as few segments as the kernel likes. A blocking send() only writes
+  // less than it was given if it timed out, in which case the collector has
+  // stalled: give up on the connection rather than waiting again.
+  ScopedWriteTimer timer(counters_, frames.length());
+  ssize_t written;
+  do {
+    written = send(fd_, frames.data(), frames.length(), flags);
+  } while (written < 0 && errno == EINTR);
+
+  return written == ssize_t(frames.length());
+#endif  // OS_WINDOWS
+}
+
+uint64_t NetworkSink::_SendDatagrams(const std::string& frames) {
+#ifdef OS_WINDOWS
+  return 0;
+#else
+  // Each message goes in a datagram of its own, without its octet count.
+  uint64_t failed = 0;
+  iovec messages[kMaxDatagramsPerSend];
+  std::size_t pos = 0;
+  while (pos < frames.length()) {
+    std::size_t n_messages = 0, bytes = 0;
+    while (pos < frames.length() && n_messages < kMaxDatagramsPerSend) {
+      std::size_t length = _ReadFrameLength(frames, &pos);
+      messages[n_messages++] = {const_cast<char*>(frames.data() + pos),
+                                length};
+      bytes += length;
+      pos += length;
+    }
+
+    ScopedWriteTimer timer(counters_, bytes);
+#ifdef __linux__
+    mmsghdr headers[kMaxDatagramsPerSend];
+    std::memset(headers, 0, sizeof(headers));
+    for (std::size_t i = 0; i < n_messages; i++) {
+      headers[i].msg_hdr.msg_iov = &messages[i];
+      headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    std::size_t done = 0;
+    while (done < n_messages) {
+      int n_sent =
+          sendmmsg(fd_, headers + done, unsigned(n_messages - done), 0);
+      if (n_sent < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        // Skip the datagram which failed (e.g. too large, or nobody is
+        // listening yet) and carry on with the rest.
+        failed++;
+        done++;
+        continue;
+      }
+
+      done += std::size_t(n_sent);
+    }
+#else
+    for (std::size_t i = 0; i < n_messages; i++) {
+      if (send(fd_, messages[i].iov_base, messages[i].iov_len, 0) < 0) {
+        failed++;
+      }
+    }
+#endif  // __linux__
+  }
+
+  return failed;
+#endif  // OS_WINDOWS
+}
+
+}  // namespace internal
+
+}  // namespace cpplog
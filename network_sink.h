@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "stats.h"
+
+namespace cpplog {
+
+namespace internal {
+
+/**
+ * @brief      Open a socket connected to a host:port (or [ipv6]:port).
+ *
+ * @param[in]  address  The address to connect to.
+ * @param[in]  stream   Whether to open a TCP socket, rather than UDP.
+ *
+ * @return     The socket, or -1 if the address couldn't be resolved or
+ *             connected to.
+ */
+int ConnectSocket(const std::string& address, bool stream);
+
+/**
+ * @brief      Sends log lines to a syslog collector, as RFC 5424 messages
+ *             over UDP (one per datagram) or a persistent TCP connection
+ *             (framed by octet counting, as in RFC 6587).
+ *
+ * @details    Write() only appends the message to a bounded buffer, so a slow
+ *             or unreachable collector never holds up the caller: once the
+ *             buffer is full, new messages are dropped and counted. A thread
+ *             of the sink's own swaps the buffer out and sends it, as a
+ *             sendmmsg() of many datagrams or a single stream of TCP
+ *             segments, once a batch has built up, an urgent message arrives
+ *             or `flush_interval` has passed. A lost TCP connection is
+ *             reopened at most once per interval; the batch being sent when
+ *             it was lost is dropped.
+ *
+ *             Write() is thread-safe.
+ */
+class NetworkSink {
+ public:
+  /**
+   * @brief      Start sending to a collector.
+   *
+   * @param[in]  address         udp://host:port or tcp://host:port. Without
+   *                             a scheme, UDP is used.
+   * @param[in]  app_name        The APP-NAME to send in each message.
+   * @param[in]  facility        The syslog facility, e.g. 1 for user-level.
+   * @param[in]  max_buffered    The most bytes to hold for the collector.
+   * @param[in]  flush_interval  The longest to hold messages before sending.
+   * @param[in]  counters        Where to count writes, or nullptr.
+   * @param[in]  dropped         Where to count dropped messages.
+   */
+  NetworkSink(const std::string& address, const std::string& app_name,
+              uint32_t facility, std::size_t max_buffered,
+              std::chrono::milliseconds flush_interval,
+              SinkCounters* counters, std::atomic<uint64_t>* dropped);
+
+  /**
+   * @brief      Send anything buffered (if the collector can be reached), then
+   *             stop.
+   */
+  ~NetworkSink();
+
+  NetworkSink(const NetworkSink&) = delete;
+  NetworkSink& operator=(const NetworkSink&) = delete;
+
+  /**
+   * @brief      Queue a message to be sent.
+   *
+   * @param[in]  severity  The syslog severity, from 0 (emergency) to 7
+   *                       (debug). Messages of 3 (error) or lower are sent
+   *                       straight away.
+   * @param[in]  log_time  The time the message was logged.
+   * @param[in]  line      The message. A trailing newline is removed.
+   * @param[in]  length    The length of `line`.
+   */
+  void Write(int severity, std::chrono::system_clock::time_point log_time,
+             const char* line, std::size_t length);
+
+ private:
+  void _Run();
+  void _AppendTimestamp(std::chrono::system_clock::time_point log_time);
+  void _Send(const std::string& frames, uint64_t n_messages);
+  bool _SendStream(const std::string& frames);
+  uint64_t _SendDatagrams(const std::string& frames);
+
+  std::string address_;
+  bool stream_;
+  uint32_t facility_;
+  std::size_t max_buffered_;
+  std::chrono::milliseconds flush_interval_;
+  SinkCounters* counters_;
+  std::atomic<uint64_t>* dropped_;
+
+  /**
+   * The " HOSTNAME APP-NAME PROCID MSGID STRUCTURED-DATA " part of the header,
+   * which never changes.
+   */
+  std::string header_suffix_;
+
+  /**
+   * The socket to the collector (only used by the sending thread), or -1,
+   * and when it was last opened.
+   */
+  int fd_;
+  std::chrono::steady_clock::time_point last_connect_;
+
+  /**
+   * Framed messages waiting to be sent, and how many there are. The sending
+   * thread swaps these with `sending_` to send them without holding the lock.
+   */
+  std::string pending_, sending_;
+  uint64_t n_pending_;
+  bool urgent_;
+
+  /**
+   * The header being built by Write(), and its cached timestamp (to the
+   * second) so that gmtime() only runs once a second.
+   */
+  std::string header_;
+  int64_t timestamp_second_;
+  std::string timestamp_;
+
+  std::mutex lock_;
+  std::condition_variable wake_;
+  bool stopping_;
+  std::thread thread_;
+};
+
+}  // namespace internal
+
+}  // namespace cpplog
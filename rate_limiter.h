@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#ifdef __linux__
+#include <time.h>
+#endif  // __linux__
+
+#include "ring_buffer.h"
+
+namespace cpplog {
+
+namespace internal {
+
+/**
+ * @file
+ *
+ * Lock-free limiters for the LOG_FIRST, LOG_EVERY_N, LOG_EVERY and LOG_RATE
+ * macros. Each call site gets a static one, which is constant-initialized, so
+ * there is no static initialization guard to check on every call.
+ *
+ * The limiters which suppress messages count them, so that the next message
+ * through can say how many were missed. The count is kept on its own cache
+ * line, so that threads being suppressed don't slow down threads checking
+ * whether they are allowed through.
+ */
+
+/**
+ * @brief      The current time in nanoseconds, from a monotonic clock which is
+ *             cheap to read but might only be accurate to a few milliseconds.
+ */
+inline int64_t CoarseNowNs() {
+#ifdef CLOCK_MONOTONIC_COARSE
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif  // CLOCK_MONOTONIC_COARSE
+}
+
+/**
+ * @brief      Lets the first `n` messages through (LOG_FIRST). Once they have
+ *             been, each check is a single relaxed load.
+ */
+class FirstLimiter {
+ public:
+  constexpr FirstLimiter() : count_(0) {}
+
+  bool Allow(uint64_t n) {
+    return count_.load(std::memory_order_relaxed) < n &&
+           count_.fetch_add(1, std::memory_order_relaxed) < n;
+  }
+
+ private:
+  std::atomic<uint64_t> count_;
+};
+
+/**
+ * @brief      Lets every `n`th message through, starting with the first
+ *             (LOG_EVERY_N).
+ */
+class EveryNLimiter {
+ public:
+  constexpr EveryNLimiter() : count_(0) {}
+
+  /**
+   * @param[in]  n           Let one in this many messages through.
+   * @param[out] suppressed  The number of messages suppressed since the last
+   *                         one let through.
+   */
+  bool Allow(uint64_t n, uint64_t* suppressed) {
+    uint64_t count = count_.fetch_add(1, std::memory_order_relaxed);
+    if (n > 1 && count % n != 0) {
+      return false;
+    }
+
+    *suppressed = count == 0 || n <= 1 ? 0 : n - 1;
+    return true;
+  }
+
+ private:
+  std::atomic<uint64_t> count_;
+};
+
+/**
+ * @brief      Lets at most one message through per interval (LOG_EVERY).
+ *
+ * @details    The thread which finds the interval has passed claims the next
+ *             one with a CAS on the time it ends, so exactly one message gets
+ *             through however many threads are logging.
+ */
+class IntervalLimiter {
+ public:
+  constexpr IntervalLimiter() : next_ns_(0), suppressed_(0) {}
+
+  /**
+   * @param[in]  interval_ns  The minimum time between messages.
+   * @param[out] suppressed   The number of messages suppressed since the last
+   *                          one let through.
+   */
+  bool Allow(int64_t interval_ns, uint64_t* suppressed) {
+    int64_t now = CoarseNowNs();
+    int64_t next = next_ns_.load(std::memory_order_relaxed);
+    if (now < next ||
+        !next_ns_.compare_exchange_strong(next, now + interval_ns,
+                                          std::memory_order_relaxed)) {
+      suppressed_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    *suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+
+ private:
+  std::atomic<int64_t> next_ns_;
+  alignas(kCacheLineSize) std::atomic<uint64_t> suppressed_;
+};
+
+/**
+ * @brief      A token bucket which lets through `per_second` messages per
+ *             second on average, in bursts of up to `per_second` (LOG_RATE).
+ *
+ * @details    This is the generic cell rate algorithm, which is a token bucket
+ *             kept in a single atomic: the time at which the bucket will next
+ *             be full. Each message pushes that back by one interval, and is
+ *             only let through if it stays within a second of now.
+ */
+class RateLimiter {
+ public:
+  constexpr RateLimiter() : full_at_ns_(0), suppressed_(0) {}
+
+  /**
+   * @param[in]  per_second  The average number of messages to let through
+   *                         per second. If it isn't positive, every message
+   *                         is suppressed.
+   * @param[out] suppressed  The number of messages suppressed since the last
+   *                         one let through.
+   */
+  bool Allow(double per_second, uint64_t* suppressed) {
+    static const int64_t kSecondNs = 1000000000;
+    if (!(per_second > 0)) {
+      suppressed_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    // Cap the interval (at about 30 years) so that tiny rates can't overflow.
+    int64_t interval_ns = int64_t(std::min(kSecondNs / per_second, 1e18));
+    int64_t tolerance_ns = std::max<int64_t>(kSecondNs - interval_ns, 0);
+    int64_t now = CoarseNowNs();
+    int64_t full_at = full_at_ns_.load(std::memory_order_relaxed);
+    do {
+      if (full_at - now > tolerance_ns) {
+        suppressed_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    } while (!full_at_ns_.compare_exchange_weak(
+        full_at, std::max(full_at, now) + interval_ns,
+        std::memory_order_relaxed));
+
+    *suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+
+ private:
+  std::atomic<int64_t> full_at_ns_;
+  alignas(kCacheLineSize) std::atomic<uint64_t> suppressed_;
+};
+
+}  // namespace internal
+
+}  // namespace cpplog
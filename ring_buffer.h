@@ -0,0 +1,411 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif  // __linux__
+
+namespace cpplog {
+
+namespace internal {
+
+/**
+ * The size of a cache line. Anything written by different threads is kept at
+ * least this far apart to avoid false sharing.
+ */
+constexpr std::size_t kCacheLineSize = 64;
+
+/**
+ * @brief      The raw memory for a ring buffer's slots.
+ *
+ * @details    By default this comes from the heap, which might hand out memory
+ *             that some other thread has already touched, and so which the
+ *             kernel has already placed on that thread's NUMA node. With
+ *             `local_pages` (on Linux), it is mapped from fresh pages instead,
+ *             and they are faulted in straight away, so that they are placed
+ *             on the node of the thread creating the buffer.
+ */
+class SlotMemory {
+ public:
+  SlotMemory(std::size_t size, bool local_pages)
+      : data_(nullptr), size_(size), mapped_(false) {
+#ifdef __linux__
+    if (local_pages) {
+      void* pages = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+      if (pages != MAP_FAILED) {
+        data_ = static_cast<char*>(pages);
+        mapped_ = true;
+      }
+    }
+#endif  // __linux__
+
+    if (data_ == nullptr) {
+      data_ = new char[size_];
+    }
+  }
+
+  ~SlotMemory() {
+#ifdef __linux__
+    if (mapped_) {
+      munmap(data_, size_);
+      return;
+    }
+#endif  // __linux__
+
+    delete[] data_;
+  }
+
+  SlotMemory(const SlotMemory&) = delete;
+  SlotMemory& operator=(const SlotMemory&) = delete;
+
+  char* data() const { return data_; }
+
+ private:
+  char* data_;
+  std::size_t size_;
+  bool mapped_;
+};
+
+/**
+ * @brief      A bounded, lock-free queue.
+ *
+ * @details    This is Dmitry Vyukov's bounded MPMC queue. Each slot carries a
+ *             sequence number which tells producers and consumers whether the
+ *             slot is ready for them, so the only shared writes are a single
+ *             CAS on the head (producers) or tail (consumers).
+ *
+ *             Values are moved into and out of the slots, so the queue never
+ *             copies a message. Each slot is padded to a cache line.
+ *
+ *             Although only the emitter thread usually consumes, producers
+ *             are allowed to pop too (e.g. to evict the oldest message when
+ *             the queue is full).
+ *
+ * @tparam     T     The type of value to store. Must be move constructible.
+ */
+template <typename T>
+class RingBuffer {
+ public:
+  /**
+   * @brief      Create a new ring buffer.
+   *
+   * @param[in]  min_capacity  The minimum number of values to hold. This will
+   *                           be rounded up to the next power of two.
+   */
+  explicit RingBuffer(std::size_t min_capacity)
+      : capacity_(_RoundUpToPowerOfTwo(min_capacity)),
+        mask_(capacity_ - 1),
+        storage_(new char[sizeof(Slot) * capacity_ + kCacheLineSize]),
+        slots_(_Align(storage_.get())),
+        head_(0),
+        tail_(0) {
+    for (std::size_t i = 0; i < capacity_; i++) {
+      new (&slots_[i]) Slot();
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  ~RingBuffer() {
+    // Destroy anything which is still in the queue.
+    while (TryPop([](T&&) {})) {
+      ;
+    }
+
+    for (std::size_t i = 0; i < capacity_; i++) {
+      slots_[i].~Slot();
+    }
+  }
+
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+
+  /**
+   * @brief      Try to push a value into the queue.
+   *
+   * @param[in]  value  The value to push. It will only be moved from if this
+   *                    function returns true.
+   *
+   * @return     true if the value was pushed, false if the queue was full.
+   */
+  bool TryPush(T&& value) {
+    std::size_t pos = head_.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+      slot = &slots_[pos & mask_];
+      std::size_t seq = slot->sequence.load(std::memory_order_acquire);
+      std::ptrdiff_t diff = std::ptrdiff_t(seq) - std::ptrdiff_t(pos);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+
+    new (slot->value()) T(std::move(value));
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief      Try to pop a value from the queue.
+   *
+   * @param[in]  consume  Called with the popped value (as an rvalue) before it
+   *                      is destroyed.
+   *
+   * @return     true if a value was popped, false if the queue was empty.
+   */
+  template <typename Consumer>
+  bool TryPop(Consumer&& consume) {
+    std::size_t pos = tail_.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+      slot = &slots_[pos & mask_];
+      std::size_t seq = slot->sequence.load(std::memory_order_acquire);
+      std::ptrdiff_t diff = std::ptrdiff_t(seq) - std::ptrdiff_t(pos + 1);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+
+    T* value = slot->value();
+    consume(std::move(*value));
+    value->~T();
+    slot->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief      Get the number of values in the queue. This is only a snapshot
+   *             and might be out of date by the time it is returned.
+   */
+  std::size_t Size() const {
+    std::size_t tail = tail_.load(std::memory_order_acquire);
+    std::size_t head = head_.load(std::memory_order_acquire);
+    return head > tail ? head - tail : 0;
+  }
+
+  /**
+   * @brief      Whether or not the queue is (approximately) empty.
+   */
+  bool Empty() const { return Size() == 0; }
+
+  /**
+   * @brief      The maximum number of values the queue can hold.
+   */
+  std::size_t Capacity() const { return capacity_; }
+
+ private:
+  struct alignas(kCacheLineSize) Slot {
+    std::atomic<std::size_t> sequence;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+    T* value() { return reinterpret_cast<T*>(&storage); }
+  };
+
+  static std::size_t _RoundUpToPowerOfTwo(std::size_t n) {
+    std::size_t result = 2;
+    while (result < n) {
+      result <<= 1;
+    }
+
+    return result;
+  }
+
+  static Slot* _Align(char* ptr) {
+    auto address = reinterpret_cast<std::uintptr_t>(ptr);
+    address = (address + kCacheLineSize - 1) & ~(kCacheLineSize - 1);
+    return reinterpret_cast<Slot*>(address);
+  }
+
+  const std::size_t capacity_, mask_;
+
+  /**
+   * The raw memory for the slots. Over-aligned new isn't available before
+   * C++17, so the slots are placed at the first aligned address within this.
+   */
+  std::unique_ptr<char[]> storage_;
+  Slot* slots_;
+
+  /**
+   * The next position to push to and pop from. These are padded onto separate
+   * cache lines so that producers and the consumer don't fight over them (or
+   * over the read-only fields above). Padding is used rather than alignas so
+   * that the buffer itself doesn't need an over-aligned allocation.
+   */
+  char padding0_[kCacheLineSize];
+  std::atomic<std::size_t> head_;
+  char padding1_[kCacheLineSize - sizeof(std::atomic<std::size_t>)];
+  std::atomic<std::size_t> tail_;
+  char padding2_[kCacheLineSize - sizeof(std::atomic<std::size_t>)];
+};
+
+/**
+ * @brief      A bounded, lock-free, single-producer single-consumer queue.
+ *
+ * @details    Only one thread may push and only one (other) thread may pop.
+ *             Each side keeps a cached copy of the other side's position, so
+ *             in the common case a push or pop touches no cache line written
+ *             by the other thread.
+ *
+ * @tparam     T     The type of value to store. Must be move constructible.
+ */
+template <typename T>
+class SpscRingBuffer {
+ public:
+  /**
+   * @brief      Create a new ring buffer.
+   *
+   * @param[in]  min_capacity  The minimum number of values to hold. This will
+   *                           be rounded up to the next power of two.
+   * @param[in]  local_pages   Whether to place the slots on the NUMA node of
+   *                           the calling thread (see SlotMemory), which
+   *                           should be the producer.
+   */
+  explicit SpscRingBuffer(std::size_t min_capacity, bool local_pages = false)
+      : capacity_(_RoundUpToPowerOfTwo(min_capacity)),
+        mask_(capacity_ - 1),
+        memory_(sizeof(Slot) * capacity_, local_pages),
+        slots_(reinterpret_cast<Slot*>(memory_.data())),
+        head_(0),
+        cached_tail_(0),
+        tail_(0),
+        cached_head_(0) {}
+
+  ~SpscRingBuffer() {
+    // Destroy anything which is still in the queue.
+    while (TryPop([](T&&) {})) {
+      ;
+    }
+  }
+
+  SpscRingBuffer(const SpscRingBuffer&) = delete;
+  SpscRingBuffer& operator=(const SpscRingBuffer&) = delete;
+
+  /**
+   * @brief      Try to push a value into the queue. Must only be called from
+   *             the producer thread.
+   *
+   * @param[in]  value  The value to push. It will only be moved from if this
+   *                    function returns true.
+   *
+   * @return     true if the value was pushed, false if the queue was full.
+   */
+  bool TryPush(T&& value) {
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head - cached_tail_ >= capacity_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head - cached_tail_ >= capacity_) {
+        return false;
+      }
+    }
+
+    new (_Value(head)) T(std::move(value));
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief      Try to pop a value from the queue. Must only be called from
+   *             the consumer thread.
+   *
+   * @param[in]  consume  Called with the popped value (as an rvalue) before it
+   *                      is destroyed.
+   *
+   * @return     true if a value was popped, false if the queue was empty.
+   */
+  template <typename Consumer>
+  bool TryPop(Consumer&& consume) {
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == cached_head_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail == cached_head_) {
+        return false;
+      }
+    }
+
+    T* value = _Value(tail);
+    consume(std::move(*value));
+    value->~T();
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief      Get the number of values in the queue. This is only a snapshot
+   *             and might be out of date by the time it is returned.
+   */
+  std::size_t Size() const {
+    std::size_t tail = tail_.load(std::memory_order_acquire);
+    std::size_t head = head_.load(std::memory_order_acquire);
+    return head > tail ? head - tail : 0;
+  }
+
+  /**
+   * @brief      Whether or not the queue is (approximately) empty.
+   */
+  bool Empty() const { return Size() == 0; }
+
+  /**
+   * @brief      The maximum number of values the queue can hold.
+   */
+  std::size_t Capacity() const { return capacity_; }
+
+ private:
+  typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+  static std::size_t _RoundUpToPowerOfTwo(std::size_t n) {
+    std::size_t result = 2;
+    while (result < n) {
+      result <<= 1;
+    }
+
+    return result;
+  }
+
+  T* _Value(std::size_t pos) {
+    return reinterpret_cast<T*>(&slots_[pos & mask_]);
+  }
+
+  const std::size_t capacity_, mask_;
+  SlotMemory memory_;
+  Slot* slots_;
+
+  /**
+   * The producer's position (and its copy of the consumer's position), then
+   * the consumer's position (and its copy of the producer's position). Each
+   * pair is padded onto its own cache line.
+   */
+  char padding0_[kCacheLineSize];
+  std::atomic<std::size_t> head_;
+  std::size_t cached_tail_;
+  char padding1_[kCacheLineSize - sizeof(std::atomic<std::size_t>) -
+                 sizeof(std::size_t)];
+  std::atomic<std::size_t> tail_;
+  std::size_t cached_head_;
+  char padding2_[kCacheLineSize - sizeof(std::atomic<std::size_t>) -
+                 sizeof(std::size_t)];
+};
+
+}  // namespace internal
+
+}  // namespace cpplog
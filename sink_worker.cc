@@ -0,0 +1,141 @@
+#include "sink_worker.h"
+
+#include "cpu_affinity.h"
+
+namespace cpplog {
+
+namespace internal {
+
+namespace {
+
+/**
+ * The size of each chunk. Chunks are submitted once they are full (or at the
+ * end of each of the emitter's batches).
+ */
+constexpr std::size_t kChunkSize = 64 * 1024;
+
+}  // namespace
+
+SinkWorker::SinkWorker(WriteFunction write, IdleFunction idle,
+                       std::size_t max_chunks,
+                       std::chrono::milliseconds idle_interval, bool block)
+    : write_(write),
+      idle_(idle),
+      idle_interval_(idle_interval),
+      block_(block),
+      submitted_(max_chunks),
+      free_(max_chunks),
+      current_(nullptr),
+      stopping_(false),
+      n_submitted_(0),
+      n_written_(0) {
+  for (std::size_t i = 0; i < max_chunks; i++) {
+    chunks_.emplace_back(new Chunk());
+    chunks_.back()->data.reserve(kChunkSize);
+    Chunk* chunk = chunks_.back().get();
+    free_.TryPush(std::move(chunk));
+  }
+
+  thread_ = std::thread(&SinkWorker::_Run, this);
+}
+
+SinkWorker::~SinkWorker() {
+  Submit();
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stopping_.store(true, std::memory_order_release);
+  }
+
+  chunk_submitted_.notify_one();
+  thread_.join();
+}
+
+bool SinkWorker::Append(const char* data, std::size_t length,
+                        bool flush_now) {
+  // Start a new chunk rather than growing this one past its reserved size.
+  if (current_ != nullptr && !current_->data.empty() &&
+      current_->data.length() + length > kChunkSize) {
+    Submit();
+  }
+
+  while (current_ == nullptr &&
+         !free_.TryPop([this](Chunk*&& chunk) { current_ = chunk; })) {
+    // Every chunk is waiting to be written.
+    if (!block_) {
+      return false;
+    }
+
+    std::this_thread::yield();
+  }
+
+  current_->data.append(data, length);
+  current_->flush_now = current_->flush_now || flush_now;
+  return true;
+}
+
+void SinkWorker::Submit() {
+  if (current_ == nullptr) {
+    return;
+  }
+
+  // There are only as many chunks as there are slots, so this always fits.
+  submitted_.TryPush(std::move(current_));
+  current_ = nullptr;
+  n_submitted_.store(n_submitted_.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+
+  // Taking the lock makes sure the worker is either waiting (and will be
+  // woken) or will see the chunk before it waits.
+  { std::lock_guard<std::mutex> lock(lock_); }
+  chunk_submitted_.notify_one();
+}
+
+bool SinkWorker::WaitUntilWritten(
+    std::chrono::steady_clock::time_point deadline) {
+  Submit();
+  uint64_t n_submitted = n_submitted_.load(std::memory_order_relaxed);
+  while (n_written_.load(std::memory_order_acquire) < n_submitted) {
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  return true;
+}
+
+void SinkWorker::_Run() {
+  PinLoggerThread();
+  while (true) {
+    bool wrote = false;
+    while (submitted_.TryPop([this](Chunk*&& chunk) {
+      write_(chunk->data.data(), chunk->data.length(), chunk->flush_now);
+      chunk->data.clear();
+      chunk->flush_now = false;
+      free_.TryPush(std::move(chunk));
+      n_written_.fetch_add(1, std::memory_order_release);
+    })) {
+      wrote = true;
+    }
+
+    if (wrote) {
+      continue;
+    }
+
+    idle_();
+
+    std::unique_lock<std::mutex> lock(lock_);
+    if (stopping_.load(std::memory_order_acquire) && submitted_.Empty()) {
+      return;
+    }
+
+    chunk_submitted_.wait_for(lock, idle_interval_, [this] {
+      return stopping_.load(std::memory_order_acquire) || !submitted_.Empty();
+    });
+  }
+}
+
+}  // namespace internal
+
+}  // namespace cpplog
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ring_buffer.h"
+
+namespace cpplog {
+
+namespace internal {
+
+/**
+ * @brief      A thread which writes rendered lines to a single destination
+ *             (e.g. stderr or one log file), so that a slow destination
+ *             doesn't hold up the others.
+ *
+ * @details    Lines are appended to a chunk, and whole chunks are handed to
+ *             the worker through an SPSC queue. Written chunks come back
+ *             through another queue and are reused, so once warmed up nothing
+ *             is allocated.
+ *
+ *             Append() and Submit() must only be called from one thread (the
+ *             emitter).
+ */
+class SinkWorker {
+ public:
+  /**
+   * Writes a chunk of lines to the destination. `flush_now` is set if any of
+   * the lines needs to be written out right away.
+   */
+  typedef std::function<void(const char* data, std::size_t length,
+                             bool flush_now)>
+      WriteFunction;
+
+  /**
+   * Called whenever the worker has nothing to do, at least once per idle
+   * interval (e.g. to flush buffers).
+   */
+  typedef std::function<void()> IdleFunction;
+
+  /**
+   * @brief      Start a worker.
+   *
+   * @param[in]  write          Writes to the destination. Only ever called
+   *                            from the worker's thread.
+   * @param[in]  idle           Called from the worker's thread when idle.
+   * @param[in]  max_chunks     The number of chunks which can be in flight.
+   * @param[in]  idle_interval  How often to call `idle` when there's nothing
+   *                            to write.
+   * @param[in]  block          What to do when all chunks are in flight:
+   *                            wait for the worker if true, or drop lines if
+   *                            false.
+   */
+  SinkWorker(WriteFunction write, IdleFunction idle, std::size_t max_chunks,
+             std::chrono::milliseconds idle_interval, bool block);
+
+  /**
+   * @brief      Write everything which has been submitted, then stop.
+   */
+  ~SinkWorker();
+
+  SinkWorker(const SinkWorker&) = delete;
+  SinkWorker& operator=(const SinkWorker&) = delete;
+
+  /**
+   * @brief      Add a line to the current chunk. The chunk is submitted once it
+   *             is large enough.
+   *
+   * @return     false if the line was dropped because every chunk is still
+   *             waiting to be written (only when not blocking).
+   */
+  bool Append(const char* data, std::size_t length, bool flush_now);
+
+  /**
+   * @brief      Hand the current chunk (if any) to the worker.
+   */
+  void Submit();
+
+  /**
+   * @brief      Wait for the worker to write everything which has been
+   *             submitted so far (e.g. before the program exits on a FATAL
+   *             message). Must be called from the thread which submits.
+   *
+   * @param[in]  deadline  When to give up waiting.
+   *
+   * @return     true if everything was written, false if the deadline passed.
+   */
+  bool WaitUntilWritten(std::chrono::steady_clock::time_point deadline);
+
+ private:
+  struct Chunk {
+    std::string data;
+    bool flush_now = false;
+  };
+
+  void _Run();
+
+  WriteFunction write_;
+  IdleFunction idle_;
+  std::chrono::milliseconds idle_interval_;
+  bool block_;
+
+  std::vector<std::unique_ptr<Chunk>> chunks_;
+  SpscRingBuffer<Chunk*> submitted_, free_;
+  Chunk* current_;
+
+  std::mutex lock_;
+  std::condition_variable chunk_submitted_;
+  std::atomic<bool> stopping_;
+  std::thread thread_;
+
+  /**
+   * The number of chunks submitted (written only by the submitting thread)
+   * and written (only by the worker).
+   */
+  std::atomic<uint64_t> n_submitted_, n_written_;
+};
+
+}  // namespace internal
+
+}  // namespace cpplog
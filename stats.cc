@@ -0,0 +1,258 @@
+#include "stats.h"
+
+#include <cstdio>
+#include <string>
+
+#include "log.h"
+
+namespace cpplog {
+
+namespace {
+
+const char* const kLevelNames[] = {"trace",   "debug", "info",
+                                   "warning", "error", "fatal"};
+
+/**
+ * @brief      Format a number for Prometheus, e.g. a bucket bound in seconds.
+ */
+std::string _FormatDouble(double value) {
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+  return buffer;
+}
+
+void _AppendHeader(const std::string& name, const char* type,
+                   const char* help, std::string* out) {
+  *out += "# HELP " + name + " " + help + "\n";
+  *out += "# TYPE " + name + " " + type + "\n";
+}
+
+void _AppendSample(const std::string& name, const std::string& labels,
+                   const std::string& value, std::string* out) {
+  *out += name;
+  if (!labels.empty()) {
+    *out += "{" + labels + "}";
+  }
+
+  *out += " " + value + "\n";
+}
+
+void _AppendPerLevel(const std::string& name, const char* help,
+                     const std::array<uint64_t, internal::N_LEVELS>& counts,
+                     std::string* out) {
+  _AppendHeader(name, "counter", help, out);
+  for (int i = 0; i < internal::N_LEVELS; i++) {
+    _AppendSample(name, std::string("level=\"") + kLevelNames[i] + "\"",
+                  std::to_string(counts[i]), out);
+  }
+}
+
+/**
+ * @brief      Append a histogram's samples (without a header). Values are
+ *             multiplied by `scale`, e.g. to turn nanoseconds into seconds.
+ */
+void _AppendHistogram(const std::string& name, const std::string& labels,
+                      const Histogram& histogram, double scale,
+                      std::string* out) {
+  std::string prefix = labels.empty() ? "" : labels + ",";
+  uint64_t cumulative = 0;
+  for (std::size_t i = 0; i + 1 < Histogram::kBuckets; i++) {
+    cumulative += histogram.buckets[i];
+    double bound = i == 0 ? 0 : double(uint64_t(1) << i) * scale;
+    _AppendSample(name + "_bucket",
+                  prefix + "le=\"" + _FormatDouble(bound) + "\"",
+                  std::to_string(cumulative), out);
+  }
+
+  _AppendSample(name + "_bucket", prefix + "le=\"+Inf\"",
+                std::to_string(histogram.count), out);
+  _AppendSample(name + "_sum", labels, _FormatDouble(histogram.sum * scale),
+                out);
+  _AppendSample(name + "_count", labels, std::to_string(histogram.count), out);
+}
+
+/**
+ * @brief      The sinks in Stats, with the names used for them in metrics.
+ */
+std::array<std::pair<const char*, const SinkStats*>, 4> _Sinks(
+    const Stats& stats) {
+  return {{std::make_pair("stderr", &stats.stderr_output),
+           std::make_pair("files", &stats.log_files),
+           std::make_pair("binary", &stats.binary_log),
+           std::make_pair("network", &stats.network)}};
+}
+
+/**
+ * @brief      Get what was recorded in a histogram since an earlier snapshot
+ *             of it. The maximum can't be recovered, so it is kept.
+ */
+Histogram _HistogramSince(const Histogram& now, const Histogram* before) {
+  Histogram since = now;
+  if (before != nullptr) {
+    for (std::size_t i = 0; i < Histogram::kBuckets; i++) {
+      since.buckets[i] -= before->buckets[i];
+    }
+
+    since.count -= before->count;
+    since.sum -= before->sum;
+  }
+
+  return since;
+}
+
+}  // namespace
+
+uint64_t Histogram::Percentile(double percentile) const {
+  uint64_t rank = uint64_t(percentile / 100 * count);
+  uint64_t seen = 0;
+  for (std::size_t i = 0; i < kBuckets; i++) {
+    seen += buckets[i];
+    if (seen > rank) {
+      uint64_t bound = i == 0 ? 0 : (uint64_t(1) << i) - 1;
+      return bound < max ? bound : max;
+    }
+  }
+
+  return max;
+}
+
+std::string StatsToPrometheus(const Stats& stats) {
+  std::string out;
+  _AppendPerLevel("cpplog_messages_enqueued_total",
+                  "Messages queued for the async emitter.", stats.enqueued,
+                  &out);
+  _AppendPerLevel("cpplog_messages_emitted_total",
+                  "Messages written to at least one output.", stats.emitted,
+                  &out);
+  _AppendPerLevel("cpplog_messages_dropped_total",
+                  "Messages dropped because the async queue was full.",
+                  stats.dropped, &out);
+  _AppendPerLevel("cpplog_messages_shed_total",
+                  "Messages shed because the async queue was filling up.",
+                  stats.shed, &out);
+
+  _AppendHeader("cpplog_queue_size", "gauge",
+                "Messages waiting in the async queue.", &out);
+  _AppendSample("cpplog_queue_size", "", std::to_string(stats.queue_size),
+                &out);
+  _AppendHeader("cpplog_queue_capacity", "gauge",
+                "The capacity of the async queue.", &out);
+  _AppendSample("cpplog_queue_capacity", "",
+                std::to_string(stats.queue_capacity), &out);
+  _AppendHeader("cpplog_queue_high_water", "gauge",
+                "The most messages the emitter has found queued.", &out);
+  _AppendSample("cpplog_queue_high_water", "",
+                std::to_string(stats.queue_high_water), &out);
+
+  _AppendHeader("cpplog_producer_waits_total", "counter",
+                "Messages whose producer waited for space in the queue.",
+                &out);
+  _AppendSample("cpplog_producer_waits_total", "",
+                std::to_string(stats.producer_waits), &out);
+  _AppendHeader("cpplog_producer_wait_seconds_total", "counter",
+                "Time producers spent waiting for space in the queue.", &out);
+  _AppendSample("cpplog_producer_wait_seconds_total", "",
+                _FormatDouble(stats.producer_wait_ns * 1e-9), &out);
+  _AppendHeader("cpplog_sink_lines_dropped_total", "counter",
+                "Lines dropped because an output's thread fell behind.", &out);
+  _AppendSample("cpplog_sink_lines_dropped_total", "",
+                std::to_string(stats.sink_lines_dropped), &out);
+
+  _AppendHeader("cpplog_emit_batch_size", "histogram",
+                "The number of messages in each of the emitter's batches.",
+                &out);
+  _AppendHistogram("cpplog_emit_batch_size", "", stats.batch_sizes, 1, &out);
+
+  _AppendHeader("cpplog_sink_writes_total", "counter",
+                "Write calls made to each kind of output.", &out);
+  for (const auto& sink : _Sinks(stats)) {
+    _AppendSample("cpplog_sink_writes_total",
+                  std::string("sink=\"") + sink.first + "\"",
+                  std::to_string(sink.second->writes), &out);
+  }
+
+  _AppendHeader("cpplog_sink_bytes_total", "counter",
+                "Bytes written to each kind of output.", &out);
+  for (const auto& sink : _Sinks(stats)) {
+    _AppendSample("cpplog_sink_bytes_total",
+                  std::string("sink=\"") + sink.first + "\"",
+                  std::to_string(sink.second->bytes), &out);
+  }
+
+  _AppendHeader("cpplog_sink_rotations_total", "counter",
+                "Log file rotations for each kind of output.", &out);
+  for (const auto& sink : _Sinks(stats)) {
+    _AppendSample("cpplog_sink_rotations_total",
+                  std::string("sink=\"") + sink.first + "\"",
+                  std::to_string(sink.second->rotations), &out);
+  }
+
+  _AppendHeader("cpplog_sink_write_seconds", "histogram",
+                "How long each write to an output took.", &out);
+  for (const auto& sink : _Sinks(stats)) {
+    _AppendHistogram("cpplog_sink_write_seconds",
+                     std::string("sink=\"") + sink.first + "\"",
+                     sink.second->write_latency_ns, 1e-9, &out);
+  }
+
+  return out;
+}
+
+std::string StatsToStatsd(const Stats& stats, const Stats* previous,
+                          const std::string& prefix) {
+  std::string out;
+  auto counter = [&out, &prefix](const std::string& name, uint64_t now,
+                                 uint64_t before) {
+    out += prefix + "." + name + ":" + std::to_string(now - before) + "|c\n";
+  };
+  auto gauge = [&out, &prefix](const std::string& name, uint64_t value) {
+    out += prefix + "." + name + ":" + std::to_string(value) + "|g\n";
+  };
+
+  static const Stats kZero = Stats();
+  const Stats& before = previous == nullptr ? kZero : *previous;
+  for (int i = 0; i < internal::N_LEVELS; i++) {
+    std::string level = kLevelNames[i];
+    counter("messages.enqueued." + level, stats.enqueued[i],
+            before.enqueued[i]);
+    counter("messages.emitted." + level, stats.emitted[i], before.emitted[i]);
+    counter("messages.dropped." + level, stats.dropped[i], before.dropped[i]);
+    counter("messages.shed." + level, stats.shed[i], before.shed[i]);
+  }
+
+  gauge("queue.size", stats.queue_size);
+  gauge("queue.capacity", stats.queue_capacity);
+  gauge("queue.high_water", stats.queue_high_water);
+  counter("producer.waits", stats.producer_waits, before.producer_waits);
+  counter("producer.wait_ns", stats.producer_wait_ns, before.producer_wait_ns);
+  counter("sink.lines_dropped", stats.sink_lines_dropped,
+          before.sink_lines_dropped);
+  counter("emit.batches", stats.batches.batches, before.batches.batches);
+  counter("emit.messages", stats.batches.messages, before.batches.messages);
+  gauge("emit.max_batch_size", stats.batches.max_batch_size);
+
+  // Latencies are summarized over the interval.
+  auto previous_sinks = _Sinks(before);
+  auto sinks = _Sinks(stats);
+  for (std::size_t i = 0; i < sinks.size(); i++) {
+    std::string name = std::string("sink.") + sinks[i].first + ".";
+    const SinkStats& now = *sinks[i].second;
+    const SinkStats& then = *previous_sinks[i].second;
+    counter(name + "writes", now.writes, then.writes);
+    counter(name + "bytes", now.bytes, then.bytes);
+    counter(name + "rotations", now.rotations, then.rotations);
+
+    Histogram latency = _HistogramSince(
+        now.write_latency_ns,
+        previous == nullptr ? nullptr : &then.write_latency_ns);
+    if (latency.count > 0) {
+      gauge(name + "write_ns.p50", latency.Percentile(50));
+      gauge(name + "write_ns.p99", latency.Percentile(99));
+      gauge(name + "write_ns.max", latency.max);
+    }
+  }
+
+  return out;
+}
+
+}  // namespace cpplog
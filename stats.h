@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace cpplog {
+
+/**
+ * @brief      A snapshot of a histogram with power-of-two buckets: bucket 0
+ *             counts zeros, and bucket `i` counts values in [2^(i-1), 2^i).
+ *             The last bucket also counts anything larger.
+ */
+struct Histogram {
+  static constexpr std::size_t kBuckets = 40;
+
+  std::array<uint64_t, kBuckets> buckets;
+
+  /**
+   * The number of values recorded, their total and the largest.
+   */
+  uint64_t count, sum, max;
+
+  /**
+   * @brief      Estimate a percentile (0-100), as the upper bound of the
+   *             bucket it falls in (or the maximum, if that is smaller).
+   */
+  uint64_t Percentile(double percentile) const;
+};
+
+/**
+ * @brief      Statistics about the writes made to one kind of destination.
+ */
+struct SinkStats {
+  /**
+   * The number of write calls made, and the number of bytes they wrote.
+   */
+  uint64_t writes, bytes;
+
+  /**
+   * The number of times files were rotated.
+   */
+  uint64_t rotations;
+
+  /**
+   * How long each write took, in nanoseconds.
+   */
+  Histogram write_latency_ns;
+};
+
+namespace internal {
+
+/**
+ * @brief      A Histogram which can be recorded into from several threads at
+ *             once without locking. Zero-initialized as a global.
+ */
+class AtomicHistogram {
+ public:
+  void Record(uint64_t value) {
+    std::size_t bucket = 0;
+    if (value > 0) {
+      bucket = std::size_t(64 - __builtin_clzll(value));
+      if (bucket >= Histogram::kBuckets) {
+        bucket = Histogram::kBuckets - 1;
+      }
+    }
+
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (value > max &&
+           !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  /**
+   * @brief      Copy the histogram. Values recorded while this is running
+   *             might only be partly included.
+   */
+  void Snapshot(Histogram* out) const {
+    out->count = 0;
+    for (std::size_t i = 0; i < Histogram::kBuckets; i++) {
+      out->buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+      out->count += out->buckets[i];
+    }
+
+    out->sum = sum_.load(std::memory_order_relaxed);
+    out->max = max_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::array<std::atomic<uint64_t>, Histogram::kBuckets> buckets_;
+  std::atomic<uint64_t> sum_, max_;
+};
+
+/**
+ * @brief      The counters behind a SinkStats. Shared by every file of the
+ *             same kind, which might be written by different threads.
+ */
+struct SinkCounters {
+  std::atomic<uint64_t> writes, bytes, rotations;
+  AtomicHistogram write_latency_ns;
+
+  void Snapshot(SinkStats* out) const {
+    out->writes = writes.load(std::memory_order_relaxed);
+    out->bytes = bytes.load(std::memory_order_relaxed);
+    out->rotations = rotations.load(std::memory_order_relaxed);
+    write_latency_ns.Snapshot(&out->write_latency_ns);
+  }
+};
+
+/**
+ * @brief      Times a write for the lifetime of the object, and records it in
+ *             a sink's counters (if there are any) when it goes out of scope.
+ */
+class ScopedWriteTimer {
+ public:
+  ScopedWriteTimer(SinkCounters* counters, std::size_t bytes)
+      : counters_(counters), bytes_(bytes) {
+    if (counters_ != nullptr) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~ScopedWriteTimer() {
+    if (counters_ == nullptr) {
+      return;
+    }
+
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    counters_->writes.fetch_add(1, std::memory_order_relaxed);
+    counters_->bytes.fetch_add(bytes_, std::memory_order_relaxed);
+    counters_->write_latency_ns.Record(uint64_t(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+            .count()));
+  }
+
+  ScopedWriteTimer(const ScopedWriteTimer&) = delete;
+  ScopedWriteTimer& operator=(const ScopedWriteTimer&) = delete;
+
+ private:
+  SinkCounters* counters_;
+  std::size_t bytes_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace internal
+
+}  // namespace cpplog
@@ -0,0 +1,133 @@
+#include "stats_reporter.h"
+
+#include <cstdio>
+
+#ifndef OS_WINDOWS
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif  // OS_WINDOWS
+
+#include "network_sink.h"
+
+namespace cpplog {
+
+namespace internal {
+
+namespace {
+
+/**
+ * The largest StatsD packet to send. Lines are grouped into packets up to this
+ * size, which fits in a typical MTU.
+ */
+constexpr std::size_t kMaxStatsdPacket = 1432;
+
+}  // namespace
+
+StatsReporter::StatsReporter(std::chrono::milliseconds interval,
+                             const std::string& path,
+                             const std::string& statsd_address,
+                             const std::string& statsd_prefix)
+    : interval_(interval),
+      path_(path),
+      statsd_prefix_(statsd_prefix),
+      statsd_fd_(-1),
+      has_previous_(false),
+      stopping_(false) {
+  if (!statsd_address.empty()) {
+    statsd_fd_ = ConnectSocket(statsd_address, false);
+  }
+
+  thread_ = std::thread(&StatsReporter::_Run, this);
+}
+
+StatsReporter::~StatsReporter() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stopping_ = true;
+  }
+
+  stop_requested_.notify_one();
+  thread_.join();
+  _Report();
+
+#ifndef OS_WINDOWS
+  if (statsd_fd_ >= 0) {
+    close(statsd_fd_);
+  }
+#endif  // OS_WINDOWS
+}
+
+void StatsReporter::_Run() {
+  std::unique_lock<std::mutex> lock(lock_);
+  while (!stop_requested_.wait_for(lock, interval_,
+                                   [this] { return stopping_; })) {
+    lock.unlock();
+    _Report();
+    lock.lock();
+  }
+}
+
+void StatsReporter::_Report() {
+  Stats stats = GetStats();
+  if (!path_.empty()) {
+    _WriteFile(StatsToPrometheus(stats));
+  }
+
+  if (statsd_fd_ >= 0) {
+    _SendStatsd(
+        StatsToStatsd(stats, has_previous_ ? &previous_ : nullptr,
+                      statsd_prefix_));
+    previous_ = stats;
+    has_previous_ = true;
+  }
+}
+
+void StatsReporter::_WriteFile(const std::string& text) {
+  // Write a temporary file and rename it over the old one, so that readers
+  // never see a partly written file.
+  std::string temp_path = path_ + ".tmp";
+  std::FILE* file = std::fopen(temp_path.c_str(), "w");
+  if (file == nullptr) {
+    return;
+  }
+
+  bool written = std::fwrite(text.data(), 1, text.length(), file) ==
+                 text.length();
+  if (std::fclose(file) != 0 || !written) {
+    std::remove(temp_path.c_str());
+    return;
+  }
+
+  std::rename(temp_path.c_str(), path_.c_str());
+}
+
+void StatsReporter::_SendStatsd(const std::string& lines) {
+#ifndef OS_WINDOWS
+  // Send whole lines, as many as fit in each packet. Errors are ignored: the
+  // next report will have up to date gauges anyway.
+  std::size_t start = 0;
+  while (start < lines.length()) {
+    std::size_t end = start;
+    while (end < lines.length()) {
+      std::size_t line_end = lines.find('\n', end);
+      line_end = line_end == std::string::npos ? lines.length() : line_end + 1;
+      if (line_end - start > kMaxStatsdPacket && end > start) {
+        break;
+      }
+
+      end = line_end;
+    }
+
+    if (send(statsd_fd_, lines.data() + start, end - start, 0) < 0) {
+      // Nothing sensible to do; the server might not be up yet.
+    }
+
+    start = end;
+  }
+#endif  // OS_WINDOWS
+}
+
+}  // namespace internal
+
+}  // namespace cpplog
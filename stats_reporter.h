@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "log.h"
+
+namespace cpplog {
+
+namespace internal {
+
+/**
+ * @brief      A thread which periodically writes the logger's statistics to a
+ *             Prometheus text file and/or sends them to StatsD over UDP
+ *             (--log_stats_*).
+ */
+class StatsReporter {
+ public:
+  /**
+   * @brief      Start reporting.
+   *
+   * @param[in]  interval        How often to report.
+   * @param[in]  path            The file to write in the Prometheus text
+   *                             format, or empty. It is replaced atomically
+   *                             (by renaming a temporary file over it).
+   * @param[in]  statsd_address  The host:port to send StatsD lines to, or
+   *                             empty.
+   * @param[in]  statsd_prefix   The prefix for StatsD metric names.
+   */
+  StatsReporter(std::chrono::milliseconds interval, const std::string& path,
+                const std::string& statsd_address,
+                const std::string& statsd_prefix);
+
+  /**
+   * @brief      Report one last time, then stop.
+   */
+  ~StatsReporter();
+
+  StatsReporter(const StatsReporter&) = delete;
+  StatsReporter& operator=(const StatsReporter&) = delete;
+
+ private:
+  void _Run();
+  void _Report();
+  void _WriteFile(const std::string& text);
+  void _SendStatsd(const std::string& lines);
+
+  std::chrono::milliseconds interval_;
+  std::string path_;
+  std::string statsd_prefix_;
+
+  /**
+   * A connected UDP socket for StatsD, or -1.
+   */
+  int statsd_fd_;
+
+  /**
+   * The statistics last sent to StatsD, which counters are sent relative to.
+   */
+  Stats previous_;
+  bool has_previous_;
+
+  std::mutex lock_;
+  std::condition_variable stop_requested_;
+  bool stopping_;
+  std::thread thread_;
+};
+
+}  // namespace internal
+
+}  // namespace cpplog